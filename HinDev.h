@@ -24,10 +24,19 @@
 #include <hardware/gralloc.h>
 #include <hardware/tv_input.h>
 #include <map>
+#include <deque>
+#include <atomic>
+#include <algorithm>
 #include "TvDeviceV4L2Event.h"
 #include "sideband/RTSidebandWindow.h"
 #include "common/RgaCropScale.h"
+#include "common/FormatNegotiator.h"
+#include "common/FramePipeline.h"
 #include "common/HandleImporter.h"
+#include "common/TimingCache.h"
+#include "common/Prewarmer.h"
+#include "common/DeviceDiscovery.h"
+#include "common/Teardown.h"
 #include "common/rk_hdmirx_config.h"
 #include <rkpq.h>
 #include "rkiep.h"
@@ -41,6 +50,18 @@
 
 using namespace android;
 using ::android::tvinput::RgaCropScale;
+using ::android::tvinput::FormatNegotiator;
+using ::android::tvinput::FORMAT_CONSUMER_DISPLAY;
+using ::android::tvinput::FORMAT_CONSUMER_PQ;
+using ::android::tvinput::FORMAT_CONSUMER_RECORD;
+using ::android::tvinput::FORMAT_CONSUMER_PREVIEW;
+using ::android::tvinput::FramePipeline;
+using ::android::tvinput::EventReactor;
+using ::android::tvinput::TimingCache;
+using ::android::tvinput::Prewarmer;
+using ::android::tvinput::DeviceDiscovery;
+using ::android::tvinput::Teardown;
+using ::android::tvinput::tv_timing_t;
 
 typedef struct source_buffer_info {
     buffer_handle_t source_buffer_handle_t;
@@ -52,7 +73,7 @@ typedef struct source_buffer_info {
 struct HinNodeInfo {
     struct v4l2_capability cap;
     struct v4l2_format format;
-    struct v4l2_plane planes[SIDEBAND_WINDOW_BUFF_CNT];
+    struct v4l2_plane planes[SIDEBAND_WINDOW_BUFF_CNT][VIDEO_MAX_PLANES];
     struct v4l2_buffer onceBuff;
     struct v4l2_requestbuffers reqBuf;
     struct v4l2_buffer bufferArray[SIDEBAND_WINDOW_BUFF_CNT];
@@ -62,6 +83,7 @@ struct HinNodeInfo {
 //    unsigned refcount[SIDEBAND_WINDOW_BUFF_CNT];
     int currBufferHandleFd;
     int currBufferHandleIndex;
+    int numPlanes;
     bool isStreaming;
     int width;
     int height;
@@ -83,8 +105,24 @@ typedef struct tv_pq_buffer_info {
     buffer_handle_t srcHandle = NULL;
     buffer_handle_t outHandle;
     bool isFilled;
+    // v4l2 index behind srcHandle while pq holds a reference on it
+    int srcIndex = -1;
 } tv_pq_buffer_info_t;
 
+// holders of a captured sideband buffer, see acquireFrame()/releaseFrame()
+enum FrameOwner {
+    FRAME_OWNER_DRIVER  = 0x1,
+    FRAME_OWNER_CAPTURE = 0x2,
+    FRAME_OWNER_DISPLAY = 0x4,
+    FRAME_OWNER_PQ      = 0x8,
+    FRAME_OWNER_RECORD  = 0x10,
+};
+
+typedef struct tv_frame_ref {
+    int refs;
+    uint32_t owners;
+} tv_frame_ref_t;
+
 enum State {
     START,
     PAUSE,
@@ -95,10 +133,13 @@ enum State {
 typedef struct tv_preview_buff_app {
     int bufferFd;
     uint64_t bufferId;
+    ino_t inode;
     // buffer_handle_t rawHandle;
     buffer_handle_t outHandle;
     bool isRendering;
     bool isFilled;
+    // the driver holds the slot between QBUF and DQBUF
+    bool isQueued;
 } tv_preview_buff_app_t;
 
 // typedef struct tv_input_preview_buff {
@@ -131,18 +172,34 @@ class HinDevImpl {
         ~HinDevImpl();
         int init(int id,int type);
         int findDevice(int id, int& initWidth, int& initHeight,int& initFormat);
+        // fd of |path| if it is the hdmirx capture node, -1 otherwise
+        int openHdmiNode(const char* path);
+        // starts bringing up the display, rga, pq and encoder contexts
+        void prewarm();
         int start();
+        // TIMED_OUT when threads didn't quit in time: they still use this
+        // object, which then has to be leaked rather than deleted
         int stop();
+        // re-reads the source format and restarts capture in place, keeping
+        // the threads, display state and buffers that still fit
+        int reconfigure();
         int pause();
 	int get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int& initFormat);
+        bool negotiateFormat(int &hdmi_in_width, int &hdmi_in_height, int& initFormat, uint32_t consumers);
         int set_format(int width = 640, int height = 480, int color_format = V4L2_PIX_FMT_NV21);
         int get_HdmiIn(bool enforce);
+        uint32_t getFormatConsumers();
         int set_rotation(int degree);
         int set_crop(int x, int y, int width, int height);
+        int set_preview_scale(int width, int height);
         int get_hin_crop(int *x, int *y, int *width, int *height);
         int set_hin_crop(int x, int y, int width, int height);
         int set_preview_info(int top, int left, int width, int height);
         int set_preview_buffer(buffer_handle_t rawHandle, uint64_t bufferId);
+        // called with mPreviewLock held
+        int findPreviewSlot(uint64_t bufferId);
+        int pickPreviewSlot();
+        void setPreviewSlot(int slot, buffer_handle_t outHandle, int bufferFd, ino_t inode, uint64_t bufferId);
         int aquire_buffer();
         // int inc_buffer_refcount(int* ptr);
         int release_buffer();
@@ -159,6 +216,7 @@ class HinDevImpl {
         int request_capture(buffer_handle_t rawHandle, uint64_t bufferId);
         bool check_zme(int src_width, int src_height, int* dst_width, int* dst_height);
         int check_interlaced();
+        bool check_plane_payload(struct v4l2_buffer *buf);
         void set_interlaced(int interlaced);
 
         const tv_input_callback_ops_t* mTvInputCB;
@@ -170,19 +228,50 @@ class HinDevImpl {
         int workThread();
         int pqBufferThread();
         int iepBufferThread();
+        int convertThread();
         int getPqFmt(int V4L2Fmt);
         // int previewBuffThread();
         int makeHwcSidebandHandle();
         void debugShowFPS();
         void wrapCaptureResultAndNotify(uint64_t buffId, buffer_handle_t handle);
+        // a requested capture that will never be filled, also valid once stopped
+        void notifyCaptureFailed();
+        // fails every request still waiting for start()
+        void failPendingCaptures();
         void doRecordCmd(const map<string, string> data);
         void doPQCmd(const map<string, string> data);
         int getRecordBufferFd(int previewHandlerIndex);
         int init_encodeserver(MppEncodeServer::MetaInfo* info);
     void deinit_encodeserver();
         void stopRecord();
+        // gives up a stop() whose threads didn't quit in time, see stop()
+        int abandonStop(const Teardown& teardown);
+        void allocPqBuffers();
+        void releasePqBuffers();
+        void allocIepBuffers();
+        void releaseIepBuffers();
+        void checkPqIdle();
+        void prefetchStandbySets();
+        void resetFrameRefs();
+        void acquireFrame(int index, uint32_t owner);
+        void releaseFrame(int index, uint32_t owner);
+        int countFrames(uint32_t owner);
+        void setDisplayFrame(int index);
+        void dumpFrameRefs(std::string* out);
+        int applyFormat(int width, int height);
+        void buildPipeline();
+        int stageFlushCache(int index);
+        int stageQueuePq(int index);
+        int stageShow(int index);
+        int stageRecord(int index);
         void buffDataTransfer(buffer_handle_t srcHandle, int srcFmt, int srcWidth, int srcHeight,
             buffer_handle_t dstHandle, int dstFmt, int dstWidth, int dstHeight, int dstWStride, int dstHStride);
+        void updatePreviewConvert();
+        int abortReconfigure(int err);
+        // the app asked for a downscaled producer stream, see set_preview_scale
+        bool scalesPreview() const { return mPreviewScaleWidth > 0; }
+        // the producer stream captures into its own buffers and converts into the app's
+        bool convertsPreview() const { return mV4L2DataFormatConvert || scalesPreview(); }
     private:
         class WorkThread : public Thread {
             HinDevImpl* mSource;
@@ -228,6 +317,21 @@ class HinDevImpl {
                 }
         };
 
+        class ConvertThread : public Thread {
+            HinDevImpl* mSource;
+            public:
+                ConvertThread(HinDevImpl* source) :
+                    Thread(false), mSource(source) { }
+                virtual void onFirstRef() {
+                    run("hdmi_input_source convert thread", PRIORITY_URGENT_DISPLAY);
+                }
+                virtual bool threadLoop() {
+                    mSource->convertThread();
+                    // loop until we need to quit
+                    return true;
+                }
+        };
+
         // class PreviewBuffThread : public Thread {
         //     HinDevImpl* mSource;
         //     public:
@@ -271,6 +375,27 @@ class HinDevImpl {
         sp<WorkThread>   mWorkThread;
         sp<PqBufferThread> mPqBufferThread;
         sp<IepBufferThread> mIepBufferThread;
+        // converts app buffers off the capture thread, results go out when done
+        sp<ConvertThread> mConvertThread;
+        Mutex mConvertLock;
+        Condition mConvertCond;
+        std::deque<int> mConvertQueue;
+        // a sideband buffer goes back to the driver when its last holder lets go
+        Mutex mFrameRefLock;
+        tv_frame_ref_t mFrameRefs[SIDEBAND_WINDOW_BUFF_CNT];
+        int mDisplayFrameIndex = -1;
+        // per frame work of the sideband path, rebuilt when features change
+        FramePipeline mPipeline;
+        std::atomic<bool> mPipelineDirty{true};
+        // capture readiness of mHinDevHandle, stop() wakes it up
+        EventReactor mCaptureReactor;
+        bool mCaptureReady = false;
+        // held by the capture thread per frame, reconfigure() takes it to
+        // swap buffers under a paused stream
+        Mutex mCaptureLock;
+        // app buffer size of a downscaled producer stream, 0 when full size
+        int mPreviewScaleWidth = 0;
+        int mPreviewScaleHeight = 0;
         // sp<PreviewBuffThread>   mPreviewBuffThread;
         mutable Mutex mLock;
         Mutex mBufferLock;
@@ -289,10 +414,22 @@ class HinDevImpl {
         int mDumpFrameCount;
         void *mUser;
         bool mV4L2DataFormatConvert;
+        // v4l2 fourcc of the app preview buffers, differs from mPixelFormat when converting
+        int mPreviewV4l2Format = 0;
         int mPreviewBuffIndex = 0;
         bool mFirstRequestCapture;
         int mRequestCaptureCount = 0;
+        // guards the app buffer slots and their lookups below
+        Mutex mPreviewLock;
         std::vector<tv_preview_buff_app_t> mPreviewRawHandle;
+        // app buffer lookups for request_capture, slot == v4l2 buffer index
+        std::unordered_map<uint64_t, int> mPreviewSlotById;
+        std::unordered_map<ino_t, int> mPreviewSlotByInode;
+        // ids of requests that came in before start() finished, replayed by
+        // it; the capture lands in the slot's own import, so the framework's
+        // handle isn't kept past request_capture()
+        Mutex mPendingCaptureLock;
+        std::deque<uint64_t> mPendingCaptures;
         std::vector<tv_pq_buffer_info_t> mIepBufferHandle;
         int mRecordCodingBuffIndex = 0;
         int mDisplayRatio = FULL_SCREEN;
@@ -303,6 +440,15 @@ class HinDevImpl {
         int mPqBuffIndex = 0;
         int mPqBuffOutIndex = 0;
         rkpq *mRkpq=nullptr;
+        // contexts brought up by prewarm(), each user waits on its future
+        Prewarmer mPrewarmer;
+        std::shared_future<bool> mDrmReady;
+        std::shared_future<bool> mPqReady;
+        rkpq *mPrewarmedPq = nullptr;
+        std::shared_future<bool> mMppReady;
+        // inited avc context, init_encodeserver() hands it to the encoder
+        MppCtx mPrewarmedMppCtx = nullptr;
+        MppApi *mPrewarmedMpi = nullptr;
         bool mUseZme;
         rkiep *mRkiep=nullptr;
         int mIepBuffIndex = 0;
@@ -310,6 +456,23 @@ class HinDevImpl {
         bool mUseIep = false;
         bool mPqIniting = false;
         int mLastPqStatus = 0;
+        // set by the work thread when a frame wanted pq but had no buffers
+        std::atomic<bool> mPqFramePending{false};
+        // when pq was switched off, 0 while it is on or nothing is held
+        nsecs_t mPqIdleSince = 0;
+        bool mPqBuffersPooled = false;
+        // output size of the pq/iep buffers handed back to the pool
+        int mPqPooledWidth = 0;
+        int mPqPooledHeight = 0;
+        // guards the mPqBufferHandle vector and its slots between the work
+        // thread queueing frames and the pq thread allocating, releasing and
+        // consuming them
+        Mutex mPqBufferLock;
+        // buffer sets of recent timings are warmed once the first frame is up
+        bool mStandbyPending = false;
+        // guards mIepBufferHandle against the iep thread, which doesn't
+        // take mBufferLock
+        Mutex mIepBufferLock;
         int mEnableDump = 0;
         // std::vector<tv_input_preview_buff_t> mPreviewBuff;
 };
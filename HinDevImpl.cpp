@@ -15,6 +15,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <linux/videodev2.h>
 #include <sys/time.h>
 #include <utils/Timers.h>
@@ -24,6 +25,7 @@
 #include <sys/stat.h>
 
 #include "HinDev.h"
+#include "sideband/DrmVopRender.h"
 #include <ui/GraphicBufferMapper.h>
 #include <ui/GraphicBuffer.h>
 #include <linux/videodev2.h>
@@ -47,11 +49,6 @@
 #define ALIGN_32(x) ((x + (BOUNDRY) - 1)& ~((BOUNDRY) - 1))
 #define ALIGN(b,w) (((b)+((w)-1))/(w)*(w))
 
-const int kMaxDevicePathLen = 256;
-const char* kDevicePath = "/dev/";
-constexpr char kPrefix[] = "video";
-constexpr int kPrefixLen = sizeof(kPrefix) - 1;
-//constexpr int kDevicePrefixLen = sizeof(kDevicePath) + kPrefixLen + 1;
 constexpr char kHdmiNodeName[] = "rk_hdmirx";
 
 nsecs_t now = 0;
@@ -199,6 +196,39 @@ static int  getNativeWindowFormat(int format)
     return nativeFormat;
 }
 
+// fourcc buffDataTransfer writes for an app buffer of |halFormat|, -1 if it can't
+static int getPreviewV4l2Format(int halFormat)
+{
+    switch (halFormat) {
+        case HAL_PIXEL_FORMAT_YCrCb_NV12:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            return V4L2_PIX_FMT_NV12;
+        case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+            return V4L2_PIX_FMT_NV16;
+        case HAL_PIXEL_FORMAT_BGR_888:
+            return V4L2_PIX_FMT_BGR24;
+        default:
+            return -1;
+    }
+}
+
+// single plane fourcc with the same layout as a multi plane one, 0 if none
+static uint32_t getContiguousFormat(uint32_t format)
+{
+    switch (format) {
+        case V4L2_PIX_FMT_NV12M:
+            return V4L2_PIX_FMT_NV12;
+        case V4L2_PIX_FMT_NV21M:
+            return V4L2_PIX_FMT_NV21;
+        case V4L2_PIX_FMT_NV16M:
+            return V4L2_PIX_FMT_NV16;
+        case V4L2_PIX_FMT_NV61M:
+            return V4L2_PIX_FMT_NV61;
+        default:
+            return 0;
+    }
+}
+
 HinDevImpl::HinDevImpl()
     : mHinDevHandle(-1),
                     mHinNodeInfo(NULL),
@@ -231,6 +261,8 @@ HinDevImpl::HinDevImpl()
     DEBUG_PRINT(1, "prop value : mDebugLevel=%d, mSkipFrame=%d, mDumpType=%d", mDebugLevel, mSkipFrame, mDumpType);
     mV4l2Event = new V4L2DeviceEvent();
     mSidebandWindow = new RTSidebandWindow();
+    mPipeline.SetFrameRefs([this](int index) { acquireFrame(index, FRAME_OWNER_RECORD); },
+        [this](int index) { releaseFrame(index, FRAME_OWNER_RECORD); });
 }
 
 int HinDevImpl::init(int id,int initType) {
@@ -248,6 +280,7 @@ int HinDevImpl::init(int id,int initType) {
     }
     memset(mHinNodeInfo, 0, sizeof(struct HinNodeInfo));
     mHinNodeInfo->currBufferHandleIndex = 0;
+    mHinNodeInfo->numPlanes = PLANES_NUM;
     mHinNodeInfo->currBufferHandleFd = 0;
 
     mFramecount = 0;
@@ -263,6 +296,7 @@ int HinDevImpl::init(int id,int initType) {
     mWorkThread = NULL;
     mPqBufferThread = NULL;
     mIepBufferThread = NULL;
+    mConvertThread = NULL;
     mV4L2DataFormatConvert = false;
     // mPreviewThreadRunning = false;
     // mPreviewBuffThread = NULL;
@@ -284,6 +318,11 @@ int HinDevImpl::init(int id,int initType) {
     info.width = mSrcFrameWidth;
     info.height = mSrcFrameHeight;
     info.usage = STREAM_BUFFER_GRALLOC_USAGE;
+    // rk_hdmirx behind an iommu can capture into scattered pages, which
+    // avoids large cma allocations for 4k frames
+    if (property_get_int32(TV_INPUT_IOMMU_BUFFER, 0) == 1) {
+        info.usage &= ~RK_GRALLOC_USAGE_PHY_CONTIG_BUFFER;
+    }
     if (initType == TV_STREAM_TYPE_INDEPENDENT_VIDEO_SOURCE) {
         mFrameType |= TYPF_SIDEBAND_WINDOW;
         mBufferCount = SIDEBAND_WINDOW_BUFF_CNT;
@@ -299,6 +338,10 @@ int HinDevImpl::init(int id,int initType) {
     info.streamType = mFrameType;
     info.format = mPixelFormat; //0x15
 
+    if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+        // the window would otherwise bring drm up a second time under it
+        Prewarmer::Wait("drm", mDrmReady);
+    }
     if(-1 == mSidebandWindow->init(info)) {
         DEBUG_PRINT(3, "mSidebandWindow->init failed !!!");
         return -1;
@@ -306,69 +349,104 @@ int HinDevImpl::init(int id,int initType) {
     return NO_ERROR;
 }
 
+void HinDevImpl::prewarm() {
+    if (property_get_int32(TV_INPUT_PREWARM, 1) != 1 || mDrmReady.valid()) {
+        return;
+    }
+    mDrmReady = mPrewarmer.Add("drm", []() {
+        DrmVopRender* render = DrmVopRender::GetInstance();
+        if (!render->mInitialized && render->initialize()) {
+            render->detect();
+        }
+        return render->mInitialized;
+    });
+    mPrewarmer.Add("rga", []() {
+        RockchipRga::get();
+        return true;
+    });
+    if (property_get_int32(TV_INPUT_PQ_ENABLE, 0) != 0) {
+        mPqReady = mPrewarmer.Add("rkpq", [this]() {
+            mPrewarmedPq = new rkpq();
+            return mPrewarmedPq != nullptr;
+        });
+    }
+    // loads the mpp service and its power domain, the first record reuses it
+    mMppReady = mPrewarmer.Add("mpp", [this]() {
+        MppCtx ctx = NULL;
+        MppApi* mpi = NULL;
+        if (mpp_create(&ctx, &mpi) != MPP_OK) {
+            return false;
+        }
+        if (mpp_init(ctx, MPP_CTX_ENC, MPP_VIDEO_CodingAVC) != MPP_OK) {
+            mpp_destroy(ctx);
+            return false;
+        }
+        mPrewarmedMppCtx = ctx;
+        mPrewarmedMpi = mpi;
+        return true;
+    });
+    mPrewarmer.Start();
+}
+
+int HinDevImpl::openHdmiNode(const char* path) {
+    int videofd = open(path, O_RDWR);
+    if (videofd < 0) {
+        DEBUG_PRINT(3, "[%s %d] open %s failed [%s]", __FUNCTION__, __LINE__, path, strerror(errno));
+        return -1;
+    }
+    DEBUG_PRINT(1, "%s open device %s successful.", __FUNCTION__, path);
+    struct v4l2_capability cap;
+    int ret = ioctl(videofd, VIDIOC_QUERYCAP, &cap);
+    if (ret < 0) {
+        DEBUG_PRINT(3, "VIDIOC_QUERYCAP Failed, error: %s", strerror(errno));
+        close(videofd);
+        return -1;
+    }
+    DEBUG_PRINT(3, "VIDIOC_QUERYCAP driver=%s", cap.driver);
+    DEBUG_PRINT(3, "VIDIOC_QUERYCAP card=%s", cap.card);
+    DEBUG_PRINT(3, "VIDIOC_QUERYCAP version=%d", cap.version);
+    DEBUG_PRINT(3, "VIDIOC_QUERYCAP capabilities=0x%08x,0x%08x", cap.capabilities,V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    DEBUG_PRINT(3, "VIDIOC_QUERYCAP device_caps=0x%08x", cap.device_caps);
+    if (strncmp(kHdmiNodeName, (const char*)cap.driver, sizeof(kHdmiNodeName)-1)) {
+        close(videofd);
+        DEBUG_PRINT(3, "isnot hdmirx,VIDIOC_QUERYCAP driver=%s", cap.driver);
+        return -1;
+    }
+    if ((cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        ALOGE("V4L2_CAP_VIDEO_CAPTURE is  a video capture device, capabilities: %x\n", cap.capabilities);
+        TVHAL_V4L2_BUF_TYPE = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    } else if ((cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+        ALOGE("V4L2_CAP_VIDEO_CAPTURE_MPLANE is  a video capture device, capabilities: %x\n", cap.capabilities);
+        TVHAL_V4L2_BUF_TYPE = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }
+    return videofd;
+}
+
 int HinDevImpl::findDevice(int id, int& initWidth, int& initHeight,int& initFormat ) {
     ALOGD("%s called", __func__);
-    // Find existing /dev/video* devices
-    DIR* devdir = opendir(kDevicePath);
-    int videofd,ret;
-    if(devdir == 0) {
-        ALOGE("%s: cannot open %s! Exiting threadloop", __FUNCTION__, kDevicePath);
-        return -1;
+    // the sysfs name/driver match (or last time's node) usually hits on the
+    // first open, every other node is only opened when it doesn't
+    DeviceDiscovery* discovery = DeviceDiscovery::GetInstance();
+    std::vector<std::string> tried = discovery->GetCandidates("hdmirx");
+    for (int i = 0; i < tried.size() && mHinDevHandle < 0; i++) {
+        mHinDevHandle = openHdmiNode(tried[i].c_str());
+        if (mHinDevHandle >= 0) {
+            discovery->Store(tried[i]);
+        }
     }
-    struct dirent* de;
-    while ((de = readdir(devdir)) != 0) {
-        // Find external v4l devices that's existing before we start watching and add them
-        if (!strncmp(kPrefix, de->d_name, kPrefixLen)) {
-		std::string deviceId(de->d_name + kPrefixLen);
-		ALOGD(" v4l device %s found", de->d_name);
-		char v4l2DevicePath[kMaxDevicePathLen];
-		char v4l2DeviceDriver[16];
-		char gadget_video[100] = {0};
-
-		sprintf(gadget_video, "/sys/class/video4linux/%s/function_name", de->d_name);
-		if (access(gadget_video, F_OK) == 0) {
-			ALOGW("/dev/%s is uvc gadget device, don't open it!", de->d_name);
-			continue;
-		}
-
-		snprintf(v4l2DevicePath, kMaxDevicePathLen,"%s%s", kDevicePath, de->d_name);
-		videofd = open(v4l2DevicePath, O_RDWR);
-		if (videofd < 0){
-			DEBUG_PRINT(3, "[%s %d] mHinDevHandle:%x [%s]", __FUNCTION__, __LINE__, videofd,strerror(errno));
-			continue;
-		} else {
-			DEBUG_PRINT(1, "%s open device %s successful.", __FUNCTION__, v4l2DevicePath);
-			struct v4l2_capability cap;
-			ret = ioctl(videofd, VIDIOC_QUERYCAP, &cap);
-			if (ret < 0) {
-				DEBUG_PRINT(3, "VIDIOC_QUERYCAP Failed, error: %s", strerror(errno));
-				close(videofd);
-				continue;
-		}
-		snprintf(v4l2DeviceDriver, 16,"%s",cap.driver);
-		DEBUG_PRINT(3, "VIDIOC_QUERYCAP driver=%s,%s", cap.driver,v4l2DeviceDriver);
-		DEBUG_PRINT(3, "VIDIOC_QUERYCAP card=%s", cap.card);
-		DEBUG_PRINT(3, "VIDIOC_QUERYCAP version=%d", cap.version);
-		DEBUG_PRINT(3, "VIDIOC_QUERYCAP capabilities=0x%08x,0x%08x", cap.capabilities,V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-		DEBUG_PRINT(3, "VIDIOC_QUERYCAP device_caps=0x%08x", cap.device_caps);
-		if(!strncmp(kHdmiNodeName, v4l2DeviceDriver, sizeof(kHdmiNodeName)-1)){
-			mHinDevHandle =  videofd;
-			if ((cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-				ALOGE("V4L2_CAP_VIDEO_CAPTURE is  a video capture device, capabilities: %x\n", cap.capabilities);
-					TVHAL_V4L2_BUF_TYPE = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		}else if ((cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
-				ALOGE("V4L2_CAP_VIDEO_CAPTURE_MPLANE is  a video capture device, capabilities: %x\n", cap.capabilities);
-				TVHAL_V4L2_BUF_TYPE = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			}
-			break;
-		}else{
-			close(videofd);
-			DEBUG_PRINT(3, "isnot hdmirx,VIDIOC_QUERYCAP driver=%s", cap.driver);
-		}
+    if (mHinDevHandle < 0) {
+        discovery->Invalidate();
+        std::vector<std::string> nodes = discovery->GetAllNodes();
+        for (int i = 0; i < nodes.size() && mHinDevHandle < 0; i++) {
+            if (std::find(tried.begin(), tried.end(), nodes[i]) != tried.end()) {
+                continue;
+            }
+            mHinDevHandle = openHdmiNode(nodes[i].c_str());
+            if (mHinDevHandle >= 0) {
+                discovery->Store(nodes[i]);
             }
         }
     }
-    closedir(devdir);
     if (mHinDevHandle < 0){
     	DEBUG_PRINT(3, "[%s %d] mHinDevHandle:%x", __FUNCTION__, __LINE__, mHinDevHandle);
     	return -1;
@@ -401,7 +479,8 @@ int HinDevImpl::findDevice(int id, int& initWidth, int& initHeight,int& initForm
 int HinDevImpl::makeHwcSidebandHandle() {
     buffer_handle_t buffer = NULL;
 
-    mSidebandWindow->allocateSidebandHandle(&buffer, mDstFrameWidth, mDstFrameHeight, -1, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
+    mSidebandWindow->allocateSidebandHandle(&buffer, mDstFrameWidth, mDstFrameHeight, -1, RK_GRALLOC_USAGE_STRIDE_ALIGN_64,
+        common::BUFFER_PURPOSE_SIDEBAND);
     if (!buffer) {
         DEBUG_PRINT(3, "allocate buffer from sideband window failed!");
         return -1;
@@ -419,6 +498,16 @@ buffer_handle_t HinDevImpl::getSindebandBufferHandle() {
 HinDevImpl::~HinDevImpl()
 {
     DEBUG_PRINT(3, "%s %d", __FUNCTION__, __LINE__);
+    mPipeline.Flush();
+    mPrewarmer.Cancel();
+    if (mPrewarmedPq != nullptr) {
+        delete mPrewarmedPq;
+        mPrewarmedPq = nullptr;
+    }
+    if (mPrewarmedMppCtx != nullptr) {
+        mpp_destroy(mPrewarmedMppCtx);
+        mPrewarmedMppCtx = nullptr;
+    }
     if (mSidebandWindow) {
         mSidebandWindow->stop();
     }
@@ -465,7 +554,17 @@ int HinDevImpl::start_device()
         ALOGD("VIDIOC_REQBUFS successful.");
     }
 
-    aquire_buffer();
+    updatePreviewConvert();
+    ret = aquire_buffer();
+    if (ret != NO_ERROR) {
+        // buffers allocated so far are freed by release_buffer() on stop
+        DEBUG_PRINT(3, "aquire_buffer Failed: %d", ret);
+        mHinNodeInfo->reqBuf.count = 0;
+        if (ioctl(mHinDevHandle, VIDIOC_REQBUFS, &mHinNodeInfo->reqBuf) < 0) {
+            DEBUG_PRINT(3, "cancel REQBUFS Failed, error: %s", strerror(errno));
+        }
+        return ret;
+    }
     for (int i = 0; i < mBufferCount; i++) {
         DEBUG_PRINT(mDebugLevel, "bufferArray index = %d", mHinNodeInfo->bufferArray[i].index);
         DEBUG_PRINT(mDebugLevel, "bufferArray type = %d", mHinNodeInfo->bufferArray[i].type);
@@ -483,6 +582,13 @@ int HinDevImpl::start_device()
         }
     }
     ALOGD("[%s %d] VIDIOC_QBUF successful", __FUNCTION__, __LINE__);
+    if (!(mFrameType & TYPF_SIDEBAND_WINDOW)) {
+        Mutex::Autolock previewLock(mPreviewLock);
+        for (int i = 0; i < mBufferCount && i < (int)mPreviewRawHandle.size(); i++) {
+            mPreviewRawHandle[i].isQueued = true;
+        }
+    }
+    resetFrameRefs();
 
     v4l2_buf_type bufType;
     bufType = TVHAL_V4L2_BUF_TYPE;
@@ -521,10 +627,12 @@ int HinDevImpl::start()
     ret = start_device();
     if(ret != NO_ERROR) {
         DEBUG_PRINT(3, "Start v4l2 device failed:%d",ret);
+        failPendingCaptures();
         return ret;
     }
 
-    mSidebandWindow->allocateSidebandHandle(&mSignalHandle, -1, -1, HAL_PIXEL_FORMAT_BGR_888, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
+    mSidebandWindow->allocateSidebandHandle(&mSignalHandle, -1, -1, HAL_PIXEL_FORMAT_BGR_888, RK_GRALLOC_USAGE_STRIDE_ALIGN_64,
+        common::BUFFER_PURPOSE_SIGNAL);
 
     ALOGD("Create Work Thread");
 
@@ -541,10 +649,29 @@ int HinDevImpl::start()
     property_set(TV_INPUT_PQ_MODE, "0");
     property_set(TV_INPUT_HDMIIN, "1");
 
+    if ((mFrameType & TYPF_SIDEBAND_WINDOW) && property_get_int32(TV_INPUT_AUTO_FRAME_RATE, 0) == 1) {
+        mSidebandWindow->matchDisplayFrameRate(mFrameFps);
+    }
+
+    if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+        tv_timing_t timing = {mSrcFrameWidth, mSrcFrameHeight, (uint32_t)mPixelFormat};
+        TimingCache::GetInstance()->Touch(timing);
+        mStandbyPending = true;
+    }
+    mPipelineDirty = true;
+    if (mCaptureReactor.Init() == 0) {
+        mCaptureReactor.Add(mHinDevHandle, EPOLLIN, [this](uint32_t) { mCaptureReady = true; });
+    }
     mWorkThread = new WorkThread(this);
-    mState = START;
+    {
+        Mutex::Autolock pendingLock(mPendingCaptureLock);
+        mState = START;
+    }
     mPqBufferThread = new PqBufferThread(this);
     mIepBufferThread = new IepBufferThread(this);
+    if (!(mFrameType & TYPF_SIDEBAND_WINDOW) && convertsPreview()) {
+        mConvertThread = new ConvertThread(this);
+    }
     /*property_get(TV_INPUT_PQ_STATUS, prop_value, "0");
     int pqStatus = (int)atoi(prop_value);
     mPqInitFinish = false;
@@ -556,7 +683,15 @@ int HinDevImpl::start()
     }*/
 
     mOpen = true;
-    ALOGD("%s %d ret:%d", __FUNCTION__, __LINE__, ret);
+    std::deque<uint64_t> pending;
+    {
+        Mutex::Autolock pendingLock(mPendingCaptureLock);
+        pending.swap(mPendingCaptures);
+    }
+    for (uint64_t bufferId : pending) {
+        request_capture(NULL, bufferId);
+    }
+    ALOGD("%s %d ret:%d, replayed %zu requests", __FUNCTION__, __LINE__, ret, pending.size());
     return NO_ERROR;
 }
 
@@ -566,68 +701,174 @@ int HinDevImpl::stop()
     ALOGD("%s %d", __FUNCTION__, __LINE__);
     int ret;
     mPqMode = PQ_OFF;
-    mState = STOPED;
+    {
+        Mutex::Autolock pendingLock(mPendingCaptureLock);
+        mState = STOPED;
+    }
+    // a start that was cancelled or never ran leaves its requests here
+    failPendingCaptures();
     char prop_value[PROPERTY_VALUE_MAX] = {0};
     property_get(TV_INPUT_PQ_ENABLE, prop_value, "0");
     if ((int)atoi(prop_value) == 1) {
         property_set(TV_INPUT_PQ_MODE, "1");
     }
     property_set(TV_INPUT_HDMIIN, "0");
-    Mutex::Autolock autoLock(mBufferLock);
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    int deadlineMs = property_get_int32(TV_INPUT_STOP_DEADLINE_MS, 200);
+    Teardown teardown(deadlineMs);
 
-    if(gMppEnCodeServer != nullptr) {
-        ALOGD("zj add file: %s func %s line %d \n",__FILE__,__FUNCTION__,__LINE__);
-        gMppEnCodeServer->stop();
+    // every stage learns it has to quit before anyone waits on one
+    if (mWorkThread != NULL) {
+        teardown.Signal("work", [this]() {
+            mWorkThread->requestExit();
+            // don't leave it sitting in the capture wait until the timeout
+            mCaptureReactor.Wakeup();
+        });
     }
-    if(mWorkThread != NULL){
-        mWorkThread->requestExit();
-        mWorkThread.clear();
-        mWorkThread = NULL;
+    if (mPqBufferThread != NULL) {
+        teardown.Signal("pq", [this]() { mPqBufferThread->requestExit(); });
     }
-    if(mPqBufferThread != NULL){
-        mPqBufferThread->requestExit();
-        mPqBufferThread.clear();
-        mPqBufferThread = NULL;
+    if (mIepBufferThread != NULL) {
+        teardown.Signal("iep", [this]() { mIepBufferThread->requestExit(); });
     }
-
-    if (mRkpq!=nullptr) {
-        delete mRkpq;
-        mRkpq = nullptr;
+    if (mConvertThread != NULL) {
+        teardown.Signal("convert", [this]() {
+            mConvertThread->requestExit();
+            mConvertCond.signal();
+        });
     }
+    teardown.RunSignals();
 
+    // the pq thread takes mBufferLock per pass, so the joins run before it is held.
+    // A join left detached at the deadline keeps its own reference on the thread.
+    if (mWorkThread != NULL) {
+        sp<WorkThread> workThread = mWorkThread;
+        teardown.Join("work", [this, workThread]() {
+            workThread->join();
+            // nothing posts to the pipeline worker once capture is gone
+            mPipeline.Flush();
+        });
+    }
+    if (mPqBufferThread != NULL) {
+        sp<PqBufferThread> pqThread = mPqBufferThread;
+        teardown.Join("pq", [pqThread]() { pqThread->join(); });
+    }
     if (mIepBufferThread != NULL) {
-        mIepBufferThread->requestExit();
-         mIepBufferThread.clear();
-         mIepBufferThread = NULL;
+        sp<IepBufferThread> iepThread = mIepBufferThread;
+        teardown.Join("iep", [iepThread]() { iepThread->join(); });
     }
-    if (mRkiep!=nullptr) {
-         delete mRkiep;
-         mRkiep = nullptr;
+    if (mConvertThread != NULL) {
+        sp<ConvertThread> convertThread = mConvertThread;
+        teardown.Join("convert", [convertThread]() { convertThread->join(); });
     }
-
-    if (mFrameType & TYPF_SIDEBAND_WINDOW) {
-        mSidebandWindow->clearVopArea();
+    std::shared_ptr<std::atomic<bool>> encoderStuck = std::make_shared<std::atomic<bool>>(false);
+    if (gMppEnCodeServer != nullptr) {
+        MppEncodeServer* encoder = gMppEnCodeServer;
+        teardown.Join("encoder", [encoder, encoderStuck]() {
+            if (!encoder->stop() && encoder->stuck()) {
+                encoderStuck->store(true);
+            }
+        });
     }
-    enum v4l2_buf_type bufType = TVHAL_V4L2_BUF_TYPE;
-    ret = ioctl (mHinDevHandle, VIDIOC_STREAMOFF, &bufType);
-    if (ret < 0) {
-        DEBUG_PRINT(3, "StopStreaming: Unable to stop capture: %s", strerror(errno));
-    } else {
-        DEBUG_PRINT(3, "StopStreaming: successful.");
+    bool stuck = false;
+    if (!teardown.RunJoins()) {
+        // a thread sits in a driver call; streamoff hands a blocked dqbuf
+        // back, the wakeups cover our own waits
+        enum v4l2_buf_type bufType = TVHAL_V4L2_BUF_TYPE;
+        ioctl(mHinDevHandle, VIDIOC_STREAMOFF, &bufType);
+        mCaptureReactor.Wakeup();
+        mConvertCond.signal();
+        stuck = !teardown.WaitPending();
+    }
+    // a quick open/close must not tear drm, rga or mpp down under the prewarm
+    // thread; it gets the same deadline and keeps them if it overruns
+    Teardown prewarm(deadlineMs);
+    prewarm.Join("prewarm", [this]() { mPrewarmer.Cancel(); });
+    if (!prewarm.RunJoins() && !prewarm.WaitPending()) {
+        stuck = true;
+    }
+    if (stuck || encoderStuck->load()) {
+        return abandonStop(teardown);
     }
 
-    // cancel request buff
-    v4l2_requestbuffers req_buffers{};
-    req_buffers.type = TVHAL_V4L2_BUF_TYPE;
-    req_buffers.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
-    req_buffers.count = 0;
-    ret = ioctl(mHinDevHandle, VIDIOC_REQBUFS, &req_buffers);
-    if (ret < 0) {
-        ALOGE("%s: cancel REQBUFS failed: %s", __FUNCTION__, strerror(errno));
-    } else {
-        ALOGE("%s: cancel REQBUFS successful.", __FUNCTION__);
+    Mutex::Autolock autoLock(mBufferLock);
+    mWorkThread.clear();
+    mWorkThread = NULL;
+    mCaptureReactor.Remove(mHinDevHandle);
+    mPqBufferThread.clear();
+    mPqBufferThread = NULL;
+    mIepBufferThread.clear();
+    mIepBufferThread = NULL;
+    mConvertThread.clear();
+    mConvertThread = NULL;
+    {
+        // the app still waits on the frames that were never converted
+        Mutex::Autolock convertLock(mConvertLock);
+        for (size_t i = 0; i < mConvertQueue.size(); i++) {
+            notifyCaptureFailed();
+        }
+        mConvertQueue.clear();
     }
 
+    // nothing runs any more, what is left doesn't depend on each other
+    teardown.Release("rkpq", [this]() {
+        if (mRkpq != nullptr) {
+            delete mRkpq;
+            mRkpq = nullptr;
+        }
+        if (mPrewarmedPq != nullptr) {
+            delete mPrewarmedPq;
+            mPrewarmedPq = nullptr;
+        }
+    });
+    teardown.Release("iep", [this]() {
+        if (mRkiep != nullptr) {
+            delete mRkiep;
+            mRkiep = nullptr;
+        }
+    });
+    teardown.Release("encoder", [this]() {
+        deinit_encodeserver();
+        if (mPrewarmedMppCtx != nullptr) {
+            mpp_destroy(mPrewarmedMppCtx);
+            mPrewarmedMppCtx = nullptr;
+        }
+    });
+    if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+        teardown.Release("display", [this]() {
+            mSidebandWindow->clearVopArea();
+            mSidebandWindow->restoreDisplayMode();
+        });
+    }
+    // the step may outlive this frame when it is left detached
+    std::shared_ptr<std::atomic<int>> streamOff = std::make_shared<std::atomic<int>>(0);
+    teardown.Release("v4l2", [this, streamOff]() {
+        enum v4l2_buf_type bufType = TVHAL_V4L2_BUF_TYPE;
+        int ret = ioctl (mHinDevHandle, VIDIOC_STREAMOFF, &bufType);
+        streamOff->store(ret);
+        if (ret < 0) {
+            DEBUG_PRINT(3, "StopStreaming: Unable to stop capture: %s", strerror(errno));
+        } else {
+            DEBUG_PRINT(3, "StopStreaming: successful.");
+        }
+
+        // cancel request buff
+        v4l2_requestbuffers req_buffers{};
+        req_buffers.type = TVHAL_V4L2_BUF_TYPE;
+        req_buffers.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
+        req_buffers.count = 0;
+        if (ioctl(mHinDevHandle, VIDIOC_REQBUFS, &req_buffers) < 0) {
+            ALOGE("%s: cancel REQBUFS failed: %s", __FUNCTION__, strerror(errno));
+        } else {
+            ALOGE("%s: cancel REQBUFS successful.", __FUNCTION__);
+        }
+    });
+    if (!teardown.RunReleases() && !teardown.WaitPending()) {
+        // the v4l2 step may still be about to use the fd
+        return abandonStop(teardown);
+    }
+    ret = streamOff->load();
+
     if (mSidebandWindow) {
         mSidebandWindow->stop();
     }
@@ -639,22 +880,206 @@ int HinDevImpl::stop()
 
     if (mHinNodeInfo)
         free(mHinNodeInfo);
+    // the destructor runs after this when the close job owns the device
+    mHinNodeInfo = NULL;
 
     if (mV4l2Event)
         mV4l2Event->closePipe();
 
     if (mHinDevHandle >= 0)
         close(mHinDevHandle);
+    mHinDevHandle = -1;
 
     mFirstRequestCapture = true;
     mRequestCaptureCount = 0;
 
-    deinit_encodeserver();
-
+    ALOGD("%s took %" PRId64 " ms: %s", __FUNCTION__,
+        ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin), teardown.Report().c_str());
     DEBUG_PRINT(3, "============================= %s end ================================", __FUNCTION__);
     return ret;
 }
 
+int HinDevImpl::abandonStop(const Teardown& teardown)
+{
+    // a detached step can still reach the buffers, mHinNodeInfo, the fd and
+    // the encoder; all of it is leaked on purpose, and so must this object be
+    ALOGE("%s stuck threads left detached, leaking the device: %s", __FUNCTION__,
+        teardown.Report().c_str());
+    // the next device must not pick up what the stuck ones still use; the
+    // encode callback checks mRecordHandle for emptiness before indexing
+    gMppEnCodeServer = nullptr;
+    mRecordHandle.clear();
+    mOpen = false;
+    return TIMED_OUT;
+}
+
+int HinDevImpl::reconfigure()
+{
+    ALOGD("%s %d", __FUNCTION__, __LINE__);
+    // a signal loss before the change leaves mState stopped, that is fine here
+    if (!mOpen || !(mFrameType & TYPF_SIDEBAND_WINDOW) || mWorkThread == NULL) {
+        return INVALID_OPERATION;
+    }
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    Mutex::Autolock autoLock(mBufferLock);
+    mState = PAUSE;
+    mCaptureReactor.Wakeup();
+    Mutex::Autolock captureLock(mCaptureLock);
+
+    int oldWidth = mSrcFrameWidth;
+    int oldHeight = mSrcFrameHeight;
+    int oldPixelFormat = mPixelFormat;
+    int oldFps = mFrameFps;
+
+    enum v4l2_buf_type bufType = TVHAL_V4L2_BUF_TYPE;
+    int ret = ioctl(mHinDevHandle, VIDIOC_STREAMOFF, &bufType);
+    if (ret < 0) {
+        DEBUG_PRINT(3, "VIDIOC_STREAMOFF Failed, error: %s", strerror(errno));
+        return abortReconfigure(ret);
+    }
+    v4l2_requestbuffers req_buffers{};
+    req_buffers.type = TVHAL_V4L2_BUF_TYPE;
+    req_buffers.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
+    req_buffers.count = 0;
+    ret = ioctl(mHinDevHandle, VIDIOC_REQBUFS, &req_buffers);
+    if (ret < 0) {
+        DEBUG_PRINT(3, "cancel REQBUFS Failed, error: %s", strerror(errno));
+        return abortReconfigure(ret);
+    }
+
+    int width = 0, height = 0, format = 0;
+    get_format(0, width, height, format);
+    if (width <= 0 || height <= 0) {
+        DEBUG_PRINT(3, "[%s %d] no valid source format", __FUNCTION__, __LINE__);
+        return abortReconfigure(UNKNOWN_ERROR);
+    }
+    {
+        Mutex::Autolock formatLock(mLock);
+        ret = applyFormat(width, height);
+    }
+    if (ret < 0) {
+        return abortReconfigure(ret);
+    }
+    bool sizeChanged = width != oldWidth || height != oldHeight || mPixelFormat != oldPixelFormat;
+
+    // frames pq still holds are stale either way, drop them before the refs reset
+    for (int i = 0; i < mPqBufferHandle.size(); i++) {
+        if (mPqBufferHandle[i].isFilled && mPqBufferHandle[i].srcIndex >= 0) {
+            releaseFrame(mPqBufferHandle[i].srcIndex, FRAME_OWNER_PQ);
+        }
+        mPqBufferHandle[i].isFilled = false;
+        mPqBufferHandle[i].srcIndex = -1;
+        mPqBufferHandle[i].srcHandle = NULL;
+    }
+    if (sizeChanged) {
+        // the plane may still scan out a capture or pq buffer, drop it and its
+        // framebuffers before the memory behind them goes away
+        mSidebandWindow->clearVopArea();
+        // capture buffers go back to the pool, same sized ones come out of it again
+        for (int i = 0; i < mBufferCount; i++) {
+            mSidebandWindow->freeBuffer(&mHinNodeInfo->buffer_handle_poll[i], 0);
+            mHinNodeInfo->buffer_handle_poll[i] = NULL;
+        }
+        releasePqBuffers();
+        releaseIepBuffers();
+        mPqIdleSince = 0;
+        mPqBuffersPooled = false;
+        // rkpq and iep are set up for one size, the pq thread brings them
+        // back at the new one on its next pass
+        if (mRkpq != nullptr) {
+            delete mRkpq;
+            mRkpq = nullptr;
+        }
+        if (mRkiep != nullptr) {
+            delete mRkiep;
+            mRkiep = nullptr;
+        }
+        mPqMode = PQ_OFF;
+        stopRecord();
+    }
+
+    mHinNodeInfo->reqBuf.type = TVHAL_V4L2_BUF_TYPE;
+    mHinNodeInfo->reqBuf.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
+    mHinNodeInfo->reqBuf.count = mBufferCount;
+    ret = ioctl(mHinDevHandle, VIDIOC_REQBUFS, &mHinNodeInfo->reqBuf);
+    if (ret < 0) {
+        DEBUG_PRINT(3, "VIDIOC_REQBUFS Failed, error: %s", strerror(errno));
+        return abortReconfigure(ret);
+    }
+    if (sizeChanged) {
+        ret = aquire_buffer();
+        if (ret != NO_ERROR) {
+            return abortReconfigure(ret);
+        }
+        for (int i = 0; i < mBufferCount; i++) {
+            if (mHinNodeInfo->buffer_handle_poll[i] == NULL) {
+                DEBUG_PRINT(3, "[%s %d] no capture buffer %d", __FUNCTION__, __LINE__, i);
+                return abortReconfigure(NO_MEMORY);
+            }
+        }
+    }
+    for (int i = 0; i < mBufferCount; i++) {
+        ret = ioctl(mHinDevHandle, VIDIOC_QBUF, &mHinNodeInfo->bufferArray[i]);
+        if (ret < 0) {
+            DEBUG_PRINT(3, "VIDIOC_QBUF Failed, error: %s", strerror(errno));
+            return abortReconfigure(ret);
+        }
+    }
+    resetFrameRefs();
+    mHinNodeInfo->currBufferHandleIndex = 0;
+    // the display still crops to the old timing otherwise
+    mSidebandWindow->setCrop(0, 0, mSrcFrameWidth, mSrcFrameHeight);
+    ret = ioctl(mHinDevHandle, VIDIOC_STREAMON, &bufType);
+    if (ret < 0) {
+        DEBUG_PRINT(3, "VIDIOC_STREAMON Failed, error: %s", strerror(errno));
+        return abortReconfigure(ret);
+    }
+
+    if (mFrameFps != oldFps && property_get_int32(TV_INPUT_AUTO_FRAME_RATE, 0) == 1) {
+        mSidebandWindow->matchDisplayFrameRate(mFrameFps);
+    }
+    tv_timing_t timing = {mSrcFrameWidth, mSrcFrameHeight, (uint32_t)mPixelFormat};
+    TimingCache::GetInstance()->Touch(timing);
+    mStandbyPending = true;
+    mPipelineDirty = true;
+    mState = START;
+    ALOGD("%s %dx%d -> %dx%d fmt 0x%x, buffers %s, took %" PRId64 " ms", __FUNCTION__,
+        oldWidth, oldHeight, width, height, mPixelFormat, sizeChanged ? "reallocated" : "kept",
+        ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+    return NO_ERROR;
+}
+
+int HinDevImpl::abortReconfigure(int err)
+{
+    // called with the stream paused under mBufferLock and mCaptureLock, leaves
+    // the device stopped with nothing allocated until the app closes it
+    ALOGE("%s err=%d, stopping the stream", __FUNCTION__, err);
+    mState = STOPED;
+    stopRecord();
+    mSidebandWindow->clearVopArea();
+    enum v4l2_buf_type bufType = TVHAL_V4L2_BUF_TYPE;
+    if (ioctl(mHinDevHandle, VIDIOC_STREAMOFF, &bufType) < 0) {
+        DEBUG_PRINT(mDebugLevel, "VIDIOC_STREAMOFF: %s", strerror(errno));
+    }
+    v4l2_requestbuffers req_buffers{};
+    req_buffers.type = TVHAL_V4L2_BUF_TYPE;
+    req_buffers.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
+    req_buffers.count = 0;
+    if (ioctl(mHinDevHandle, VIDIOC_REQBUFS, &req_buffers) < 0) {
+        DEBUG_PRINT(3, "cancel REQBUFS Failed, error: %s", strerror(errno));
+    }
+    releasePqBuffers();
+    releaseIepBuffers();
+    mPqIdleSince = 0;
+    mPqBuffersPooled = false;
+    for (int i = 0; i < mBufferCount; i++) {
+        mSidebandWindow->freeBuffer(&mHinNodeInfo->buffer_handle_poll[i], 0);
+        mHinNodeInfo->buffer_handle_poll[i] = NULL;
+    }
+    resetFrameRefs();
+    return err == NO_ERROR ? UNKNOWN_ERROR : err;
+}
+
 int HinDevImpl::set_preview_callback(NotifyQueueDataCallback callback)
 {
     if (!callback) {
@@ -676,7 +1101,7 @@ int HinDevImpl::set_data_callback(V4L2EventCallBack callback)
     return NO_ERROR;
 }
 
-int HinDevImpl::get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int& initFormat)
+bool HinDevImpl::negotiateFormat(int &hdmi_in_width, int &hdmi_in_height, int& initFormat, uint32_t consumers)
 {
     std::vector<int> formatList;
     struct v4l2_fmtdesc fmtdesc;
@@ -690,20 +1115,49 @@ int HinDevImpl::get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int&
         fmtdesc.index++;
     }
     v4l2_format format;
-    format.type = TVHAL_V4L2_BUF_TYPE;
+    std::vector<uint32_t> candidates;
+    uint32_t firstAccepted = 0;
     vector<int>::iterator it;
     for(it = formatList.begin();it != formatList.end();it++){
+        memset(&format, 0, sizeof(format));
+        format.type = TVHAL_V4L2_BUF_TYPE;
     	format.fmt.pix.pixelformat = (int)*it;
     	if (ioctl(mHinDevHandle, VIDIOC_TRY_FMT, &format) != -1)
     	{
     		DEBUG_PRINT(3, "V4L2 driver try: width:%d,height:%d,format:0x%x", format.fmt.pix.width, format.fmt.pix.height,format.fmt.pix.pixelformat);
     		hdmi_in_width =  format.fmt.pix.width;
     		hdmi_in_height = format.fmt.pix.height;
-    		mPixelFormat = format.fmt.pix.pixelformat;
-    		initFormat = getNativeWindowFormat(format.fmt.pix.pixelformat);//V4L2_PIX_FMT_BGR24;
-    		break;
+    		// the driver may adjust the request, score what it actually gives
+    		uint32_t tryFormat = format.fmt.pix.pixelformat;
+    		if (firstAccepted == 0) {
+    		    firstAccepted = tryFormat;
+    		}
+    		if (std::find(candidates.begin(), candidates.end(), tryFormat) == candidates.end()) {
+    		    candidates.push_back(tryFormat);
+    		}
     	}
     }
+    if (!candidates.empty()) {
+        int64_t cost = 0;
+        uint32_t picked = FormatNegotiator::Pick(candidates, hdmi_in_width, hdmi_in_height, consumers, &cost);
+        if (picked == 0) {
+            DEBUG_PRINT(3, "[%s %d] no format fits consumers 0x%x, use first 0x%x", __FUNCTION__, __LINE__, consumers, firstAccepted);
+            picked = firstAccepted;
+        } else {
+            DEBUG_PRINT(3, "[%s %d] pick format 0x%x cost %" PRId64 " bytes/frame for consumers 0x%x",
+                __FUNCTION__, __LINE__, picked, cost, consumers);
+        }
+        mPixelFormat = picked;
+        initFormat = getNativeWindowFormat(picked);//V4L2_PIX_FMT_BGR24;
+    }
+    return !candidates.empty();
+}
+
+int HinDevImpl::get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int& initFormat)
+{
+    v4l2_format format;
+    memset(&format, 0, sizeof(format));
+    format.type = TVHAL_V4L2_BUF_TYPE;
     int err = ioctl(mHinDevHandle, VIDIOC_G_FMT, &format);
     if (err < 0)
     {
@@ -717,6 +1171,32 @@ int HinDevImpl::get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int&
         DEBUG_PRINT(3, "after %s get from v4l2 format.fmt.pix.pixelformat =%d", __FUNCTION__, format.fmt.pix.pixelformat);
     }
 
+    // a timing negotiated before for the same source fourcc and consumers
+    // skips the enum/try round
+    uint32_t srcFormat = err < 0 ? 0 : format.fmt.pix.pixelformat;
+    uint32_t consumers = getFormatConsumers();
+    struct v4l2_dv_timings timings;
+    memset(&timings, 0, sizeof(timings));
+    bool haveTimings = srcFormat != 0 && ioctl(mHinDevHandle, VIDIOC_QUERY_DV_TIMINGS, &timings) == 0
+            && timings.type == V4L2_DV_BT_656_1120 && timings.bt.width > 0 && timings.bt.height > 0;
+    uint32_t cachedFormat = 0;
+    if (haveTimings && TimingCache::GetInstance()->LookupFormat(timings.bt, srcFormat, consumers, &cachedFormat)) {
+        mPixelFormat = cachedFormat;
+        initFormat = getNativeWindowFormat(cachedFormat);
+        DEBUG_PRINT(3, "[%s %d] cached format 0x%x for src 0x%x", __FUNCTION__, __LINE__,
+            cachedFormat, srcFormat);
+    } else {
+        if (negotiateFormat(hdmi_in_width, hdmi_in_height, initFormat, consumers) && haveTimings) {
+            TimingCache::GetInstance()->StoreFormat(timings.bt, srcFormat, consumers, mPixelFormat);
+        }
+    }
+    // the frame size is what the driver captures now, whichever way the
+    // format was picked; pix and pix_mp start with the same fields
+    if (srcFormat != 0) {
+        hdmi_in_width = format.fmt.pix.width;
+        hdmi_in_height = format.fmt.pix.height;
+    }
+
     err = ioctl(mHinDevHandle, RK_HDMIRX_CMD_GET_FPS, &mFrameFps);
     if (err < 0) {
         DEBUG_PRINT(3, "[%s %d] failed, RK_HDMIRX_CMD_GET_FPS %d, %s", __FUNCTION__, __LINE__, err, strerror(err));
@@ -744,6 +1224,22 @@ int HinDevImpl::get_format(int fd, int &hdmi_in_width, int &hdmi_in_height,int&
     if(hdmi_in_width == 0 || hdmi_in_height == 0) return 0;
     return -1;
 }
+uint32_t HinDevImpl::getFormatConsumers() {
+    uint32_t consumers = 0;
+    if (mFrameType & TYPE_STREAM_BUFFER_PRODUCER) {
+        consumers |= FORMAT_CONSUMER_PREVIEW;
+    } else {
+        consumers |= FORMAT_CONSUMER_DISPLAY;
+    }
+    if (property_get_int32(TV_INPUT_PQ_ENABLE, 0) != 0) {
+        consumers |= FORMAT_CONSUMER_PQ;
+    }
+    if (!mRecordHandle.empty()) {
+        consumers |= FORMAT_CONSUMER_RECORD;
+    }
+    return consumers;
+}
+
 int HinDevImpl::get_HdmiIn(bool enforce){
     if(enforce && mIsHdmiIn) return mIsHdmiIn;
     struct v4l2_control control;
@@ -794,6 +1290,11 @@ int HinDevImpl::set_format(int width, int height, int color_format)
     Mutex::Autolock autoLock(mLock);
     if (mOpen == true)
         return NO_ERROR;
+    return applyFormat(width, height);
+}
+
+int HinDevImpl::applyFormat(int width, int height)
+{
     int ret;
 
     mSrcFrameWidth = width;
@@ -816,6 +1317,30 @@ int HinDevImpl::set_format(int width, int height, int color_format)
     } else {
         ALOGD("%s VIDIOC_S_FMT success. ", __FUNCTION__);
     }
+    mHinNodeInfo->numPlanes = PLANES_NUM;
+    if (mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+        struct v4l2_pix_format_mplane *pixMp = &mHinNodeInfo->format.fmt.pix_mp;
+        uint32_t contiguous = getContiguousFormat(pixMp->pixelformat);
+        if (pixMp->num_planes > 1 && contiguous != 0) {
+            // gralloc hands out one fd per buffer and vb2 ignores data_offset
+            // on capture, ask for the single plane layout of the same format
+            struct v4l2_format multiPlane = mHinNodeInfo->format;
+            pixMp->pixelformat = contiguous;
+            if (ioctl(mHinDevHandle, VIDIOC_S_FMT, &mHinNodeInfo->format) < 0) {
+                DEBUG_PRINT(3, "[%s %d] single plane 0x%x refused: %s", __FUNCTION__, __LINE__,
+                    contiguous, strerror(errno));
+                // the driver still runs the multi plane format set above
+                mHinNodeInfo->format = multiPlane;
+            }
+        }
+        if (pixMp->num_planes > 0 && pixMp->num_planes <= VIDEO_MAX_PLANES) {
+            mHinNodeInfo->numPlanes = pixMp->num_planes;
+        }
+        for (int i = 0; i < mHinNodeInfo->numPlanes; i++) {
+            ALOGD("%s plane[%d] bytesperline=%d sizeimage=%d", __FUNCTION__, i,
+                pixMp->plane_fmt[i].bytesperline, pixMp->plane_fmt[i].sizeimage);
+        }
+    }
     int format = getNativeWindowFormat(mPixelFormat);
     mSidebandWindow->setBufferGeometry(mSrcFrameWidth, mSrcFrameHeight, format);
     return ret;
@@ -851,6 +1376,25 @@ int HinDevImpl::set_crop(int x, int y, int width, int height)
     return NO_ERROR;
 }
 
+int HinDevImpl::set_preview_scale(int width, int height)
+{
+    ALOGD("[%s %d] %dx%d", __FUNCTION__, __LINE__, width, height);
+    mPreviewScaleWidth = 0;
+    mPreviewScaleHeight = 0;
+    if (width <= 0 || height <= 0 || (width == mSrcFrameWidth && height == mSrcFrameHeight)) {
+        return NO_ERROR;
+    }
+    // the rga path in buffDataTransfer can't scale nv24
+    if (mPixelFormat == V4L2_PIX_FMT_NV24 || width > mSrcFrameWidth || height > mSrcFrameHeight) {
+        ALOGE("%s %dx%d not supported for %dx%d fmt=0x%x", __FUNCTION__, width, height,
+            mSrcFrameWidth, mSrcFrameHeight, mPixelFormat);
+        return -EINVAL;
+    }
+    mPreviewScaleWidth = width;
+    mPreviewScaleHeight = height;
+    return NO_ERROR;
+}
+
 int HinDevImpl::set_frame_rate(int frameRate)
 {
     ALOGD("[%s %d]", __FUNCTION__, __LINE__);
@@ -963,16 +1507,19 @@ int HinDevImpl::aquire_buffer()
 {
     int ret = UNKNOWN_ERROR;
     DEBUG_PRINT(3, "%s %d", __FUNCTION__, __LINE__);
+    if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+        mSidebandWindow->prefetchBuffer(mBufferCount);
+    }
     for (int i = 0; i < mBufferCount; i++) {
-        memset(&mHinNodeInfo->planes[i], 0, sizeof(struct v4l2_plane));
+        memset(mHinNodeInfo->planes[i], 0, sizeof(mHinNodeInfo->planes[i]));
         memset(&mHinNodeInfo->bufferArray[i], 0, sizeof(struct v4l2_buffer));
 
         mHinNodeInfo->bufferArray[i].index = i;
         mHinNodeInfo->bufferArray[i].type = TVHAL_V4L2_BUF_TYPE;
         mHinNodeInfo->bufferArray[i].memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
         if (mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
-            mHinNodeInfo->bufferArray[i].m.planes = &mHinNodeInfo->planes[i];
-            mHinNodeInfo->bufferArray[i].length = PLANES_NUM;
+            mHinNodeInfo->bufferArray[i].m.planes = mHinNodeInfo->planes[i];
+            mHinNodeInfo->bufferArray[i].length = mHinNodeInfo->numPlanes;
         }
 
         ret = ioctl(mHinDevHandle, VIDIOC_QUERYBUF, &mHinNodeInfo->bufferArray[i]);
@@ -982,7 +1529,8 @@ int HinDevImpl::aquire_buffer()
         }
 
 
-       if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+       // a scaled or converted producer stream captures into our own full size buffers
+       if ((mFrameType & TYPF_SIDEBAND_WINDOW) || convertsPreview()) {
             ret = mSidebandWindow->allocateBuffer(&mHinNodeInfo->buffer_handle_poll[i]);
             if (ret != 0) {
                 DEBUG_PRINT(3, "mSidebandWindow->allocateBuffer failed !!!");
@@ -993,19 +1541,31 @@ int HinDevImpl::aquire_buffer()
         }
 
 	 if (mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
-            for (int j=0; j<PLANES_NUM; j++) {
+            for (int j=0; j<mHinNodeInfo->numPlanes; j++) {
                 //mHinNodeInfo->bufferArray[i].m.planes[j].m.fd = mSidebandWindow->getBufferHandleFd(mHinNodeInfo->buffer_handle_poll[i]);
-		if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+                if (j > 0) {
+                    // vb2 ignores data_offset on capture, every extra plane needs
+                    // a dma-buf of its own
+                    int planeFd = mSidebandWindow->getBufferPlaneFd(mHinNodeInfo->buffer_handle_poll[i], j);
+                    if (planeFd < 0 || planeFd == mSidebandWindow->getBufferPlaneFd(mHinNodeInfo->buffer_handle_poll[i], 0)) {
+                        DEBUG_PRINT(3, "buffer %d plane %d has no separate fd (%d), can't capture %d planes",
+                            i, j, planeFd, mHinNodeInfo->numPlanes);
+                        return -EINVAL;
+                    }
+                    mHinNodeInfo->bufferArray[i].m.planes[j].m.fd = planeFd;
+		} else if ((mFrameType & TYPF_SIDEBAND_WINDOW) || convertsPreview()) {
                     mHinNodeInfo->bufferArray[i].m.planes[j].m.fd = mSidebandWindow->getBufferHandleFd(mHinNodeInfo->buffer_handle_poll[i]);
                 } else {
                     mHinNodeInfo->bufferArray[i].m.planes[j].m.fd = mPreviewRawHandle[i].bufferFd;
                 }
                 mHinNodeInfo->bufferArray[i].m.planes[j].length = 0;
+                DEBUG_PRINT(mDebugLevel, "buffer %d plane %d fd=%d data_offset=%d", i, j,
+                    mHinNodeInfo->bufferArray[i].m.planes[j].m.fd, mHinNodeInfo->bufferArray[i].m.planes[j].data_offset);
             }
         }
     }
     ALOGD("[%s %d] VIDIOC_QUERYBUF successful", __FUNCTION__, __LINE__);
-    return -1;
+    return NO_ERROR;
 }
 
 int HinDevImpl::release_buffer()
@@ -1029,35 +1589,30 @@ int HinDevImpl::release_buffer()
         mRecordHandle.clear();
     }
 
-    if (!mPqBufferHandle.empty()) {
-        for (int i=0; i<mPqBufferHandle.size(); i++) {
-            //mSidebandWindow->freeBuffer(&mPqBufferHandle[i].srcHandle, 1);
-            mPqBufferHandle[i].srcHandle = NULL;
-            mSidebandWindow->freeBuffer(&mPqBufferHandle[i].outHandle, 1);
-            mPqBufferHandle[i].outHandle = NULL;
-        }
-        mPqBufferHandle.clear();
-    }
-
-    if (mUseIep && !mIepBufferHandle.empty()) {
-        for (int i=0; i<mIepBufferHandle.size(); i++) {
-            mSidebandWindow->freeBuffer(&mIepBufferHandle[i].srcHandle, 1);
-            mIepBufferHandle[i].srcHandle = NULL;
-            mSidebandWindow->freeBuffer(&mIepBufferHandle[i].outHandle, 1);
-            mIepBufferHandle[i].outHandle = NULL;
-        }
-        mIepBufferHandle.clear();
-    }
+    releasePqBuffers();
+    releaseIepBuffers();
+    mPqIdleSince = 0;
+    mPqBuffersPooled = false;
 
     if (mFrameType & TYPE_STREAM_BUFFER_PRODUCER) {
+        Mutex::Autolock previewLock(mPreviewLock);
         if (!mPreviewRawHandle.empty()) {
             for (int i=0; i<mPreviewRawHandle.size(); i++) {
                 mSidebandWindow->freeBuffer(&mPreviewRawHandle[i].outHandle, 1);
                 mPreviewRawHandle[i].outHandle = NULL;
-                mHinNodeInfo->buffer_handle_poll[i] = NULL;
             }
             mPreviewRawHandle.clear();
         }
+        // capture buffers are ours only when scaling or converting, else they
+        // alias the app buffers freed above
+        for (int i=0; i<mBufferCount; i++) {
+            if (convertsPreview() && mHinNodeInfo->buffer_handle_poll[i]) {
+                mSidebandWindow->freeBuffer(&mHinNodeInfo->buffer_handle_poll[i], 0);
+            }
+            mHinNodeInfo->buffer_handle_poll[i] = NULL;
+        }
+        mPreviewSlotById.clear();
+        mPreviewSlotByInode.clear();
     } else {
         for (int i=0; i<mBufferCount; i++) {
             if (mSidebandWindow) {
@@ -1066,50 +1621,163 @@ int HinDevImpl::release_buffer()
             mHinNodeInfo->buffer_handle_poll[i] = NULL;
         }
     }
+    if (mSidebandWindow) {
+        mSidebandWindow->dumpBufferPoolStats();
+        mSidebandWindow->dumpCacheSyncStats();
+    }
     return 0;
 }
 
 int HinDevImpl::set_preview_info(int top, int left, int width, int height) {
+    Mutex::Autolock previewLock(mPreviewLock);
     mPreviewRawHandle.resize(APP_PREVIEW_BUFF_CNT);
     return 0;
 }
 
 int HinDevImpl::set_preview_buffer(buffer_handle_t rawHandle, uint64_t bufferId) {
     ALOGD("%s called, rawHandle=%p bufferId=%" PRIu64, __func__, rawHandle, bufferId);
-    int buffHandleFd = mSidebandWindow->importHidlHandleBufferLocked(rawHandle);
-    ALOGD("%s buffHandleFd=%d, after import rawHandle=%p", __FUNCTION__, buffHandleFd, rawHandle);
-    mPreviewRawHandle[mPreviewBuffIndex].bufferFd = buffHandleFd;
-    mPreviewRawHandle[mPreviewBuffIndex].bufferId = bufferId;
-    mPreviewRawHandle[mPreviewBuffIndex].outHandle = rawHandle;
-    mPreviewRawHandle[mPreviewBuffIndex].isRendering = false;
-    mPreviewRawHandle[mPreviewBuffIndex].isFilled = false;
-    mPreviewBuffIndex++;
-    if(mPreviewBuffIndex == APP_PREVIEW_BUFF_CNT) mPreviewBuffIndex = 0;
-    return 0;
-}
-
-
-int HinDevImpl::request_capture(buffer_handle_t rawHandle, uint64_t bufferId) {
+    if (!rawHandle) {
+        return BAD_VALUE;
+    }
+    // a repeated registration may carry a new handle, so import every time
+    buffer_handle_t outHandle = rawHandle;
+    int buffHandleFd = mSidebandWindow->importHidlHandleBufferLocked(outHandle);
+    if (buffHandleFd < 0) {
+        ALOGE("%s import of bufferId=%" PRIu64 " failed", __func__, bufferId);
+        return UNKNOWN_ERROR;
+    }
+    struct stat st;
+    ino_t inode = fstat(buffHandleFd, &st) == 0 ? st.st_ino : 0;
+
+    Mutex::Autolock previewLock(mPreviewLock);
+    if (mPreviewRawHandle.empty()) {
+        mSidebandWindow->freeBuffer(&outHandle, 1);
+        return NO_INIT;
+    }
+    int slot = findPreviewSlot(bufferId);
+    if (inode && (slot < 0 || mPreviewRawHandle[slot].inode != inode)) {
+        auto it = mPreviewSlotByInode.find(inode);
+        if (it != mPreviewSlotByInode.end()) {
+            slot = it->second;
+        }
+    }
+    if (slot >= 0 && inode && mPreviewRawHandle[slot].inode == inode) {
+        // same dma-buf under a new handle or id, a queued capture holds its own
+        // reference to it and the new fd names the same memory
+        setPreviewSlot(slot, outHandle, buffHandleFd, inode, bufferId);
+        ALOGD("%s bufferId=%" PRIu64 " reimported into slot %d", __FUNCTION__, bufferId, slot);
+        return 0;
+    }
+    if (slot >= 0) {
+        // the id names other memory now, a queued old slot is dropped from the
+        // lookups and refilled once the driver hands it back
+        mPreviewSlotById.erase(bufferId);
+    }
+    slot = pickPreviewSlot();
+    if (slot < 0) {
+        ALOGE("%s every slot is queued, bufferId=%" PRIu64 " not registered", __func__, bufferId);
+        mSidebandWindow->freeBuffer(&outHandle, 1);
+        return -EBUSY;
+    }
+    setPreviewSlot(slot, outHandle, buffHandleFd, inode, bufferId);
+    mPreviewBuffIndex = (slot + 1) % APP_PREVIEW_BUFF_CNT;
+    return 0;
+}
+
+int HinDevImpl::pickPreviewSlot() {
+    // the driver may be writing into a queued slot, never hand that one out;
+    // an empty or orphaned slot goes before one still registered
+    int fallback = -1;
+    for (int i = 0; i < APP_PREVIEW_BUFF_CNT; i++) {
+        int slot = (mPreviewBuffIndex + i) % APP_PREVIEW_BUFF_CNT;
+        const tv_preview_buff_app_t& previewBuff = mPreviewRawHandle[slot];
+        if (previewBuff.isQueued) {
+            continue;
+        }
+        if (!previewBuff.outHandle || findPreviewSlot(previewBuff.bufferId) != slot) {
+            return slot;
+        }
+        if (fallback < 0) {
+            fallback = slot;
+        }
+    }
+    return fallback;
+}
+
+void HinDevImpl::setPreviewSlot(int slot, buffer_handle_t outHandle, int bufferFd, ino_t inode, uint64_t bufferId) {
+    tv_preview_buff_app_t& previewBuff = mPreviewRawHandle[slot];
+    if (previewBuff.outHandle) {
+        // the replaced import, its context and mapper handle only go away
+        // through the imported free path
+        if (findPreviewSlot(previewBuff.bufferId) == slot) {
+            mPreviewSlotById.erase(previewBuff.bufferId);
+        }
+        mPreviewSlotByInode.erase(previewBuff.inode);
+        mSidebandWindow->freeBuffer(&previewBuff.outHandle, 1);
+        previewBuff.outHandle = NULL;
+    }
+    previewBuff.bufferFd = bufferFd;
+    previewBuff.bufferId = bufferId;
+    previewBuff.inode = inode;
+    previewBuff.outHandle = outHandle;
+    previewBuff.isRendering = false;
+    previewBuff.isFilled = false;
+    mPreviewSlotById[bufferId] = slot;
+    if (inode) {
+        mPreviewSlotByInode[inode] = slot;
+    }
+    if (!convertsPreview() && slot < mBufferCount && mHinNodeInfo->buffer_handle_poll[slot]
+            && (mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+        // slot replaced after aquire_buffer, keep the qbuf template in step
+        mHinNodeInfo->buffer_handle_poll[slot] = outHandle;
+        mHinNodeInfo->bufferArray[slot].m.planes[0].m.fd = bufferFd;
+    }
+}
+
+int HinDevImpl::findPreviewSlot(uint64_t bufferId) {
+    auto it = mPreviewSlotById.find(bufferId);
+    if (it == mPreviewSlotById.end()) {
+        return -1;
+    }
+    return it->second;
+}
+
+
+int HinDevImpl::request_capture(buffer_handle_t rawHandle, uint64_t bufferId) {
     //int ret;
     //int bufferIndex = -1;
     //ALOGD("rawHandle = %p,bufferId=%lld,%lld" PRIu64, rawHandle,(long long)bufferId,(long long)mPreviewRawHandle[0].bufferId);
-    int previewBufferIndex = -1;
-    for (int i=0; i<mPreviewRawHandle.size(); i++) {
-        if (mPreviewRawHandle[i].bufferId == bufferId) {
-            previewBufferIndex = i;
-            break;
+    // app buffers are queued at the v4l2 index of their slot, see aquire_buffer()
+    {
+        // start() runs on the control queue, it replays what came in before
+        bool pending = false;
+        bool dropped = false;
+        {
+            Mutex::Autolock pendingLock(mPendingCaptureLock);
+            if (mState != START && !mOpen && mHinNodeInfo != NULL) {
+                if (mPendingCaptures.size() >= APP_PREVIEW_BUFF_CNT) {
+                    ALOGW("%s drop pending bufferId %" PRIu64, __FUNCTION__, mPendingCaptures.front());
+                    mPendingCaptures.pop_front();
+                    dropped = true;
+                }
+                mPendingCaptures.push_back(bufferId);
+                pending = true;
+            }
+        }
+        if (dropped) {
+            notifyCaptureFailed();
+        }
+        if (pending) {
+            return 0;
         }
     }
-
+    Mutex::Autolock previewLock(mPreviewLock);
+    int previewBufferIndex = findPreviewSlot(bufferId);
     int bufferIndex = -1;
     int requestFd = -1;
-    for (int i=0; i<mBufferCount; i++) {
-        int fd = mHinNodeInfo->bufferArray[i].m.planes[0].m.fd;
-        if (fd == mPreviewRawHandle[previewBufferIndex].bufferFd) {
-            bufferIndex = i;
-            requestFd = fd;
-            break;
-        }
+    if (previewBufferIndex >= 0 && previewBufferIndex < mBufferCount) {
+        bufferIndex = previewBufferIndex;
+        requestFd = mHinNodeInfo->bufferArray[bufferIndex].m.planes[0].m.fd;
     }
     DEBUG_PRINT(mDebugLevel, "request_capture previewBufferIndex=%d, bufferIndex=%d, requestFd=%d, bufferId %" PRIu64,
         previewBufferIndex, bufferIndex, requestFd, bufferId);
@@ -1127,22 +1795,28 @@ int HinDevImpl::request_capture(buffer_handle_t rawHandle, uint64_t bufferId) {
         return 0;
     }
 
+    if (bufferIndex < 0) {
+        ALOGE("%s unknown bufferId %" PRIu64, __FUNCTION__, bufferId);
+        return -EINVAL;
+    }
+
     mRequestCaptureCount++;
 
     //ALOGD("rawHandle = %p, bufferId=%" PRIu64, rawHandle, bufferId);
-    for (int i=0; i<mPreviewRawHandle.size(); i++) {
-        if (mPreviewRawHandle[i].bufferId == bufferId) {
-            if (mPreviewRawHandle[i].isFilled) {
-                mPreviewRawHandle[i].isRendering = false;
-                mPreviewRawHandle[i].isFilled = false;
-                break;
-            }
-        }
+    if (mPreviewRawHandle[previewBufferIndex].isFilled) {
+        mPreviewRawHandle[previewBufferIndex].isRendering = false;
+        mPreviewRawHandle[previewBufferIndex].isFilled = false;
+    }
+    if (mPreviewRawHandle[previewBufferIndex].isQueued) {
+        ALOGW("%s bufferId %" PRIu64 " already queued", __FUNCTION__, bufferId);
+        return mHinNodeInfo->currBufferHandleIndex;
     }
     int ret = ioctl(mHinDevHandle, VIDIOC_QBUF, &mHinNodeInfo->bufferArray[bufferIndex]);
     if (ret != 0) {
         ALOGE("VIDIOC_QBUF Buffer failed err=%s bufferIndex %d requestFd=%d %" PRIu64,
             strerror(errno), bufferIndex, requestFd, bufferId);
+    } else {
+        mPreviewRawHandle[previewBufferIndex].isQueued = true;
     }
 
     ALOGV("%s end.", __FUNCTION__);
@@ -1166,6 +1840,25 @@ void HinDevImpl::wrapCaptureResultAndNotify(uint64_t buffId,buffer_handle_t hand
     	mNotifyQueueCb(result);
 }
 
+void HinDevImpl::failPendingCaptures() {
+    std::deque<uint64_t> pending;
+    {
+        Mutex::Autolock pendingLock(mPendingCaptureLock);
+        pending.swap(mPendingCaptures);
+    }
+    for (size_t i = 0; i < pending.size(); i++) {
+        notifyCaptureFailed();
+    }
+}
+
+void HinDevImpl::notifyCaptureFailed() {
+    tv_input_capture_result_t result;
+    result.buff_id = -1;
+    if (mNotifyQueueCb != NULL) {
+        mNotifyQueueCb(result);
+    }
+}
+
 void OnInputAvailableCB(int32_t index){
     //ALOGD("InputAvailable index = %d",index);
     if (!mRecordHandle.empty()){
@@ -1179,6 +1872,12 @@ void OnInputAvailableCB(int32_t index){
 int HinDevImpl::init_encodeserver(MppEncodeServer::MetaInfo* info) {
     if (gMppEnCodeServer == nullptr) {
         gMppEnCodeServer = new MppEncodeServer();
+        mPipelineDirty = true;
+    }
+    if (Prewarmer::Wait("mpp", mMppReady) && mPrewarmedMppCtx != nullptr) {
+        gMppEnCodeServer->adoptContext(mPrewarmedMppCtx, mPrewarmedMpi);
+        mPrewarmedMppCtx = nullptr;
+        mPrewarmedMpi = nullptr;
     }
 
     if (!gMppEnCodeServer->init(info)) {
@@ -1197,12 +1896,21 @@ void HinDevImpl::deinit_encodeserver() {
     if(gMppEnCodeServer!=nullptr){
         delete gMppEnCodeServer;
         gMppEnCodeServer = nullptr;
+        mPipelineDirty = true;
     }
 }
 
 void HinDevImpl::stopRecord() {
-    if (gMppEnCodeServer != nullptr) {
-        gMppEnCodeServer->stop();
+    // called with mCaptureLock held, so nothing posts a new record frame; this
+    // only waits for the one the pipeline worker may still be filling
+    mPipeline.Flush();
+    if (gMppEnCodeServer != nullptr && !gMppEnCodeServer->stop() && gMppEnCodeServer->stuck()) {
+        // the encode loop may still read the server and the record buffers
+        ALOGE("%s encoder stuck, leaking it and the record buffers", __FUNCTION__);
+        gMppEnCodeServer = nullptr;
+        mPipelineDirty = true;
+        mRecordHandle.clear();
+        return;
     }
     deinit_encodeserver();
     if (!mRecordHandle.empty()){
@@ -1219,8 +1927,17 @@ void HinDevImpl::doRecordCmd(const map<string, string> data) {
     if (mState != START) {
         return;
     }
+    // mRecordHandle and the encoder change below: keep the work thread from
+    // posting frames until we are done, then drain the one in flight
+    mCaptureReactor.Wakeup();
+    Mutex::Autolock captureLock(mCaptureLock);
+    mPipeline.Flush();
     int width = mSrcFrameWidth;
     int height = mSrcFrameHeight;
+    if (!mRecordHandle.empty()) {
+        width = mRecordHandle[0].width;
+        height = mRecordHandle[0].height;
+    }
     if (mFrameFps < 1) {
         ioctl(mHinDevHandle, RK_HDMIRX_CMD_GET_FPS, &mFrameFps);
         ALOGD("%s RK_HDMIRX_CMD_GET_FPS %d", __FUNCTION__, mFrameFps);
@@ -1236,10 +1953,35 @@ void HinDevImpl::doRecordCmd(const map<string, string> data) {
                 allowRecord = false;
             } else if (it.second.compare("1") == 0) {
                 if (mRecordHandle.empty()) {
+                    // admission control: record at half size when the full size
+                    // doesn't fit the memory budget, refuse when neither does
+                    int64_t needed = (int64_t)width * height * 3 / 2 * SIDEBAND_RECORD_BUFF_CNT;
+                    int64_t headroom = mSidebandWindow->getMemoryHeadroom();
+                    if (needed > headroom) {
+                        // nv24 is converted by the cpu, which can't scale
+                        if (mPixelFormat != V4L2_PIX_FMT_NV24 && needed / 4 <= headroom) {
+                            width = _ALIGN(width / 2, 2);
+                            height = _ALIGN(height / 2, 2);
+                            ALOGW("%s memory budget: record at %dx%d, %" PRId64 " bytes left",
+                                __FUNCTION__, width, height, headroom);
+                        } else {
+                            ALOGE("%s memory budget: refuse record, need %" PRId64 " have %" PRId64,
+                                __FUNCTION__, needed, headroom);
+                            mSidebandWindow->dumpMemoryStats(NULL);
+                            return;
+                        }
+                    }
                     mRecordHandle.resize(SIDEBAND_RECORD_BUFF_CNT);
+                    mSidebandWindow->prefetchInternalHandle(width, height, HAL_PIXEL_FORMAT_YCrCb_NV12,
+                        RK_GRALLOC_USAGE_STRIDE_ALIGN_64, SIDEBAND_RECORD_BUFF_CNT, common::BUFFER_PURPOSE_RECORD);
                     for (int i=0; i<mRecordHandle.size(); i++) {
-                        mSidebandWindow->allocateSidebandHandle(&mRecordHandle[i].outHandle,
-                            width, height, HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
+                        if (mSidebandWindow->allocateInternalHandle(&mRecordHandle[i].outHandle,
+                                width, height, HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64,
+                                common::BUFFER_PURPOSE_RECORD) != 0) {
+                            ALOGE("%s allocate record buffer %d failed", __FUNCTION__, i);
+                            stopRecord();
+                            return;
+                        }
                         mRecordHandle[i].width = width;
                         mRecordHandle[i].height = height;
                         mRecordHandle[i].verStride = width;//_ALIGN(width, 16);
@@ -1294,6 +2036,7 @@ void HinDevImpl::doRecordCmd(const map<string, string> data) {
 }
 
 void HinDevImpl::doPQCmd(const map<string, string> data) {
+    mPipelineDirty = true;
     if (mState != START) {
         mPqMode = PQ_OFF;
         return;
@@ -1333,6 +2076,10 @@ void HinDevImpl::doPQCmd(const map<string, string> data) {
            delete mRkpq;
            mRkpq = nullptr;
         }
+        if (!mPqBufferHandle.empty() || !mIepBufferHandle.empty()) {
+            mPqIdleSince = systemTime();
+        }
+        mPqFramePending = false;
 
         if (mRkiep!=nullptr) {
            delete mRkiep;
@@ -1340,29 +2087,15 @@ void HinDevImpl::doPQCmd(const map<string, string> data) {
         }
 
     } else if(mPqMode == PQ_OFF) {
-        if (mPqBufferHandle.empty()) {
-            mPqBufferHandle.resize(SIDEBAND_PQ_BUFF_CNT);
-            for (int i=0; i<mPqBufferHandle.size(); i++) {
-                //mSidebandWindow->allocateSidebandHandle(&mPqBufferHandle[i].srcHandle, -1, -1, -1);
-                mSidebandWindow->allocateSidebandHandle(&mPqBufferHandle[i].outHandle, mDstFrameWidth, mDstFrameHeight,
-                    HAL_PIXEL_FORMAT_YCrCb_NV12_10, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
-            }
-            ALOGD("%s all pqbufferhandle", __FUNCTION__);
-        }
+        // the buffers themselves are set up by the pq thread once a frame
+        // actually needs them, a quick re-enable finds them still held
+        mPqIdleSince = 0;
         for (int i=0; i<mPqBufferHandle.size(); i++) {
             mPqBufferHandle[i].isFilled = false;
         }
 
         if (mUseIep) {
-            if (mIepBufferHandle.empty()) {
-                mIepBufferHandle.resize(SIDEBAND_IEP_BUFF_CNT);
-                for (int i=0; i<mIepBufferHandle.size(); i++) {
-                    mSidebandWindow->allocateSidebandHandle(&mIepBufferHandle[i].srcHandle, mDstFrameWidth, mDstFrameHeight,
-                    HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
-                    mSidebandWindow->allocateSidebandHandle(&mIepBufferHandle[i].outHandle, mDstFrameWidth, mDstFrameHeight,
-                    HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64);
-                }
-            }
+            Mutex::Autolock iepLock(mIepBufferLock);
             for (int i=0; i<mIepBufferHandle.size(); i++) {
                 mIepBufferHandle[i].isFilled = false;
             }
@@ -1373,7 +2106,12 @@ void HinDevImpl::doPQCmd(const map<string, string> data) {
         mPqBuffIndex = 0;
         mPqBuffOutIndex = 0;
         if (mRkpq == nullptr) {
-            mRkpq = new rkpq();
+            if (Prewarmer::Wait("rkpq", mPqReady) && mPrewarmedPq != nullptr) {
+                mRkpq = mPrewarmedPq;
+                mPrewarmedPq = nullptr;
+            } else {
+                mRkpq = new rkpq();
+            }
             int fmt = getPqFmt(mPixelFormat);
             uint32_t width_stride[2] = {0 , 0};
             if (mSrcFrameWidth != _ALIGN(mSrcFrameWidth, 64)) {
@@ -1441,6 +2179,252 @@ void HinDevImpl::doPQCmd(const map<string, string> data) {
     ALOGD("%s mStartPQ pqMode=%d", __FUNCTION__, mPqMode);
 }
 
+void HinDevImpl::allocPqBuffers() {
+    Mutex::Autolock pqLock(mPqBufferLock);
+    if (!mPqBufferHandle.empty()) {
+        return;
+    }
+    mPqBufferHandle.resize(SIDEBAND_PQ_BUFF_CNT);
+    // rkpq only gets the fd and writes linear nv12 10bit, keep the layout linear
+    uint64_t pqOutUsage = RK_GRALLOC_USAGE_STRIDE_ALIGN_64;
+    mSidebandWindow->prefetchInternalHandle(mDstFrameWidth, mDstFrameHeight,
+        HAL_PIXEL_FORMAT_YCrCb_NV12_10, pqOutUsage, SIDEBAND_PQ_BUFF_CNT, common::BUFFER_PURPOSE_PQ);
+    for (int i=0; i<mPqBufferHandle.size(); i++) {
+        mSidebandWindow->allocateInternalHandle(&mPqBufferHandle[i].outHandle, mDstFrameWidth, mDstFrameHeight,
+            HAL_PIXEL_FORMAT_YCrCb_NV12_10, pqOutUsage, common::BUFFER_PURPOSE_PQ);
+        mPqBufferHandle[i].isFilled = false;
+    }
+    mPqBuffIndex = 0;
+    mPqBuffOutIndex = 0;
+    ALOGD("%s all pqbufferhandle", __FUNCTION__);
+    mSidebandWindow->dumpBufferPoolStats();
+}
+
+void HinDevImpl::releasePqBuffers() {
+    Mutex::Autolock pqLock(mPqBufferLock);
+    if (mPqBufferHandle.empty()) {
+        return;
+    }
+    for (int i=0; i<mPqBufferHandle.size(); i++) {
+        if (mPqBufferHandle[i].isFilled && mPqBufferHandle[i].srcIndex >= 0) {
+            releaseFrame(mPqBufferHandle[i].srcIndex, FRAME_OWNER_PQ);
+        }
+        mPqBufferHandle[i].srcIndex = -1;
+        mPqBufferHandle[i].srcHandle = NULL;
+        mSidebandWindow->freeBuffer(&mPqBufferHandle[i].outHandle, 1);
+        mPqBufferHandle[i].outHandle = NULL;
+    }
+    mPqBufferHandle.clear();
+}
+
+void HinDevImpl::resetFrameRefs() {
+    Mutex::Autolock autoLock(mFrameRefLock);
+    for (int i = 0; i < SIDEBAND_WINDOW_BUFF_CNT; i++) {
+        mFrameRefs[i].refs = 0;
+        mFrameRefs[i].owners = FRAME_OWNER_DRIVER;
+    }
+    mDisplayFrameIndex = -1;
+}
+
+void HinDevImpl::acquireFrame(int index, uint32_t owner) {
+    if (index < 0 || index >= mBufferCount) {
+        return;
+    }
+    Mutex::Autolock autoLock(mFrameRefLock);
+    mFrameRefs[index].refs++;
+    mFrameRefs[index].owners = (mFrameRefs[index].owners & ~FRAME_OWNER_DRIVER) | owner;
+}
+
+void HinDevImpl::releaseFrame(int index, uint32_t owner) {
+    if (index < 0 || index >= mBufferCount) {
+        return;
+    }
+    Mutex::Autolock autoLock(mFrameRefLock);
+    tv_frame_ref_t& ref = mFrameRefs[index];
+    if (ref.refs <= 0 || !(ref.owners & owner)) {
+        ALOGW("%s index=%d owner=0x%x not held, owners=0x%x refs=%d", __FUNCTION__,
+            index, owner, ref.owners, ref.refs);
+        return;
+    }
+    ref.owners &= ~owner;
+    if (--ref.refs > 0) {
+        return;
+    }
+    ref.owners = FRAME_OWNER_DRIVER;
+    // streamoff already took every buffer back
+    if (mState != START) {
+        return;
+    }
+    int ret = ioctl(mHinDevHandle, VIDIOC_QBUF, &mHinNodeInfo->bufferArray[index]);
+    if (ret != 0) {
+        DEBUG_PRINT(3, "VIDIOC_QBUF Buffer failed %s", strerror(errno));
+    } else {
+        DEBUG_PRINT(mDebugLevel, "VIDIOC_QBUF %d successful.", index);
+    }
+}
+
+int HinDevImpl::countFrames(uint32_t owner) {
+    Mutex::Autolock autoLock(mFrameRefLock);
+    int count = 0;
+    for (int i = 0; i < mBufferCount; i++) {
+        if (mFrameRefs[i].owners & owner) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void HinDevImpl::setDisplayFrame(int index) {
+    int last = -1;
+    {
+        Mutex::Autolock autoLock(mFrameRefLock);
+        last = mDisplayFrameIndex;
+        mDisplayFrameIndex = index;
+    }
+    // the plane scans the old buffer out until the new one is committed
+    if (last >= 0) {
+        releaseFrame(last, FRAME_OWNER_DISPLAY);
+    }
+}
+
+void HinDevImpl::dumpFrameRefs(std::string* out) {
+    static const struct {
+        uint32_t owner;
+        const char* name;
+    } kOwners[] = {
+        {FRAME_OWNER_DRIVER, "driver"},
+        {FRAME_OWNER_CAPTURE, "capture"},
+        {FRAME_OWNER_DISPLAY, "display"},
+        {FRAME_OWNER_PQ, "pq"},
+        {FRAME_OWNER_RECORD, "record"},
+    };
+    Mutex::Autolock autoLock(mFrameRefLock);
+    char line[64];
+    for (int i = 0; i < mBufferCount && i < SIDEBAND_WINDOW_BUFF_CNT; i++) {
+        snprintf(line, sizeof(line), "%s%d:%d[", i ? " " : "", i, mFrameRefs[i].refs);
+        out->append(line);
+        bool first = true;
+        for (size_t j = 0; j < sizeof(kOwners) / sizeof(kOwners[0]); j++) {
+            if (mFrameRefs[i].owners & kOwners[j].owner) {
+                out->append(first ? "" : ",");
+                out->append(kOwners[j].name);
+                first = false;
+            }
+        }
+        out->append("]");
+    }
+}
+
+void HinDevImpl::allocIepBuffers() {
+    Mutex::Autolock iepLock(mIepBufferLock);
+    if (!mIepBufferHandle.empty()) {
+        return;
+    }
+    mIepBufferHandle.resize(SIDEBAND_IEP_BUFF_CNT);
+    // src and out share geometry, fetch both sets at once
+    mSidebandWindow->prefetchInternalHandle(mDstFrameWidth, mDstFrameHeight,
+        HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64, SIDEBAND_IEP_BUFF_CNT * 2,
+        common::BUFFER_PURPOSE_IEP);
+    for (int i=0; i<mIepBufferHandle.size(); i++) {
+        mSidebandWindow->allocateInternalHandle(&mIepBufferHandle[i].srcHandle, mDstFrameWidth, mDstFrameHeight,
+            HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64, common::BUFFER_PURPOSE_IEP);
+        mSidebandWindow->allocateInternalHandle(&mIepBufferHandle[i].outHandle, mDstFrameWidth, mDstFrameHeight,
+            HAL_PIXEL_FORMAT_YCrCb_NV12, RK_GRALLOC_USAGE_STRIDE_ALIGN_64, common::BUFFER_PURPOSE_IEP);
+        mIepBufferHandle[i].isFilled = false;
+    }
+    mIepBuffIndex = 0;
+    mIepBuffOutIndex = 0;
+}
+
+void HinDevImpl::releaseIepBuffers() {
+    Mutex::Autolock iepLock(mIepBufferLock);
+    if (mIepBufferHandle.empty()) {
+        return;
+    }
+    for (int i=0; i<mIepBufferHandle.size(); i++) {
+        mSidebandWindow->freeBuffer(&mIepBufferHandle[i].srcHandle, 1);
+        mIepBufferHandle[i].srcHandle = NULL;
+        mSidebandWindow->freeBuffer(&mIepBufferHandle[i].outHandle, 1);
+        mIepBufferHandle[i].outHandle = NULL;
+    }
+    mIepBufferHandle.clear();
+}
+
+void HinDevImpl::prefetchStandbySets() {
+    int sets = property_get_int32(TV_INPUT_STANDBY_SETS, 2);
+    if (sets <= 1) {
+        return;
+    }
+    // sets beyond what the pool keeps would only be evicted again
+    int64_t budget = (int64_t)property_get_int32(TV_INPUT_POOL_BUDGET, 64) << 20;
+    int64_t headroom = mSidebandWindow->getMemoryHeadroom();
+    bool pq = property_get_int32(TV_INPUT_PQ_ENABLE, 0) != 0;
+    uint64_t pqOutUsage = RK_GRALLOC_USAGE_STRIDE_ALIGN_64;
+    std::vector<tv_timing_t> recent = TimingCache::GetInstance()->GetRecent(sets);
+    for (int i = 0; i < recent.size(); i++) {
+        const tv_timing_t& t = recent[i];
+        if (t.width == mSrcFrameWidth && t.height == mSrcFrameHeight && t.pixelFormat == (uint32_t)mPixelFormat) {
+            continue;
+        }
+        int64_t bytes = (int64_t)t.width * t.height * FormatNegotiator::GetBitsPerPixel(t.pixelFormat) / 8 * mBufferCount;
+        if (pq) {
+            // nv12 10bit
+            bytes += (int64_t)t.width * t.height * 15 / 8 * SIDEBAND_PQ_BUFF_CNT;
+        }
+        if (bytes <= 0 || bytes > budget || bytes > headroom) {
+            ALOGD("%s skip %dx%d fmt 0x%x, %" PRId64 " bytes over budget", __FUNCTION__,
+                t.width, t.height, t.pixelFormat, bytes);
+            continue;
+        }
+        mSidebandWindow->prefetchBuffer(t.width, t.height, getNativeWindowFormat(t.pixelFormat), mBufferCount);
+        if (pq) {
+            mSidebandWindow->prefetchInternalHandle(t.width, t.height,
+                HAL_PIXEL_FORMAT_YCrCb_NV12_10, pqOutUsage, SIDEBAND_PQ_BUFF_CNT, common::BUFFER_PURPOSE_PQ);
+        }
+        budget -= bytes;
+        headroom -= bytes;
+        ALOGD("%s standby set %dx%d fmt 0x%x, %" PRId64 " bytes", __FUNCTION__,
+            t.width, t.height, t.pixelFormat, bytes);
+    }
+    mSidebandWindow->dumpBufferPoolStats();
+}
+
+void HinDevImpl::checkPqIdle() {
+    if (mPqIdleSince == 0) {
+        return;
+    }
+    int idleMs = property_get_int32(TV_INPUT_PQ_IDLE_MS, 3000);
+    if (idleMs <= 0) {
+        return;
+    }
+    nsecs_t idle = systemTime() - mPqIdleSince;
+    if (!mPqBufferHandle.empty() || !mIepBufferHandle.empty()) {
+        // first step: hand them back to the pool, re-enabling still
+        // skips the allocator
+        if (idle >= ms2ns(idleMs)) {
+            ALOGD("%s pq idle %dms, release pq/iep buffers", __FUNCTION__, idleMs);
+            mPqPooledWidth = mDstFrameWidth;
+            mPqPooledHeight = mDstFrameHeight;
+            releasePqBuffers();
+            releaseIepBuffers();
+            mPqBuffersPooled = true;
+            mSidebandWindow->dumpMemoryStats(NULL);
+        }
+    } else if (mPqBuffersPooled) {
+        // second step: give the memory back
+        if (idle >= ms2ns(idleMs) * 2) {
+            ALOGD("%s pq idle %dms, trim pooled pq/iep buffers", __FUNCTION__, idleMs * 2);
+            // only the pq/iep geometries, capture and standby sets stay warm
+            mSidebandWindow->trimBufferPool(mPqPooledWidth, mPqPooledHeight, HAL_PIXEL_FORMAT_YCrCb_NV12_10);
+            mSidebandWindow->trimBufferPool(mPqPooledWidth, mPqPooledHeight, HAL_PIXEL_FORMAT_YCrCb_NV12);
+            mPqBuffersPooled = false;
+            mPqIdleSince = 0;
+        }
+    } else {
+        mPqIdleSince = 0;
+    }
+}
+
 int HinDevImpl::getPqFmt(int V4L2Fmt) {
     if (V4L2_PIX_FMT_BGR24 == V4L2Fmt) {
         return RKPQ_IMG_FMT_BG24;
@@ -1467,12 +2451,41 @@ int HinDevImpl::deal_priv_message(const std::string action, const std::map<std::
         Mutex::Autolock autoLock(mBufferLock);
         if (mFrameType & TYPF_SIDEBAND_WINDOW && NULL != mSidebandHandle) {
             //mSidebandWindow->clearVopArea();
-            stopRecord();
+            {
+                mCaptureReactor.Wakeup();
+                Mutex::Autolock captureLock(mCaptureLock);
+                stopRecord();
+            }
             if (mSignalHandle != NULL && mWorkThread != NULL) {
                 mSidebandWindow->show(mSignalHandle, FULL_SCREEN);
             }
         }
         return 1;
+    } else if (action.compare("meminfo") == 0) {
+        if (mSidebandWindow) {
+            std::string info;
+            mSidebandWindow->dumpMemoryStats(&info);
+            property_set(TV_INPUT_MEM_INFO, info.c_str());
+        }
+        return 1;
+    } else if (action.compare("pipeinfo") == 0) {
+        std::string info;
+        mPipeline.DumpStats(&info);
+        ALOGD("%s", info.c_str());
+        // the full line is in the log, the property only takes what fits
+        if (info.size() >= PROPERTY_VALUE_MAX) {
+            info.resize(PROPERTY_VALUE_MAX - 1);
+        }
+        if (property_set(TV_INPUT_PIPE_INFO, info.c_str()) != 0) {
+            ALOGE("%s failed to set %s", __FUNCTION__, TV_INPUT_PIPE_INFO);
+        }
+        return 1;
+    } else if (action.compare("frameinfo") == 0) {
+        std::string info;
+        dumpFrameRefs(&info);
+        ALOGD("%s", info.c_str());
+        property_set(TV_INPUT_FRAME_INFO, info.c_str());
+        return 1;
     } else if (action.compare("refresh_hotcfg") == 0) {
         char prop_value[PROPERTY_VALUE_MAX] = {0};
         property_get(TV_INPUT_DISPLAY_RATIO, prop_value, "0");
@@ -1532,10 +2545,38 @@ void HinDevImpl::buffDataTransfer(buffer_handle_t srcHandle, int srcFmt, int src
     }
 }
 
+bool HinDevImpl::check_plane_payload(struct v4l2_buffer *buf)
+{
+    if (buf->flags & V4L2_BUF_FLAG_ERROR) {
+        DEBUG_PRINT(3, "%s buffer %d flagged error, drop", __FUNCTION__, buf->index);
+        return false;
+    }
+    if (!(mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+        return true;
+    }
+    struct v4l2_pix_format_mplane *pixMp = &mHinNodeInfo->format.fmt.pix_mp;
+    for (int i = 0; i < (int)buf->length; i++) {
+        struct v4l2_plane *plane = &buf->m.planes[i];
+        DEBUG_PRINT(mDebugLevel, "%s buffer %d plane %d bytesused=%d data_offset=%d", __FUNCTION__,
+            buf->index, i, plane->bytesused, plane->data_offset);
+        if (plane->bytesused == 0 || plane->data_offset > plane->bytesused) {
+            DEBUG_PRINT(3, "%s buffer %d plane %d bad payload bytesused=%d data_offset=%d, drop", __FUNCTION__,
+                buf->index, i, plane->bytesused, plane->data_offset);
+            return false;
+        }
+        if (plane->bytesused - plane->data_offset < pixMp->plane_fmt[i].sizeimage) {
+            DEBUG_PRINT(mDebugLevel, "%s buffer %d plane %d short payload %d < %d", __FUNCTION__,
+                buf->index, i, plane->bytesused - plane->data_offset, pixMp->plane_fmt[i].sizeimage);
+        }
+    }
+    return true;
+}
+
 int HinDevImpl::workThread()
 {
     int ret;
     pthread_t tid=0;
+    Mutex::Autolock captureLock(mCaptureLock);
     if (mState == START /*&& !mFirstRequestCapture*/ && mRequestCaptureCount > 0) {
         //DEBUG_PRINT(3, "%s %d currBufferHandleIndex = %d", __FUNCTION__, __LINE__, mHinNodeInfo->currBufferHandleIndex);
  	//mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex].flags = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE |
@@ -1549,25 +2590,60 @@ int HinDevImpl::workThread()
             mRequestCaptureCount--;
         }
 
-        int ts;
-        fd_set fds;
-        struct timeval tv;
-        FD_ZERO(&fds);
-        FD_SET(mHinDevHandle, &fds);
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        ts = select(mHinDevHandle + 1, &fds, NULL, NULL, &tv);
+        bool woken = false;
+        mCaptureReady = false;
+        int ts = mCaptureReactor.PollOnce(1000, &woken);
         if (mDebugLevel) {
             tid = pthread_self();
             for (int i = 0; i < SIDEBAND_WINDOW_BUFF_CNT; i++) {
                DEBUG_PRINT(mDebugLevel, "==now tid=%lu, i=%d, index=%d, fd=%d", tid, i, mHinNodeInfo->bufferArray[i].index, mHinNodeInfo->bufferArray[i].m.planes[0].m.fd);
             }
         }
-        if(ts == 0 || mState != START) {
+        if(ts <= 0 || !mCaptureReady || mState != START) {
             return 0;
         }
 
-        ret = ioctl(mHinDevHandle, VIDIOC_DQBUF, &mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex]);
+        // buffers held by pq or the display come back out of order, so dequeue
+        // into scratch and continue with whatever index the driver returned
+        struct v4l2_plane dqPlanes[VIDEO_MAX_PLANES];
+        struct v4l2_buffer dqBuf;
+        memset(dqPlanes, 0, sizeof(dqPlanes));
+        memset(&dqBuf, 0, sizeof(dqBuf));
+        dqBuf.type = TVHAL_V4L2_BUF_TYPE;
+        dqBuf.memory = TVHAL_V4L2_BUF_MEMORY_TYPE;
+        if (mHinNodeInfo->cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+            dqBuf.m.planes = dqPlanes;
+            dqBuf.length = mHinNodeInfo->numPlanes;
+        }
+        ret = ioctl(mHinDevHandle, VIDIOC_DQBUF, &dqBuf);
+        if (ret == 0 && dqBuf.index < (unsigned int)mBufferCount) {
+            struct v4l2_buffer* slot = &mHinNodeInfo->bufferArray[dqBuf.index];
+            struct v4l2_plane* planes = slot->m.planes;
+            *slot = dqBuf;
+            if (planes) {
+                // the driver reports the fds of the queue time, an app buffer
+                // reimported since then left the template with newer ones
+                int fds[VIDEO_MAX_PLANES];
+                for (int i = 0; i < mHinNodeInfo->numPlanes; i++) {
+                    fds[i] = planes[i].m.fd;
+                }
+                memcpy(planes, dqPlanes, sizeof(struct v4l2_plane) * mHinNodeInfo->numPlanes);
+                for (int i = 0; i < mHinNodeInfo->numPlanes; i++) {
+                    planes[i].m.fd = fds[i];
+                }
+                slot->m.planes = planes;
+            }
+            mHinNodeInfo->currBufferHandleIndex = dqBuf.index;
+            if (mFrameType & TYPF_SIDEBAND_WINDOW) {
+                acquireFrame(dqBuf.index, FRAME_OWNER_CAPTURE);
+            } else if (!convertsPreview() || mConvertThread == NULL) {
+                // a converted slot stays busy until convertThread is done with it
+                Mutex::Autolock previewLock(mPreviewLock);
+                if (dqBuf.index < mPreviewRawHandle.size()) {
+                    mPreviewRawHandle[dqBuf.index].isQueued = false;
+                }
+            }
+        }
         if (ret < 0) {
             DEBUG_PRINT(3, "VIDIOC_DQBUF Failed, error: %s", strerror(errno));
             return 0;
@@ -1582,6 +2658,13 @@ int HinDevImpl::workThread()
             return NO_ERROR;
         }
 
+        if (!check_plane_payload(&mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex])
+                && (mFrameType & TYPF_SIDEBAND_WINDOW)) {
+            releaseFrame(mHinNodeInfo->currBufferHandleIndex, FRAME_OWNER_CAPTURE);
+            mHinNodeInfo->currBufferHandleIndex++;
+            return NO_ERROR;
+        }
+
         if (mEnableDump == 1) {
             if (mDumpType == 0 && mDumpFrameCount > 0) {
                 char fileName[128] = {0};
@@ -1598,114 +2681,243 @@ int HinDevImpl::workThread()
         mSidebandWindow->setDebugLevel(mDebugLevel);
 
         if (mFrameType & TYPF_SIDEBAND_WINDOW) {
-            // add flushCache to prevent image tearing and ghosting caused by
-            // cache consistency issues
+            if (mPipelineDirty.exchange(false)) {
+                buildPipeline();
+            }
             int currPreviewHandlerIndex = mHinNodeInfo->currBufferHandleIndex;
-            ret = mSidebandWindow->flushCache(
-                mHinNodeInfo->buffer_handle_poll[currPreviewHandlerIndex]);
+            ret = mPipeline.Run(currPreviewHandlerIndex);
+            releaseFrame(currPreviewHandlerIndex, FRAME_OWNER_CAPTURE);
             if (ret != 0) {
-                DEBUG_PRINT(3, "mSidebandWindow->flushCache failed !!!");
                 return ret;
             }
-
-            if (mPqMode != PQ_OFF && !mPqBufferHandle.empty()) {
-                if (mPqBufferHandle[mPqBuffIndex].isFilled) {
-                    DEBUG_PRINT(3, "skip pq buffer");
-                } else {
-                    mPqBufferHandle[mPqBuffIndex].srcHandle = mHinNodeInfo->buffer_handle_poll[currPreviewHandlerIndex];
-                    mPqBufferHandle[mPqBuffIndex].isFilled = true;
-                    mPqBuffIndex++;
-                    if (mPqBuffIndex == SIDEBAND_PQ_BUFF_CNT) {
-                        mPqBuffIndex = 0;
-                    }
-                }
-            }
-
-            if (((mPqMode & PQ_LF_RANGE) == PQ_LF_RANGE && mPixelFormat == V4L2_PIX_FMT_BGR24)
-                    || (mPqMode & PQ_NORMAL) == PQ_NORMAL || mPqIniting) {
-                    if(mDebugLevel == 3)
-                        ALOGE("workThread mSidebandWindow no show, mPqMode %d mPixelFormat %d mPqIniting %d", mPqMode, V4L2_PIX_FMT_BGR24, mPqIniting);
+        } else {
+            unsigned int slot = mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex].index;
+            if (convertsPreview() && mConvertThread != NULL) {
+                // hand the conversion over and go back to dequeuing
+                Mutex::Autolock autoLock(mConvertLock);
+                mConvertQueue.push_back(slot);
+                mConvertCond.signal();
             } else {
-                if (mSkipFrame > 0) {
-                    mSkipFrame--;
-                    DEBUG_PRINT(3, "mSkipFrame not to show %d", mSkipFrame);
-                } else {
-                    if (mDebugLevel == 3) {
-                        ALOGE("sidebandwindow show index=%d", currPreviewHandlerIndex);
+                // a slot whose id was registered again with other memory only
+                // comes back to be refilled, its frame isn't for anyone
+                uint64_t bufferId = 0;
+                buffer_handle_t outHandle = NULL;
+                {
+                    Mutex::Autolock previewLock(mPreviewLock);
+                    if (slot < mPreviewRawHandle.size() && findPreviewSlot(mPreviewRawHandle[slot].bufferId) == (int)slot) {
+                        bufferId = mPreviewRawHandle[slot].bufferId;
+                        outHandle = mPreviewRawHandle[slot].outHandle;
                     }
-                    mSidebandWindow->show(
-                        mHinNodeInfo->buffer_handle_poll[currPreviewHandlerIndex], mDisplayRatio);
+                }
+                if (outHandle) {
+                    wrapCaptureResultAndNotify(bufferId, outHandle);
                 }
             }
+        }
+        debugShowFPS();
+        mHinNodeInfo->currBufferHandleIndex++;
+    }
+    return NO_ERROR;
+}
 
-//encode:sendFrame
-            if (gMppEnCodeServer != nullptr && gMppEnCodeServer->mThreadEnabled.load()) {
-                RKMppEncApi::MyDmaBuffer_t inDmaBuf;
-                memset(&inDmaBuf, 0, sizeof(RKMppEncApi::MyDmaBuffer_t));
-                inDmaBuf.fd = -1;
-                if(!mRecordHandle.empty()) {
-                    tv_record_buffer_info_t recordBuffer = mRecordHandle[mRecordCodingBuffIndex];
-                    if (!recordBuffer.isCoding) {
-                        buffDataTransfer(mHinNodeInfo->buffer_handle_poll[currPreviewHandlerIndex], mPixelFormat,
-                            mSrcFrameWidth, mSrcFrameHeight,
-                            recordBuffer.outHandle, V4L2_PIX_FMT_NV12,
-                            recordBuffer.width, recordBuffer.height, recordBuffer.verStride, recordBuffer.horStride);
-                        inDmaBuf.fd = recordBuffer.outHandle->data[0];
-                    }
-                }
-                if (inDmaBuf.fd == -1) {
-                    DEBUG_PRINT(3, "skip record");
-                } else if (gMppEnCodeServer != nullptr) {
-                inDmaBuf.size = gMppEnCodeServer->mEncoder->mHorStride *
-                                gMppEnCodeServer->mEncoder->mVerStride * 3 / 2;
-                inDmaBuf.handler =
-                    (void *)mHinNodeInfo
-                    ->buffer_handle_poll[currPreviewHandlerIndex];
-                inDmaBuf.index = mRecordCodingBuffIndex;
-                mRecordHandle[mRecordCodingBuffIndex].isCoding = true;
-                mRecordCodingBuffIndex++;
-                if (mRecordCodingBuffIndex == SIDEBAND_RECORD_BUFF_CNT) {
-                    mRecordCodingBuffIndex = 0;
-                }
-                mLastTime = systemTime();
-                bool enc_ret = gMppEnCodeServer->mEncoder->sendFrame(
-                                   (RKMppEncApi::MyDmaBuffer_t)inDmaBuf,
-                                   getBufSize(V4L2_PIX_FMT_NV12, mSrcFrameWidth, mSrcFrameHeight),
-                                   systemTime(), 0);
+void HinDevImpl::buildPipeline() {
+    mPipeline.Begin(mPixelFormat);
+    mPipeline.AddStage("flush", 0, 0, [this](int index) { return stageFlushCache(index); });
+    if (mPqMode != PQ_OFF) {
+        mPipeline.AddStage("pq", 0, 0, [this](int index) { return stageQueuePq(index); });
+    }
+    mPipeline.AddStage("show", 0, 0, [this](int index) { return stageShow(index); });
+    if (gMppEnCodeServer != nullptr) {
+        mPipeline.AddStage("record", 0, V4L2_PIX_FMT_NV12, [this](int index) { return stageRecord(index); },
+            true);
+    }
+    std::string info;
+    mPipeline.DumpStats(&info);
+    ALOGD("%s %s", __FUNCTION__, info.c_str());
+}
 
-                now = systemTime();
-                diff = now - mLastTime;
+int HinDevImpl::stageFlushCache(int index) {
+    // add flushCache to prevent image tearing and ghosting caused by
+    // cache consistency issues
+    int ret = mSidebandWindow->flushCache(mHinNodeInfo->buffer_handle_poll[index]);
+    if (ret != 0) {
+        DEBUG_PRINT(3, "mSidebandWindow->flushCache failed !!!");
+    }
+    return ret;
+}
 
-                if (!enc_ret) {
-                    DEBUG_PRINT(3, "sendFrame failed");
-                }
-                }
+int HinDevImpl::stageQueuePq(int index) {
+    Mutex::Autolock pqLock(mPqBufferLock);
+    if (mPqMode != PQ_OFF && mPqBufferHandle.empty()) {
+        mPqFramePending = true;
+    } else if (mPqMode != PQ_OFF) {
+        if (mPqBufferHandle[mPqBuffIndex].isFilled) {
+            DEBUG_PRINT(3, "skip pq buffer");
+        } else if (countFrames(FRAME_OWNER_PQ) >= mBufferCount - 1
+                || countFrames(FRAME_OWNER_DRIVER) == 0) {
+            // pq has as many slots as there are capture buffers, leave the
+            // driver at least this one to capture into
+            DEBUG_PRINT(mDebugLevel, "skip pq buffer, capture pool low");
+        } else {
+            acquireFrame(index, FRAME_OWNER_PQ);
+            mPqBufferHandle[mPqBuffIndex].srcHandle = mHinNodeInfo->buffer_handle_poll[index];
+            mPqBufferHandle[mPqBuffIndex].srcIndex = index;
+            mPqBufferHandle[mPqBuffIndex].isFilled = true;
+            mPqBuffIndex++;
+            if (mPqBuffIndex == SIDEBAND_PQ_BUFF_CNT) {
+                mPqBuffIndex = 0;
             }
-//start encode threads
-             if (gMppEnCodeServer != nullptr && !mEncodeThreadRunning) {
-                gMppEnCodeServer->start();
-                mEncodeThreadRunning = true;
-             }
-            ret = ioctl(mHinDevHandle, VIDIOC_QBUF, &mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex]);
-            if (ret != 0) {
-                DEBUG_PRINT(3, "VIDIOC_QBUF Buffer failed %s", strerror(errno));
-            } else {
-                DEBUG_PRINT(mDebugLevel, "VIDIOC_QBUF %d successful.", mHinNodeInfo->currBufferHandleIndex);
+        }
+    }
+    return 0;
+}
+
+int HinDevImpl::stageShow(int index) {
+    if (((mPqMode & PQ_LF_RANGE) == PQ_LF_RANGE && mPixelFormat == V4L2_PIX_FMT_BGR24)
+            || (mPqMode & PQ_NORMAL) == PQ_NORMAL || mPqIniting) {
+        if(mDebugLevel == 3)
+            ALOGE("workThread mSidebandWindow no show, mPqMode %d mPixelFormat %d mPqIniting %d", mPqMode, V4L2_PIX_FMT_BGR24, mPqIniting);
+    } else {
+        if (mSkipFrame > 0) {
+            mSkipFrame--;
+            DEBUG_PRINT(3, "mSkipFrame not to show %d", mSkipFrame);
+        } else {
+            if (mDebugLevel == 3) {
+                ALOGE("sidebandwindow show index=%d", index);
+            }
+            acquireFrame(index, FRAME_OWNER_DISPLAY);
+            mSidebandWindow->show(mHinNodeInfo->buffer_handle_poll[index], mDisplayRatio);
+            setDisplayFrame(index);
+        }
+    }
+    return 0;
+}
+
+int HinDevImpl::stageRecord(int index) {
+    if (gMppEnCodeServer != nullptr && gMppEnCodeServer->mThreadEnabled.load()) {
+        RKMppEncApi::MyDmaBuffer_t inDmaBuf;
+        memset(&inDmaBuf, 0, sizeof(RKMppEncApi::MyDmaBuffer_t));
+        inDmaBuf.fd = -1;
+        if(!mRecordHandle.empty()) {
+            tv_record_buffer_info_t recordBuffer = mRecordHandle[mRecordCodingBuffIndex];
+            if (!recordBuffer.isCoding) {
+                buffDataTransfer(mHinNodeInfo->buffer_handle_poll[index], mPixelFormat,
+                    mSrcFrameWidth, mSrcFrameHeight,
+                    recordBuffer.outHandle, V4L2_PIX_FMT_NV12,
+                    recordBuffer.width, recordBuffer.height, recordBuffer.verStride, recordBuffer.horStride);
+                inDmaBuf.fd = recordBuffer.outHandle->data[0];
             }
+        }
+        if (inDmaBuf.fd == -1) {
+            DEBUG_PRINT(3, "skip record");
         } else {
-            if (mV4L2DataFormatConvert) {
-                mSidebandWindow->buffDataTransfer(mHinNodeInfo->buffer_handle_poll[mHinNodeInfo->currBufferHandleIndex], mPreviewRawHandle[mPreviewBuffIndex].outHandle);
+            inDmaBuf.size = gMppEnCodeServer->mEncoder->mHorStride *
+                            gMppEnCodeServer->mEncoder->mVerStride * 3 / 2;
+            inDmaBuf.handler = (void *)mHinNodeInfo->buffer_handle_poll[index];
+            inDmaBuf.index = mRecordCodingBuffIndex;
+            mRecordHandle[mRecordCodingBuffIndex].isCoding = true;
+            mRecordCodingBuffIndex++;
+            if (mRecordCodingBuffIndex == SIDEBAND_RECORD_BUFF_CNT) {
+                mRecordCodingBuffIndex = 0;
             }
-            for (int i=0; i<mPreviewRawHandle.size(); i++) {
-                if (mPreviewRawHandle[i].bufferFd == mHinNodeInfo->bufferArray[mHinNodeInfo->currBufferHandleIndex].m.planes[0].m.fd) {
-                    wrapCaptureResultAndNotify(mPreviewRawHandle[i].bufferId,mPreviewRawHandle[i].outHandle);
-                    break;
-                }
+            mLastTime = systemTime();
+            bool enc_ret = gMppEnCodeServer->mEncoder->sendFrame(
+                               (RKMppEncApi::MyDmaBuffer_t)inDmaBuf,
+                               getBufSize(V4L2_PIX_FMT_NV12, mSrcFrameWidth, mSrcFrameHeight),
+                               systemTime(), 0);
+
+            now = systemTime();
+            diff = now - mLastTime;
+
+            if (!enc_ret) {
+                DEBUG_PRINT(3, "sendFrame failed");
             }
         }
-        debugShowFPS();
-        mHinNodeInfo->currBufferHandleIndex++;
     }
+    //start encode threads
+    if (gMppEnCodeServer != nullptr && !mEncodeThreadRunning) {
+        gMppEnCodeServer->start();
+        mEncodeThreadRunning = true;
+    }
+    return 0;
+}
+
+void HinDevImpl::updatePreviewConvert() {
+    // the driver fourcc follows the source, the app buffers keep the format
+    // they were allocated with
+    mV4L2DataFormatConvert = false;
+    mPreviewV4l2Format = mPixelFormat;
+    if ((mFrameType & TYPF_SIDEBAND_WINDOW) || mPreviewRawHandle.empty()
+            || mPreviewRawHandle[0].outHandle == NULL) {
+        return;
+    }
+    int halFormat = mSidebandWindow->getBufferFormat(mPreviewRawHandle[0].outHandle);
+    if (halFormat < 0 || halFormat == getNativeWindowFormat(mPixelFormat)) {
+        return;
+    }
+    int dstFormat = getPreviewV4l2Format(halFormat);
+    bool rgaSrc = mPixelFormat == V4L2_PIX_FMT_BGR24 || mPixelFormat == V4L2_PIX_FMT_NV12
+        || mPixelFormat == V4L2_PIX_FMT_NV16;
+    bool nv24Src = mPixelFormat == V4L2_PIX_FMT_NV24 && dstFormat == V4L2_PIX_FMT_NV12
+        && !scalesPreview();
+    if (dstFormat < 0 || (!rgaSrc && !nv24Src)) {
+        ALOGE("%s no conversion from 0x%x to hal format 0x%x, app gets the raw frame",
+            __FUNCTION__, mPixelFormat, halFormat);
+        return;
+    }
+    mPreviewV4l2Format = dstFormat;
+    mV4L2DataFormatConvert = true;
+    ALOGD("%s driver 0x%x, app hal format 0x%x, converting", __FUNCTION__, mPixelFormat, halFormat);
+}
+
+int HinDevImpl::convertThread() {
+    int slot = -1;
+    {
+        Mutex::Autolock autoLock(mConvertLock);
+        if (mConvertQueue.empty()) {
+            mConvertCond.waitRelative(mConvertLock, ms2ns(100));
+            if (mConvertQueue.empty()) {
+                return NO_ERROR;
+            }
+        }
+        slot = mConvertQueue.front();
+        mConvertQueue.pop_front();
+    }
+    if (mState != START) {
+        notifyCaptureFailed();
+        return NO_ERROR;
+    }
+    int dstWidth = scalesPreview() ? mPreviewScaleWidth : mSrcFrameWidth;
+    int dstHeight = scalesPreview() ? mPreviewScaleHeight : mSrcFrameHeight;
+    uint64_t bufferId = 0;
+    buffer_handle_t outHandle = NULL;
+    {
+        // a registration can't swap the import out under the conversion
+        Mutex::Autolock previewLock(mPreviewLock);
+        if (slot < 0 || slot >= (int)mPreviewRawHandle.size()) {
+            return NO_ERROR;
+        }
+        tv_preview_buff_app_t& previewBuff = mPreviewRawHandle[slot];
+        // the driver is done with it; a slot registered again with other
+        // memory gets no frame
+        previewBuff.isQueued = false;
+        if (!previewBuff.outHandle || findPreviewSlot(previewBuff.bufferId) != slot) {
+            return NO_ERROR;
+        }
+        // gralloc pads the app buffer rows, rga wants that stride in pixels
+        int dstStride = mSidebandWindow->getBufferStride(previewBuff.outHandle, 0);
+        if (mPreviewV4l2Format == V4L2_PIX_FMT_BGR24) {
+            dstStride /= 3;
+        }
+        if (dstStride < dstWidth) {
+            dstStride = dstWidth;
+        }
+        buffDataTransfer(mHinNodeInfo->buffer_handle_poll[slot], mPixelFormat, mSrcFrameWidth, mSrcFrameHeight,
+            previewBuff.outHandle, mPreviewV4l2Format, dstWidth, dstHeight, dstStride, dstHeight);
+        bufferId = previewBuff.bufferId;
+        outHandle = previewBuff.outHandle;
+    }
+    wrapCaptureResultAndNotify(bufferId, outHandle);
     return NO_ERROR;
 }
 
@@ -1756,6 +2968,25 @@ int HinDevImpl::pqBufferThread() {
         }
     }
 
+    if (mState == START && mPqMode != PQ_OFF && mPqFramePending) {
+        allocPqBuffers();
+        if (mUseIep) {
+            allocIepBuffers();
+        }
+        mPqFramePending = false;
+    } else if (mPqMode == PQ_OFF) {
+        checkPqIdle();
+    }
+    int displayFrameIndex = -1;
+    {
+        Mutex::Autolock frameRefLock(mFrameRefLock);
+        displayFrameIndex = mDisplayFrameIndex;
+    }
+    if (mStandbyPending && mState == START && displayFrameIndex >= 0) {
+        mStandbyPending = false;
+        prefetchStandbySets();
+    }
+
     if (mState == START) {
         if (mPqMode != PQ_OFF && !mPqBufferHandle.empty() && mPqBufferHandle[mPqBuffOutIndex].isFilled) {
             bool showPqFrame = false;
@@ -1796,9 +3027,14 @@ int HinDevImpl::pqBufferThread() {
             }
             if (showPqFrame) {
                 mSidebandWindow->show(mPqBufferHandle[mPqBuffOutIndex].outHandle, mDisplayRatio);
+                // the display moved on to a pq output buffer
+                setDisplayFrame(-1);
             } else if(mDebugLevel == 3) {
                 ALOGE("pq mSidebandWindow no show, because showPqFrame false");
             }
+            Mutex::Autolock pqLock(mPqBufferLock);
+            releaseFrame(mPqBufferHandle[mPqBuffOutIndex].srcIndex, FRAME_OWNER_PQ);
+            mPqBufferHandle[mPqBuffOutIndex].srcIndex = -1;
             mPqBufferHandle[mPqBuffOutIndex].isFilled = false;
             mPqBuffOutIndex++;
             if (mPqBuffOutIndex == SIDEBAND_PQ_BUFF_CNT) {
@@ -1850,28 +3086,31 @@ bool HinDevImpl::check_zme(int src_width, int src_height, int* dst_width, int* d
 
 int HinDevImpl::iepBufferThread() {
     //Mutex::Autolock autoLock(mBufferLock); will happend rob wait if mBufferLock
-    if (mState == START) {
-        if (mPqMode != PQ_OFF && !mIepBufferHandle.empty() && mUseIep) {
-            int cur = mIepBuffOutIndex;
-            int last1 = (cur + SIDEBAND_IEP_BUFF_CNT -1)%SIDEBAND_IEP_BUFF_CNT;
-            int last2 = (cur + SIDEBAND_IEP_BUFF_CNT -2)%SIDEBAND_IEP_BUFF_CNT;
-            //ALOGD("check iep %s  %d %d %d----%d %d %d", __FUNCTION__, last2, last1, cur, mIepBufferHandle[last2].isFilled, mIepBufferHandle[last1].isFilled, mIepBufferHandle[cur].isFilled);
-            if (mIepBufferHandle[cur].isFilled && mIepBufferHandle[last1].isFilled && mIepBufferHandle[last2].isFilled) {
-                int curIepOutIndex = mIepBuffOutIndex;
-                int nextIepOutIndex = (mIepBuffOutIndex + SIDEBAND_IEP_BUFF_CNT + 1)%SIDEBAND_IEP_BUFF_CNT;
-                mRkiep->iep2_deinterlace(mIepBufferHandle[cur].srcHandle->data[0], mIepBufferHandle[last1].srcHandle->data[0], mIepBufferHandle[last2].srcHandle->data[0],
-                    mIepBufferHandle[curIepOutIndex].outHandle->data[0], mIepBufferHandle[nextIepOutIndex].outHandle->data[0]);
-                if (mState != START) {
-                    if(mDebugLevel == 3) {
-                        ALOGE("iep mState != START return NO_ERROR");
+    {
+        Mutex::Autolock iepLock(mIepBufferLock);
+        if (mState == START) {
+            if (mPqMode != PQ_OFF && !mIepBufferHandle.empty() && mUseIep) {
+                int cur = mIepBuffOutIndex;
+                int last1 = (cur + SIDEBAND_IEP_BUFF_CNT -1)%SIDEBAND_IEP_BUFF_CNT;
+                int last2 = (cur + SIDEBAND_IEP_BUFF_CNT -2)%SIDEBAND_IEP_BUFF_CNT;
+                //ALOGD("check iep %s  %d %d %d----%d %d %d", __FUNCTION__, last2, last1, cur, mIepBufferHandle[last2].isFilled, mIepBufferHandle[last1].isFilled, mIepBufferHandle[cur].isFilled);
+                if (mIepBufferHandle[cur].isFilled && mIepBufferHandle[last1].isFilled && mIepBufferHandle[last2].isFilled) {
+                    int curIepOutIndex = mIepBuffOutIndex;
+                    int nextIepOutIndex = (mIepBuffOutIndex + SIDEBAND_IEP_BUFF_CNT + 1)%SIDEBAND_IEP_BUFF_CNT;
+                    mRkiep->iep2_deinterlace(mIepBufferHandle[cur].srcHandle->data[0], mIepBufferHandle[last1].srcHandle->data[0], mIepBufferHandle[last2].srcHandle->data[0],
+                        mIepBufferHandle[curIepOutIndex].outHandle->data[0], mIepBufferHandle[nextIepOutIndex].outHandle->data[0]);
+                    if (mState != START) {
+                        if(mDebugLevel == 3) {
+                            ALOGE("iep mState != START return NO_ERROR");
+                        }
+                        return NO_ERROR;
+                    }
+                    mSidebandWindow->show(mIepBufferHandle[curIepOutIndex].outHandle, mDisplayRatio);
+                    mIepBufferHandle[curIepOutIndex].isFilled = false;
+                    mIepBuffOutIndex ++;
+                    if (mIepBuffOutIndex == SIDEBAND_IEP_BUFF_CNT) {
+                        mIepBuffOutIndex = 0;
                     }
-                    return NO_ERROR;
-                }
-                mSidebandWindow->show(mIepBufferHandle[curIepOutIndex].outHandle, mDisplayRatio);
-                mIepBufferHandle[curIepOutIndex].isFilled = false;
-                mIepBuffOutIndex ++;
-                if (mIepBuffOutIndex == SIDEBAND_IEP_BUFF_CNT) {
-                    mIepBuffOutIndex = 0;
                 }
             }
         }
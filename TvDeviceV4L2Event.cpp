@@ -8,10 +8,22 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <cutils/properties.h>
 
 #include "TvDeviceV4L2Event.h"
+#include "common/Utils.h"
 using android::UNKNOWN_ERROR;
 using android::NO_ERROR;
+
+#define EVENT_SETTLE_MS_DEFAULT 200
+// windows to wait for a stable signal before reporting anyway
+#define EVENT_SETTLE_MAX_RETRIES 10
+
+#define PENDING_SOURCE_CHANGE 0x1
+#define PENDING_CTRL          0x2
+#define PENDING_SIGNAL_LOST   0x4
 ////////////////////////////////////////////////////////////////////
 //                          PUBLIC METHODS
 ////////////////////////////////////////////////////////////////////
@@ -32,7 +44,7 @@ int V4L2DeviceEvent::initialize(int fd){
     subscribeEvent(V4L2_EVENT_CTRL);
     subscribeEvent(RK_HDMIRX_V4L2_EVENT_SIGNAL_LOST);
     mV4L2EventThread = new V4L2EventThread(mFd,callback_);
-    mV4L2EventThread->v4l2pipe();
+    mV4L2EventThread->initReactor();
     mV4L2EventThread->run("Tvinput_Ev", android::PRIORITY_DISPLAY);
     return 0;
 }
@@ -232,12 +244,32 @@ V4L2DeviceEvent::V4L2EventThread::V4L2EventThread(int fd,V4L2EventCallBack callb
 
 V4L2DeviceEvent::V4L2EventThread::~V4L2EventThread() {
     closeDevice();
+    if (mTimerFd >= 0) {
+        mReactor.Remove(mTimerFd);
+        close(mTimerFd);
+        mTimerFd = -1;
+    }
 }
-bool V4L2DeviceEvent::V4L2EventThread::v4l2pipe() {
+bool V4L2DeviceEvent::V4L2EventThread::initReactor() {
     ALOGI("@%s", __FUNCTION__);
-    if (pipe(pipefd) < 0) {
-	ALOGE("pipe failed: %s\n", strerror(errno));
-	return false;
+    if (mReactor.Init() != 0) {
+        return false;
+    }
+    if (mReactor.Add(mVideoFd, EPOLLPRI, [this](uint32_t) { handleEvent(); }) != 0) {
+        return false;
+    }
+    mSettleMs = property_get_int32(TV_INPUT_EVENT_SETTLE_MS, EVENT_SETTLE_MS_DEFAULT);
+    if (mSettleMs > 0) {
+        mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (mTimerFd < 0 || mReactor.Add(mTimerFd, EPOLLIN, [this](uint32_t) {
+                    uint64_t expirations;
+                    if (read(mTimerFd, &expirations, sizeof(expirations)) > 0) {
+                        settle();
+                    }
+                }) != 0) {
+            ALOGE("settle timer failed: %s, events are not debounced", strerror(errno));
+            mSettleMs = 0;
+        }
     }
     return true;
 }
@@ -287,56 +319,106 @@ int V4L2DeviceEvent::V4L2EventThread::getFormat(){
 void V4L2DeviceEvent::V4L2EventThread::closeDevice()
 {
     ALOGI("close device");
-    if (write(pipefd[1], "q", 1) != 1) {}
-    close(pipefd[0]);
-    close(pipefd[1]);
+    mReactor.Wakeup();
 }
 bool V4L2DeviceEvent::V4L2EventThread::threadLoop() {
     ALOGV("@%s", __FUNCTION__);
-    struct pollfd fds[2];
-    //int retry = 3;
-    //fds.events = POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM | POLLRDBAND | POLLPRI;
-    fds[0].fd = pipefd[0];
-    fds[0].events = POLLIN;
-
-    fds[1].fd = mVideoFd;
-    fds[1].events = POLLPRI;
-    struct v4l2_event ev;
-    CLEAR(ev);
-    if (poll(fds, 2, 5000) < 0) {
-	ALOGD("%d: poll failed: %s\n", mVideoFd, strerror(errno));
+    bool woken = false;
+    int ret = mReactor.PollOnce(5000, &woken);
+    if (ret < 0) {
+	ALOGD("%d: poll failed: %s\n", mVideoFd, strerror(-ret));
 	return false;
     }
-    if (fds[0].revents & POLLIN) {
+    if (woken) {
 	ALOGD("%d: quit message received\n", mVideoFd);
 	return false;
     }
-    if (fds[1].revents & POLLPRI) {
-	if (ioctl(fds[1].fd, VIDIOC_DQEVENT, &ev) == 0) {
-		switch (ev.type) {
-		case V4L2_EVENT_SOURCE_CHANGE:
-			ALOGD("%d: V4L2_EVENT_SOURCE_CHANGE event\n", mVideoFd);
-			/*retry = 3;
-			while(retry-- >= 0){
-			  if(!getFormat()) break;
-			  else usleep(100*1000);
-			}*/
-			break;
-		case V4L2_EVENT_CTRL:
-			ALOGD("%d:  V4L2_EVENT_CTRL event \n", mVideoFd );
-		        //getHdmiIn(false);
-			break;
-		default:
-			ALOGD("%d: unknown event\n", mVideoFd);
-			break;
-		}
-		if(mCallback_ != NULL)
-                  mCallback_(ev.type);
-	} else {
+    return true;
+}
+
+void V4L2DeviceEvent::V4L2EventThread::handleEvent() {
+    struct v4l2_event ev;
+    // drain everything queued so far, a mode switch usually brings several
+    do {
+	CLEAR(ev);
+	if (ioctl(mVideoFd, VIDIOC_DQEVENT, &ev) != 0) {
 		ALOGD("%d: VIDIOC_DQEVENT failed: %s\n",mVideoFd, strerror(errno));
+		break;
+	}
+	switch (ev.type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		ALOGD("%d: V4L2_EVENT_SOURCE_CHANGE event, pending %u\n", mVideoFd, ev.pending);
+		mPendingEvents |= PENDING_SOURCE_CHANGE;
+		break;
+	case V4L2_EVENT_CTRL:
+		ALOGD("%d:  V4L2_EVENT_CTRL event, pending %u\n", mVideoFd, ev.pending);
+		mPendingEvents |= PENDING_CTRL;
+		break;
+	case RK_HDMIRX_V4L2_EVENT_SIGNAL_LOST:
+		ALOGD("%d: RK_HDMIRX_V4L2_EVENT_SIGNAL_LOST event, pending %u\n", mVideoFd, ev.pending);
+		mPendingEvents |= PENDING_SIGNAL_LOST;
+		break;
+	default:
+		ALOGD("%d: unknown event\n", mVideoFd);
+		dispatch(ev.type);
+		break;
 	}
+    } while (ev.pending > 0);
+
+    if (!mPendingEvents) {
+	return;
     }
-    return true;
+    if (mSettleMs <= 0) {
+	settle();
+	return;
+    }
+    // every new event restarts the window
+    mSettleRetries = 0;
+    armSettleTimer();
+}
+
+void V4L2DeviceEvent::V4L2EventThread::armSettleTimer() {
+    struct itimerspec spec;
+    CLEAR(spec);
+    spec.it_value.tv_sec = mSettleMs / 1000;
+    spec.it_value.tv_nsec = (mSettleMs % 1000) * 1000000L;
+    if (timerfd_settime(mTimerFd, 0, &spec, NULL) != 0) {
+	ALOGE("timerfd_settime failed: %s", strerror(errno));
+	settle();
+    }
+}
+
+void V4L2DeviceEvent::V4L2EventThread::settle() {
+    int stable = 1;
+    if (ioctl(mVideoFd, RK_HDMIRX_CMD_GET_SIGNAL_STABLE_STATUS, &stable) != 0) {
+	// not an rk hdmirx node, nothing better to go by
+	stable = 1;
+    }
+    if ((mPendingEvents & PENDING_SOURCE_CHANGE) && !stable && mTimerFd >= 0
+		&& mSettleRetries < EVENT_SETTLE_MAX_RETRIES) {
+	mSettleRetries++;
+	armSettleTimer();
+	return;
+    }
+    uint32_t pending = mPendingEvents;
+    mPendingEvents = 0;
+    mSettleRetries = 0;
+    ALOGD("%d: settled pending=0x%x stable=%d\n", mVideoFd, pending, stable);
+    if (pending & PENDING_CTRL) {
+	dispatch(V4L2_EVENT_CTRL);
+    }
+    // a lost signal that came back is covered by the source change
+    if ((pending & PENDING_SIGNAL_LOST) && (!stable || !(pending & PENDING_SOURCE_CHANGE))) {
+	dispatch(RK_HDMIRX_V4L2_EVENT_SIGNAL_LOST);
+    }
+    if ((pending & PENDING_SOURCE_CHANGE) && (stable || !(pending & PENDING_SIGNAL_LOST))) {
+	dispatch(V4L2_EVENT_SOURCE_CHANGE);
+    }
+}
+
+void V4L2DeviceEvent::V4L2EventThread::dispatch(int eventType) {
+    if(mCallback_ != NULL)
+	mCallback_(eventType);
 }
 ////////////////////////////////////////////////////////////////////
 //                          PRIVATE METHODS
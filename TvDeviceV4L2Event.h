@@ -17,6 +17,7 @@
 #include <sstream>
 #include <vector>
 #include "common/rk_hdmirx_config.h"
+#include "common/EventReactor.h"
 
 using namespace std;
 using android::status_t;
@@ -71,14 +72,25 @@ public:
         public:
             V4L2EventThread(int fd,V4L2EventCallBack callback);
             ~V4L2EventThread();
-            virtual bool v4l2pipe();
+            virtual bool initReactor();
             virtual void openDevice();
             virtual void closeDevice();
             virtual bool threadLoop() override;
         private :
+            void handleEvent();
+            void armSettleTimer();
+            void settle();
+            void dispatch(int eventType);
+
             int mVideoFd;
+            // debounce of event bursts during a mode switch
+            int mTimerFd = -1;
+            int mSettleMs = 0;
+            int mSettleRetries = 0;
+            uint32_t mPendingEvents = 0;
 
-            int pipefd[2] = {-1, -1};
+            // video fd POLLPRI plus the quit wakeup from closeDevice()
+            android::tvinput::EventReactor mReactor;
             V4L2EventCallBack mCallback_;
             sp<V4L2DeviceEvent::FormartSize> mCurformat;
     };
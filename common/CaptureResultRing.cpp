@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_CaptureResultRing"
+
+#include "CaptureResultRing.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <cutils/ashmem.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+CaptureResultRing::CaptureResultRing()
+    : mMemFd(-1),
+      mEventFd(-1),
+      mSize(0),
+      mHeader(NULL),
+      mEntries(NULL),
+      mHandle(NULL) {
+}
+
+CaptureResultRing::~CaptureResultRing() {
+    Release();
+}
+
+int CaptureResultRing::Init() {
+    mSize = sizeof(capture_result_ring_header_t)
+            + CAPTURE_RESULT_RING_SLOTS * sizeof(capture_result_entry_t);
+    mMemFd = ashmem_create_region("tv_input_result_ring", mSize);
+    if (mMemFd < 0) {
+        ALOGE("%s create region failed: %s", __FUNCTION__, strerror(errno));
+        Release();
+        return -ENOMEM;
+    }
+    void* addr = mmap(NULL, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mMemFd, 0);
+    if (addr == MAP_FAILED) {
+        ALOGE("%s mmap failed: %s", __FUNCTION__, strerror(errno));
+        Release();
+        return -ENOMEM;
+    }
+    memset(addr, 0, mSize);
+    mHeader = (capture_result_ring_header_t*)addr;
+    mEntries = (capture_result_entry_t*)(mHeader + 1);
+    mHeader->magic = CAPTURE_RESULT_RING_MAGIC;
+    mHeader->version = CAPTURE_RESULT_RING_VERSION;
+    mHeader->slots = CAPTURE_RESULT_RING_SLOTS;
+    mHeader->entry_size = sizeof(capture_result_entry_t);
+
+    mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mEventFd < 0) {
+        ALOGE("%s eventfd failed: %s", __FUNCTION__, strerror(errno));
+        Release();
+        return -errno;
+    }
+    mHandle = native_handle_create(2, 0);
+    if (!mHandle) {
+        Release();
+        return -ENOMEM;
+    }
+    mHandle->data[0] = mMemFd;
+    mHandle->data[1] = mEventFd;
+    ALOGD("%s %zu bytes, %d slots", __FUNCTION__, mSize, CAPTURE_RESULT_RING_SLOTS);
+    return 0;
+}
+
+bool CaptureResultRing::Push(const capture_result_entry_t& entry) {
+    if (!mHeader) {
+        return false;
+    }
+    uint32_t head = mHeader->head.load(std::memory_order_relaxed);
+    uint32_t tail = mHeader->tail.load(std::memory_order_acquire);
+    if (head - tail >= CAPTURE_RESULT_RING_SLOTS) {
+        mHeader->dropped++;
+        return false;
+    }
+    mEntries[head % CAPTURE_RESULT_RING_SLOTS] = entry;
+    // seq_cst pairs with the client setting |waiting| and re-reading |head|
+    // before it sleeps, so a result is never published without a wakeup
+    mHeader->head.store(head + 1, std::memory_order_seq_cst);
+    if (mHeader->waiting.exchange(0, std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(mEventFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+            ALOGW("%s eventfd write failed: %s", __FUNCTION__, strerror(errno));
+        }
+    }
+    return true;
+}
+
+void CaptureResultRing::Release() {
+    if (mHandle) {
+        // the fds are closed below
+        native_handle_delete(mHandle);
+        mHandle = NULL;
+    }
+    if (mHeader) {
+        munmap(mHeader, mSize);
+        mHeader = NULL;
+        mEntries = NULL;
+    }
+    if (mEventFd >= 0) {
+        close(mEventFd);
+        mEventFd = -1;
+    }
+    if (mMemFd >= 0) {
+        close(mMemFd);
+        mMemFd = -1;
+    }
+}
+
+} /* namespace tvinput */
+} /* namespace android */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_CAPTURE_RESULT_RING_H_
+#define HDMI_IN_CAPTURE_RESULT_RING_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <cutils/native_handle.h>
+
+namespace android {
+namespace tvinput {
+
+// buff_id of the one-off capture result that carries the ring handle
+#define CAPTURE_RESULT_RING_BUFF_ID 0xfffffffffffffffeULL
+#define CAPTURE_RESULT_RING_MAGIC 0x52494e47  // "RING"
+#define CAPTURE_RESULT_RING_VERSION 1
+#define CAPTURE_RESULT_RING_SLOTS 64
+
+// Shared layout, mapped read/write by the HAL and the client. Entries are
+// written by the HAL only; the client only moves |tail| and |waiting|.
+typedef struct capture_result_entry {
+    uint64_t buff_id;
+    uint32_t seq;
+    int32_t stream_id;
+    int64_t timestamp_ns;
+    // always -1: entries are published once the frame is complete
+    // (after VIDIOC_DQBUF, or after the cpu conversion), and fds can't travel through shared
+    // memory anyway. Kept so the layout can carry a sync point later.
+    int32_t acquire_fence;
+    // 0 captured, nonzero failed (buff_id is then meaningless)
+    int32_t status;
+} capture_result_entry_t;
+
+typedef struct capture_result_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t entry_size;
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    // set by the client before it blocks on the eventfd
+    std::atomic<uint32_t> waiting;
+    uint32_t dropped;
+} capture_result_ring_header_t;
+
+// Single producer ring of capture results in shared memory. The eventfd is
+// only written when the client said it is about to sleep, so a burst of
+// frames costs one wakeup instead of one binder call each.
+class CaptureResultRing {
+ public:
+    CaptureResultRing();
+    ~CaptureResultRing();
+
+    // creates the shared region and the eventfd, 0 on success
+    int Init();
+
+    // returns false when the ring is full, the caller holds the result back
+    // and retries before publishing anything newer
+    bool Push(const capture_result_entry_t& entry);
+
+    // native handle with the region fd and the eventfd, owned by the ring
+    const native_handle_t* GetHandle() const { return mHandle; }
+
+ private:
+    void Release();
+
+    int mMemFd;
+    int mEventFd;
+    size_t mSize;
+    capture_result_ring_header_t* mHeader;
+    capture_result_entry_t* mEntries;
+    native_handle_t* mHandle;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_CAPTURE_RESULT_RING_H_
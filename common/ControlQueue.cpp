@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_ControlQueue"
+
+#include "ControlQueue.h"
+#include <inttypes.h>
+#include <log/log.h>
+#include <utils/Timers.h>
+
+namespace android {
+namespace tvinput {
+
+ControlQueue::~ControlQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mCond.notify_all();
+    if (mThread.joinable()) {
+        mThread.join();
+    }
+}
+
+void ControlQueue::Post(const char* name, Job job) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mJobs.push_back({name, job});
+    if (!mThread.joinable()) {
+        mThread = std::thread(&ControlQueue::Run, this);
+    }
+    mCond.notify_all();
+}
+
+size_t ControlQueue::Cancel(const char* name) {
+    std::lock_guard<std::mutex> lock(mLock);
+    size_t dropped = 0;
+    for (auto it = mJobs.begin(); it != mJobs.end(); ) {
+        if (it->name == name) {
+            it = mJobs.erase(it);
+            dropped++;
+        } else {
+            ++it;
+        }
+    }
+    if (dropped > 0) {
+        ALOGD("%s dropped %zu queued %s", __FUNCTION__, dropped, name);
+        mCond.notify_all();
+    }
+    return dropped;
+}
+
+bool ControlQueue::IsBusy() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mRunning || !mJobs.empty();
+}
+
+void ControlQueue::WaitIdle() {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (!mRunning && mJobs.empty()) {
+        return;
+    }
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    mCond.wait(lock, [this]() { return !mRunning && mJobs.empty(); });
+    ALOGD("%s held the caller %" PRId64 " ms", __FUNCTION__,
+        ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+}
+
+void ControlQueue::Run() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mCond.wait(lock, [this]() { return mExit || !mJobs.empty(); });
+        if (mJobs.empty()) {
+            break;
+        }
+        control_job_t entry = mJobs.front();
+        mJobs.pop_front();
+        mRunning = true;
+        lock.unlock();
+        nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+        entry.job();
+        ALOGD("%s %s done in %" PRId64 " ms", __FUNCTION__, entry.name.c_str(),
+            ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+        lock.lock();
+        mRunning = false;
+        mCond.notify_all();
+    }
+}
+
+} /* namespace tvinput */
+} /* namespace android */
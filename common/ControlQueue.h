@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_CONTROL_QUEUE_H_
+#define HDMI_IN_CONTROL_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace android {
+namespace tvinput {
+
+// Runs stream open/close work in order on one thread so the framework's
+// binder thread returns right away. Jobs that have not started yet can be
+// dropped, e.g. an open that a close overtook.
+class ControlQueue {
+ public:
+    typedef std::function<void()> Job;
+
+    ControlQueue() : mRunning(false), mExit(false) {}
+    // finishes every queued job before returning
+    ~ControlQueue();
+
+    void Post(const char* name, Job job);
+
+    // drops queued jobs called |name|, returns how many were dropped
+    size_t Cancel(const char* name);
+
+    // true while a job is queued or running
+    bool IsBusy();
+
+    // waits until every job posted so far has finished
+    void WaitIdle();
+
+ private:
+    typedef struct control_job {
+        std::string name;
+        Job job;
+    } control_job_t;
+
+    void Run();
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<control_job_t> mJobs;
+    bool mRunning;
+    bool mExit;
+    std::thread mThread;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_CONTROL_QUEUE_H_
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_DeviceDiscovery"
+
+#include "DeviceDiscovery.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/inotify.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+#define SYSFS_V4L2_PATH "/sys/class/video4linux/"
+#define DEV_PATH "/dev/"
+#define VIDEO_PREFIX "video"
+
+// static
+DeviceDiscovery* DeviceDiscovery::GetInstance() {
+    static DeviceDiscovery instance;
+    return &instance;
+}
+
+DeviceDiscovery::DeviceDiscovery() {
+    mInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mInotifyFd >= 0 && inotify_add_watch(mInotifyFd, DEV_PATH, IN_CREATE | IN_DELETE) < 0) {
+        ALOGW("%s can't watch %s: %s, the node is not cached", __FUNCTION__, DEV_PATH, strerror(errno));
+        close(mInotifyFd);
+        mInotifyFd = -1;
+    }
+}
+
+void DeviceDiscovery::CheckChangesLocked() {
+    if (mInotifyFd < 0) {
+        mCached.clear();
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(mInotifyFd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len > 0 && !strncmp(event->name, VIDEO_PREFIX, strlen(VIDEO_PREFIX))) {
+                ALOGD("%s /dev/%s %s, drop cached %s", __FUNCTION__, event->name,
+                    (event->mask & IN_CREATE) ? "added" : "removed", mCached.c_str());
+                mCached.clear();
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// static
+bool DeviceDiscovery::ReadSysfs(const std::string& node, std::string* name, std::string* driver) {
+    std::string base = SYSFS_V4L2_PATH + node;
+    // uvc gadgets expose function_name, opening them disturbs the gadget
+    if (access((base + "/function_name").c_str(), F_OK) == 0) {
+        return false;
+    }
+    name->clear();
+    driver->clear();
+    int fd = open((base + "/name").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char value[64] = {0};
+        ssize_t len = read(fd, value, sizeof(value) - 1);
+        close(fd);
+        if (len > 0) {
+            name->assign(value, len);
+            name->erase(name->find_last_not_of("\n") + 1);
+        }
+    }
+    char link[PATH_MAX] = {0};
+    ssize_t len = readlink((base + "/device/driver").c_str(), link, sizeof(link) - 1);
+    if (len > 0) {
+        const char* slash = strrchr(link, '/');
+        driver->assign(slash ? slash + 1 : link);
+    }
+    return true;
+}
+
+std::vector<std::string> DeviceDiscovery::GetCandidates(const char* hint) {
+    Mutex::Autolock autoLock(mLock);
+    std::vector<std::string> candidates;
+    CheckChangesLocked();
+    if (!mCached.empty()) {
+        candidates.push_back(mCached);
+    }
+    DIR* dir = opendir(SYSFS_V4L2_PATH);
+    if (!dir) {
+        ALOGW("%s can't open %s: %s", __FUNCTION__, SYSFS_V4L2_PATH, strerror(errno));
+        return candidates;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, VIDEO_PREFIX, strlen(VIDEO_PREFIX))) {
+            continue;
+        }
+        std::string name, driver;
+        if (!ReadSysfs(de->d_name, &name, &driver)) {
+            continue;
+        }
+        if (name.find(hint) == std::string::npos && driver.find(hint) == std::string::npos) {
+            continue;
+        }
+        std::string path = std::string(DEV_PATH) + de->d_name;
+        if (std::find(candidates.begin(), candidates.end(), path) == candidates.end()) {
+            ALOGD("%s %s name=%s driver=%s", __FUNCTION__, path.c_str(), name.c_str(), driver.c_str());
+            candidates.push_back(path);
+        }
+    }
+    closedir(dir);
+    return candidates;
+}
+
+std::vector<std::string> DeviceDiscovery::GetAllNodes() {
+    std::vector<std::string> nodes;
+    DIR* dir = opendir(DEV_PATH);
+    if (!dir) {
+        ALOGE("%s can't open %s: %s", __FUNCTION__, DEV_PATH, strerror(errno));
+        return nodes;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, VIDEO_PREFIX, strlen(VIDEO_PREFIX))) {
+            continue;
+        }
+        std::string name, driver;
+        if (!ReadSysfs(de->d_name, &name, &driver)) {
+            ALOGW("/dev/%s is uvc gadget device, don't open it!", de->d_name);
+            continue;
+        }
+        nodes.push_back(std::string(DEV_PATH) + de->d_name);
+    }
+    closedir(dir);
+    return nodes;
+}
+
+void DeviceDiscovery::Store(const std::string& path) {
+    Mutex::Autolock autoLock(mLock);
+    // changes seen so far predate |path|
+    CheckChangesLocked();
+    if (mInotifyFd >= 0) {
+        mCached = path;
+    }
+}
+
+void DeviceDiscovery::Invalidate() {
+    Mutex::Autolock autoLock(mLock);
+    mCached.clear();
+}
+
+} /* namespace tvinput */
+} /* namespace android */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_DEVICE_DISCOVERY_H_
+#define HDMI_IN_DEVICE_DISCOVERY_H_
+
+#include <string>
+#include <vector>
+#include <utils/Mutex.h>
+
+namespace android {
+namespace tvinput {
+
+// Finds the capture node without opening every /dev/video*: the sysfs name
+// and driver link of each node are matched first, and the node found last
+// time is remembered until a video node is added to or removed from /dev.
+// Opening is left to the caller, which still checks VIDIOC_QUERYCAP.
+class DeviceDiscovery {
+ public:
+    static DeviceDiscovery* GetInstance();
+
+    // /dev paths worth opening for |hint|, best first: the cached node,
+    // then nodes whose sysfs name or driver contains |hint|
+    std::vector<std::string> GetCandidates(const char* hint);
+
+    // every /dev/video* except uvc gadgets, for when no candidate matched
+    std::vector<std::string> GetAllNodes();
+
+    // remembers |path| as the node to try first next time
+    void Store(const std::string& path);
+    void Invalidate();
+
+ private:
+    DeviceDiscovery();
+    // drops the cached node if /dev saw video nodes come or go
+    void CheckChangesLocked();
+    static bool ReadSysfs(const std::string& node, std::string* name, std::string* driver);
+
+    Mutex mLock;
+    int mInotifyFd;
+    std::string mCached;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_DEVICE_DISCOVERY_H_
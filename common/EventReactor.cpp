@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_EventReactor"
+
+#include "EventReactor.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+#define REACTOR_MAX_EVENTS 8
+
+EventReactor::EventReactor()
+    : mEpollFd(-1),
+      mWakeFd(-1) {
+}
+
+EventReactor::~EventReactor() {
+    if (mWakeFd >= 0) {
+        close(mWakeFd);
+    }
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+    }
+}
+
+int EventReactor::Init() {
+    Mutex::Autolock autoLock(mLock);
+    if (mEpollFd >= 0) {
+        return 0;
+    }
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd < 0) {
+        ALOGE("%s epoll_create1 failed: %s", __FUNCTION__, strerror(errno));
+        return -errno;
+    }
+    mWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mWakeFd < 0) {
+        int err = -errno;
+        ALOGE("%s eventfd failed: %s", __FUNCTION__, strerror(errno));
+        close(mEpollFd);
+        mEpollFd = -1;
+        return err;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = mWakeFd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev) != 0) {
+        int err = -errno;
+        ALOGE("%s add wakeup fd failed: %s", __FUNCTION__, strerror(errno));
+        close(mWakeFd);
+        close(mEpollFd);
+        mWakeFd = -1;
+        mEpollFd = -1;
+        return err;
+    }
+    return 0;
+}
+
+int EventReactor::Add(int fd, uint32_t events, Handler handler) {
+    Mutex::Autolock autoLock(mLock);
+    if (mEpollFd < 0 || fd < 0) {
+        return -EINVAL;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    int op = mHandlers.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(mEpollFd, op, fd, &ev) != 0) {
+        ALOGE("%s fd=%d failed: %s", __FUNCTION__, fd, strerror(errno));
+        return -errno;
+    }
+    mHandlers[fd] = handler;
+    return 0;
+}
+
+int EventReactor::Remove(int fd) {
+    Mutex::Autolock autoLock(mLock);
+    if (mEpollFd < 0 || !mHandlers.count(fd)) {
+        return -EINVAL;
+    }
+    mHandlers.erase(fd);
+    // the fd may already be closed, which dropped it from the set anyway
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+}
+
+int EventReactor::PollOnce(int timeoutMs, bool* woken) {
+    if (woken) {
+        *woken = false;
+    }
+    if (mEpollFd < 0) {
+        return -EINVAL;
+    }
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int count = epoll_wait(mEpollFd, events, REACTOR_MAX_EVENTS, timeoutMs);
+    if (count < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    int handled = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        if (fd == mWakeFd) {
+            uint64_t value;
+            if (read(mWakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                ALOGW("%s wakeup read failed: %s", __FUNCTION__, strerror(errno));
+            }
+            if (woken) {
+                *woken = true;
+            }
+            continue;
+        }
+        Handler handler;
+        {
+            Mutex::Autolock autoLock(mLock);
+            auto it = mHandlers.find(fd);
+            if (it == mHandlers.end()) {
+                continue;
+            }
+            handler = it->second;
+        }
+        handler(events[i].events);
+        handled++;
+    }
+    return handled;
+}
+
+void EventReactor::Wakeup() {
+    if (mWakeFd < 0) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(mWakeFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        ALOGW("%s failed: %s", __FUNCTION__, strerror(errno));
+    }
+}
+
+} /* namespace tvinput */
+} /* namespace android */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_EVENT_REACTOR_H_
+#define HDMI_IN_EVENT_REACTOR_H_
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <utils/Mutex.h>
+
+namespace android {
+namespace tvinput {
+
+// epoll based wait on a set of fds plus an eventfd that other threads use to
+// interrupt the wait (stop, reconfigure). Handlers run on the thread that
+// calls PollOnce().
+class EventReactor {
+ public:
+    typedef std::function<void(uint32_t events)> Handler;
+
+    EventReactor();
+    ~EventReactor();
+
+    // creates the epoll and wakeup fds, safe to call again once initialized
+    int Init();
+
+    // watches |fd| for |events| (EPOLLIN, EPOLLPRI, ...), replaces any handler
+    // already registered for it
+    int Add(int fd, uint32_t events, Handler handler);
+    int Remove(int fd);
+
+    // waits up to |timeoutMs| (-1 forever) and runs the handlers of the ready
+    // fds. Returns the number of handlers run, 0 on timeout, negative errno on
+    // failure. |woken| is set when Wakeup() ended the wait.
+    int PollOnce(int timeoutMs, bool* woken);
+
+    // makes the current or next PollOnce() return right away
+    void Wakeup();
+
+ private:
+    int mEpollFd;
+    int mWakeFd;
+    Mutex mLock;
+    std::map<int, Handler> mHandlers;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_EVENT_REACTOR_H_
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_FormatNegotiator"
+
+#include "FormatNegotiator.h"
+#include <inttypes.h>
+#include <linux/videodev2.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+// the cpu NV24ToNV12 path costs far more than its raw traffic suggests
+#define CPU_CONVERT_PENALTY 4
+
+int FormatNegotiator::GetBitsPerPixel(uint32_t v4l2Fmt) {
+    switch (v4l2Fmt) {
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_NV21:
+            return 12;
+        case V4L2_PIX_FMT_NV16:
+        case V4L2_PIX_FMT_YUYV:
+            return 16;
+        case V4L2_PIX_FMT_NV24:
+        case V4L2_PIX_FMT_BGR24:
+            return 24;
+        default:
+            return 0;
+    }
+}
+
+int64_t FormatNegotiator::GetCost(uint32_t v4l2Fmt, int width, int height, uint32_t consumers) {
+    int bpp = GetBitsPerPixel(v4l2Fmt);
+    if (bpp == 0 || width <= 0 || height <= 0) {
+        return kUnsupported;
+    }
+    int64_t frameSize = (int64_t)width * height * bpp / 8;
+    int64_t nv12Size = (int64_t)width * height * 3 / 2;
+    bool vopFormat = v4l2Fmt == V4L2_PIX_FMT_NV12 || v4l2Fmt == V4L2_PIX_FMT_NV16
+            || v4l2Fmt == V4L2_PIX_FMT_NV24 || v4l2Fmt == V4L2_PIX_FMT_BGR24;
+
+    // capture write
+    int64_t cost = frameSize;
+    if (consumers & FORMAT_CONSUMER_DISPLAY) {
+        if (!vopFormat) {
+            return kUnsupported;
+        }
+        cost += frameSize;
+    }
+    if (consumers & FORMAT_CONSUMER_PQ) {
+        // rkpq takes the same set of inputs as the vop
+        if (!vopFormat) {
+            return kUnsupported;
+        }
+        cost += frameSize;
+    }
+    if (consumers & FORMAT_CONSUMER_RECORD) {
+        // the encoder wants NV12, everything else is converted per frame
+        if (v4l2Fmt == V4L2_PIX_FMT_NV24) {
+            cost += (frameSize + nv12Size) * CPU_CONVERT_PENALTY;
+        } else if (vopFormat) {
+            cost += frameSize + nv12Size;
+        } else {
+            return kUnsupported;
+        }
+    }
+    if (consumers & FORMAT_CONSUMER_PREVIEW) {
+        cost += frameSize;
+    }
+    return cost;
+}
+
+uint32_t FormatNegotiator::Pick(const std::vector<uint32_t>& candidates, int width, int height,
+        uint32_t consumers, int64_t* outCost) {
+    uint32_t best = 0;
+    int64_t bestCost = kUnsupported;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        int64_t cost = GetCost(candidates[i], width, height, consumers);
+        ALOGD("format %c%c%c%c %dx%d consumers=0x%x cost=%" PRId64,
+            candidates[i] & 0xff, (candidates[i] >> 8) & 0xff, (candidates[i] >> 16) & 0xff,
+            (candidates[i] >> 24) & 0xff, width, height, consumers, cost == kUnsupported ? -1 : cost);
+        if (cost < bestCost) {
+            best = candidates[i];
+            bestCost = cost;
+        }
+    }
+    if (outCost) {
+        *outCost = bestCost;
+    }
+    return best;
+}
+
+} /* namespace tvinput */
+} /* namespace android */
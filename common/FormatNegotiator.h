@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_FORMAT_NEGOTIATOR_H_
+#define HDMI_IN_FORMAT_NEGOTIATOR_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace android {
+namespace tvinput {
+
+enum FormatConsumer {
+    FORMAT_CONSUMER_DISPLAY = 0x1,
+    FORMAT_CONSUMER_PQ      = 0x2,
+    FORMAT_CONSUMER_RECORD  = 0x4,
+    FORMAT_CONSUMER_PREVIEW = 0x8,
+};
+
+// Scores capture pixel formats by the memory traffic they cost per frame
+// (capture write plus every consumer read/convert) and picks the cheapest.
+class FormatNegotiator {
+ public:
+    static const int64_t kUnsupported = INT64_MAX;
+
+    // bytes moved per frame for |v4l2Fmt| with the given consumers,
+    // kUnsupported if one of the consumers can't take the format at all
+    static int64_t GetCost(uint32_t v4l2Fmt, int width, int height, uint32_t consumers);
+
+    // returns the cheapest of |candidates|, 0 if none is usable
+    static uint32_t Pick(const std::vector<uint32_t>& candidates, int width, int height,
+            uint32_t consumers, int64_t* outCost);
+
+    static int GetBitsPerPixel(uint32_t v4l2Fmt);
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_FORMAT_NEGOTIATOR_H_
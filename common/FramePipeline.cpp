@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_FramePipeline"
+
+#include "FramePipeline.h"
+#include <inttypes.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+#define FOURCC_ARGS(fmt) (fmt) & 0xff, ((fmt) >> 8) & 0xff, ((fmt) >> 16) & 0xff, ((fmt) >> 24) & 0xff
+
+FramePipeline::FramePipeline()
+    : mSrcFmt(0),
+      mPendingIndex(-1),
+      mWorkerBusy(false),
+      mExit(false) {
+}
+
+FramePipeline::~FramePipeline() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mCond.notify_all();
+    if (mWorker.joinable()) {
+        mWorker.join();
+    }
+}
+
+void FramePipeline::SetFrameRefs(FrameFunc hold, FrameFunc release) {
+    Flush();
+    std::lock_guard<std::mutex> lock(mLock);
+    mHold = hold;
+    mRelease = release;
+}
+
+void FramePipeline::Begin(uint32_t srcFmt) {
+    // the worker reads the stage list without the lock
+    Flush();
+    std::lock_guard<std::mutex> lock(mLock);
+    mSrcFmt = srcFmt;
+    mStages.clear();
+}
+
+bool FramePipeline::AddStage(const char* name, uint32_t inFmt, uint32_t outFmt, StageFunc func,
+        bool async) {
+    if (inFmt != 0 && inFmt != mSrcFmt) {
+        ALOGE("%s stage %s takes %c%c%c%c, source is %c%c%c%c", __FUNCTION__, name,
+            FOURCC_ARGS(inFmt), FOURCC_ARGS(mSrcFmt));
+        return false;
+    }
+    Stage stage;
+    stage.name = name;
+    stage.inFmt = inFmt;
+    stage.outFmt = outFmt;
+    stage.func = func;
+    stage.async = async;
+    stage.count = 0;
+    stage.skipped = 0;
+    stage.totalNs = 0;
+    stage.maxNs = 0;
+    std::lock_guard<std::mutex> lock(mLock);
+    mStages.push_back(stage);
+    return true;
+}
+
+void FramePipeline::AddCostLocked(Stage& stage, nsecs_t cost) {
+    stage.count++;
+    stage.totalNs += cost;
+    if (cost > stage.maxNs) {
+        stage.maxNs = cost;
+    }
+}
+
+int FramePipeline::Run(int index) {
+    bool hasAsync = false;
+    for (size_t i = 0; i < mStages.size(); i++) {
+        Stage& stage = mStages[i];
+        if (stage.async) {
+            hasAsync = true;
+            continue;
+        }
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+        int ret = stage.func(index);
+        nsecs_t cost = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            AddCostLocked(stage, cost);
+        }
+        if (ret != 0) {
+            ALOGV("%s stage %s dropped index %d ret=%d", __FUNCTION__, stage.name.c_str(), index, ret);
+            return ret;
+        }
+    }
+    if (hasAsync) {
+        Post(index);
+    }
+    return 0;
+}
+
+void FramePipeline::Post(int index) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mWorkerBusy || mPendingIndex >= 0) {
+        for (size_t i = 0; i < mStages.size(); i++) {
+            if (mStages[i].async) {
+                mStages[i].skipped++;
+            }
+        }
+        return;
+    }
+    if (mHold) {
+        mHold(index);
+    }
+    mPendingIndex = index;
+    if (!mWorker.joinable()) {
+        mWorker = std::thread(&FramePipeline::WorkerLoop, this);
+    }
+    mCond.notify_all();
+}
+
+void FramePipeline::Flush() {
+    std::unique_lock<std::mutex> lock(mLock);
+    mCond.wait(lock, [this]() { return !mWorkerBusy && mPendingIndex < 0; });
+}
+
+void FramePipeline::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mCond.wait(lock, [this]() { return mExit || mPendingIndex >= 0; });
+        if (mPendingIndex < 0) {
+            break;
+        }
+        int index = mPendingIndex;
+        mPendingIndex = -1;
+        mWorkerBusy = true;
+        lock.unlock();
+        for (size_t i = 0; i < mStages.size(); i++) {
+            Stage& stage = mStages[i];
+            if (!stage.async) {
+                continue;
+            }
+            nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+            int ret = stage.func(index);
+            nsecs_t cost = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+            lock.lock();
+            AddCostLocked(stage, cost);
+            lock.unlock();
+            if (ret != 0) {
+                ALOGV("%s stage %s dropped index %d ret=%d", __FUNCTION__, stage.name.c_str(), index, ret);
+                break;
+            }
+        }
+        if (mRelease) {
+            mRelease(index);
+        }
+        lock.lock();
+        mWorkerBusy = false;
+        mCond.notify_all();
+    }
+}
+
+void FramePipeline::DumpStats(std::string* out) const {
+    std::lock_guard<std::mutex> lock(mLock);
+    char line[128];
+    snprintf(line, sizeof(line), "src=%c%c%c%c", FOURCC_ARGS(mSrcFmt));
+    out->append(line);
+    for (size_t i = 0; i < mStages.size(); i++) {
+        const Stage& stage = mStages[i];
+        int64_t avgUs = stage.count ? stage.totalNs / (int64_t)stage.count / 1000 : 0;
+        snprintf(line, sizeof(line), " %s%s:%" PRIu64 "/%" PRId64 "us/%" PRId64 "us",
+            stage.name.c_str(), stage.async ? "*" : "", stage.count, avgUs, (int64_t)(stage.maxNs / 1000));
+        out->append(line);
+        if (stage.async && stage.skipped) {
+            snprintf(line, sizeof(line), "/-%" PRIu64, stage.skipped);
+            out->append(line);
+        }
+        if (stage.outFmt) {
+            snprintf(line, sizeof(line), "->%c%c%c%c", FOURCC_ARGS(stage.outFmt));
+            out->append(line);
+        }
+    }
+}
+
+} /* namespace tvinput */
+} /* namespace android */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_FRAME_PIPELINE_H_
+#define HDMI_IN_FRAME_PIPELINE_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utils/Timers.h>
+
+namespace android {
+namespace tvinput {
+
+// Ordered list of per-frame stages, built per session from the features that
+// are actually on, so a disabled feature isn't even a branch on the capture
+// path. Every stage is timed. Async stages run on a worker thread once the
+// inline ones passed, so they overlap the next frame's capture and display.
+class FramePipeline {
+ public:
+    // returns 0 to pass the frame on, anything else drops it
+    typedef std::function<int(int index)> StageFunc;
+    typedef std::function<void(int index)> FrameFunc;
+
+    FramePipeline();
+    // waits for the frame the worker is on
+    ~FramePipeline();
+
+    // |hold| keeps the buffer at |index| for the worker, |release| lets it go
+    void SetFrameRefs(FrameFunc hold, FrameFunc release);
+
+    // starts a new graph for frames of |srcFmt|, stats are reset
+    void Begin(uint32_t srcFmt);
+
+    // appends a stage taking |inFmt| (0 takes anything) and writing |outFmt|
+    // into its own buffers (0 if it only reads or passes the frame on),
+    // returns false if the source format doesn't fit
+    bool AddStage(const char* name, uint32_t inFmt, uint32_t outFmt, StageFunc func,
+            bool async = false);
+
+    // runs every inline stage on the buffer at |index|, stops at the first
+    // failure, then hands the frame to the async stages. A frame the worker
+    // has no room for skips them.
+    int Run(int index);
+
+    // waits until the worker is done with every frame handed to it
+    void Flush();
+
+    size_t GetStageCount() const { return mStages.size(); }
+
+    void DumpStats(std::string* out) const;
+
+ private:
+    struct Stage {
+        std::string name;
+        uint32_t inFmt;
+        uint32_t outFmt;
+        StageFunc func;
+        bool async;
+        uint64_t count;
+        uint64_t skipped;
+        nsecs_t totalNs;
+        nsecs_t maxNs;
+    };
+
+    void AddCostLocked(Stage& stage, nsecs_t cost);
+    void Post(int index);
+    void WorkerLoop();
+
+    uint32_t mSrcFmt;
+    std::vector<Stage> mStages;
+    FrameFunc mHold;
+    FrameFunc mRelease;
+    // guards the stats against DumpStats and the hand over to the worker
+    mutable std::mutex mLock;
+    std::condition_variable mCond;
+    std::thread mWorker;
+    int mPendingIndex;
+    bool mWorkerBusy;
+    bool mExit;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_FRAME_PIPELINE_H_
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_Prewarmer"
+
+#include "Prewarmer.h"
+#include <inttypes.h>
+#include <log/log.h>
+#include <utils/Timers.h>
+
+namespace android {
+namespace tvinput {
+
+Prewarmer::~Prewarmer() {
+    Join();
+}
+
+std::shared_future<bool> Prewarmer::Add(const char* name, Task task) {
+    prewarm_task_t entry;
+    entry.name = name;
+    entry.task = task;
+    std::shared_future<bool> ready = entry.done.get_future().share();
+    mTasks.push_back(std::move(entry));
+    return ready;
+}
+
+void Prewarmer::Start() {
+    if (mThread.joinable() || mTasks.empty()) {
+        return;
+    }
+    mThread = std::thread(&Prewarmer::Run, this);
+}
+
+void Prewarmer::Join() {
+    if (mThread.joinable()) {
+        mThread.join();
+    } else {
+        // never started, don't leave anyone waiting on a broken promise
+        for (size_t i = 0; i < mTasks.size(); i++) {
+            mTasks[i].done.set_value(false);
+        }
+    }
+    mTasks.clear();
+}
+
+void Prewarmer::Cancel() {
+    mCancel = true;
+    Join();
+}
+
+void Prewarmer::Run() {
+    for (size_t i = 0; i < mTasks.size(); i++) {
+        if (mCancel) {
+            ALOGD("%s %s cancelled", __FUNCTION__, mTasks[i].name.c_str());
+            mTasks[i].done.set_value(false);
+            continue;
+        }
+        nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+        bool ok = mTasks[i].task();
+        mTasks[i].done.set_value(ok);
+        ALOGD("%s %s %s in %" PRId64 " ms", __FUNCTION__, mTasks[i].name.c_str(),
+            ok ? "ready" : "failed", ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+    }
+}
+
+// static
+bool Prewarmer::Wait(const char* name, const std::shared_future<bool>& ready) {
+    if (!ready.valid()) {
+        return false;
+    }
+    if (ready.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+        ready.wait();
+        ALOGD("%s %s held the caller %" PRId64 " ms", __FUNCTION__, name,
+            ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+    }
+    return ready.get();
+}
+
+} /* namespace tvinput */
+} /* namespace android */
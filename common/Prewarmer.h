@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_PREWARMER_H_
+#define HDMI_IN_PREWARMER_H_
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace tvinput {
+
+// Runs context bring-up (drm, rga, pq, mpp) on one background thread while
+// the framework is still negotiating the stream. Every task gets a future
+// the pipeline waits on only when it reaches that context first.
+class Prewarmer {
+ public:
+    typedef std::function<bool()> Task;
+
+    Prewarmer() {}
+    ~Prewarmer();
+
+    // queues |task|, the future tells whether it succeeded; call before Start()
+    std::shared_future<bool> Add(const char* name, Task task);
+
+    // runs the queued tasks in order on a new thread
+    void Start();
+
+    // waits until every queued task has finished
+    void Join();
+
+    // tasks that haven't started yet are skipped and report false, then
+    // waits for the one that is running
+    void Cancel();
+
+    // result of |ready|, false if nothing was queued for it; logs how long
+    // the caller had to wait
+    static bool Wait(const char* name, const std::shared_future<bool>& ready);
+
+ private:
+    typedef struct prewarm_task {
+        std::string name;
+        Task task;
+        std::promise<bool> done;
+    } prewarm_task_t;
+
+    void Run();
+
+    std::vector<prewarm_task_t> mTasks;
+    std::thread mThread;
+    std::atomic<bool> mCancel{false};
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_PREWARMER_H_
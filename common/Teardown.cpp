@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_Teardown"
+
+#include "Teardown.h"
+#include <inttypes.h>
+#include <thread>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+void Teardown::Signal(const char* name, Step step) {
+    mSignals.push_back({name, step});
+}
+
+void Teardown::Join(const char* name, Step step) {
+    mJoins.push_back({name, step});
+}
+
+void Teardown::Release(const char* name, Step step) {
+    mReleases.push_back({name, step});
+}
+
+void Teardown::RunSignals() {
+    for (size_t i = 0; i < mSignals.size(); i++) {
+        mSignals[i].step();
+    }
+    mSignals.clear();
+}
+
+bool Teardown::RunJoins() {
+    return RunConcurrently("join", mJoins);
+}
+
+bool Teardown::RunReleases() {
+    return RunConcurrently("release", mReleases);
+}
+
+bool Teardown::WaitStep(step_state_t& state, nsecs_t deadline) {
+    std::unique_lock<std::mutex> lock(state.lock);
+    if (mDeadlineMs <= 0) {
+        state.cond.wait(lock, [&state]() { return state.done; });
+        return true;
+    }
+    nsecs_t left = deadline - systemTime(SYSTEM_TIME_MONOTONIC);
+    if (left < 0) {
+        left = 0;
+    }
+    return state.cond.wait_for(lock, std::chrono::nanoseconds(left), [&state]() { return state.done; });
+}
+
+bool Teardown::RunConcurrently(const char* phase, std::vector<teardown_step_t>& steps) {
+    if (steps.empty()) {
+        return true;
+    }
+    nsecs_t begin = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t deadline = begin + ms2ns(mDeadlineMs);
+    std::vector<std::shared_ptr<step_state_t>> states;
+    for (size_t i = 0; i < steps.size(); i++) {
+        std::shared_ptr<step_state_t> state = std::make_shared<step_state_t>();
+        Step step = steps[i].step;
+        std::thread([step, state]() {
+            nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+            step();
+            std::lock_guard<std::mutex> lock(state->lock);
+            state->costMs = ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+            state->done = true;
+            state->cond.notify_all();
+        }).detach();
+        states.push_back(state);
+    }
+    bool finished = true;
+    char item[64];
+    for (size_t i = 0; i < steps.size(); i++) {
+        if (!WaitStep(*states[i], deadline)) {
+            ALOGW("%s %s %s still running after %dms, left detached", __FUNCTION__, phase,
+                steps[i].name.c_str(), mDeadlineMs);
+            mPending.push_back({steps[i].name, states[i]});
+            snprintf(item, sizeof(item), "%s=late ", steps[i].name.c_str());
+            mReport += item;
+            finished = false;
+            continue;
+        }
+        int64_t cost = states[i]->costMs;
+        if (mDeadlineMs > 0 && cost > mDeadlineMs) {
+            ALOGW("%s %s %s took %" PRId64 "ms, deadline %dms", __FUNCTION__, phase,
+                steps[i].name.c_str(), cost, mDeadlineMs);
+        }
+        snprintf(item, sizeof(item), "%s=%" PRId64 " ", steps[i].name.c_str(), cost);
+        mReport += item;
+    }
+    ALOGD("%s %s phase %" PRId64 "ms", __FUNCTION__, phase,
+        (int64_t)ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - begin));
+    steps.clear();
+    return finished;
+}
+
+bool Teardown::WaitPending() {
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + ms2ns(mDeadlineMs);
+    bool finished = true;
+    for (size_t i = 0; i < mPending.size(); i++) {
+        if (WaitStep(*mPending[i].state, deadline)) {
+            ALOGD("%s %s finished late, %" PRId64 "ms", __FUNCTION__, mPending[i].name.c_str(),
+                mPending[i].state->costMs);
+        } else {
+            ALOGE("%s %s still stuck, given up on", __FUNCTION__, mPending[i].name.c_str());
+            finished = false;
+        }
+    }
+    mPending.clear();
+    return finished;
+}
+
+} /* namespace tvinput */
+} /* namespace android */
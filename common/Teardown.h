@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_TEARDOWN_H_
+#define HDMI_IN_TEARDOWN_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utils/Timers.h>
+
+namespace android {
+namespace tvinput {
+
+// Runs a stop in three phases so no stage waits for another to notice it
+// should quit:
+// - signal: every exit request goes out first, in order, without waiting
+// - join: all waits run at once, each on a thread of its own
+// - release: independent resources are freed concurrently
+// RunSignals()/RunJoins() and RunReleases() can be called separately when
+// the caller needs a lock between them. A join or release still running at
+// the deadline is left detached, the caller decides how to get it unstuck.
+// A deadline of 0 waits for every step.
+class Teardown {
+ public:
+    typedef std::function<void()> Step;
+
+    explicit Teardown(int deadlineMs) : mDeadlineMs(deadlineMs) {}
+
+    void Signal(const char* name, Step step);
+    void Join(const char* name, Step step);
+    void Release(const char* name, Step step);
+
+    void RunSignals();
+    // false when a step overran the deadline and was left detached
+    bool RunJoins();
+    bool RunReleases();
+
+    // gives the steps left detached one more deadline, false if any of them
+    // is still running; those are given up on
+    bool WaitPending();
+
+    // "name=ms ..." of every join and release step run so far
+    const std::string& Report() const { return mReport; }
+
+ private:
+    typedef struct teardown_step {
+        std::string name;
+        Step step;
+    } teardown_step_t;
+
+    // shared with the step's thread, so a detached step never outlives it
+    typedef struct step_state {
+        std::mutex lock;
+        std::condition_variable cond;
+        bool done = false;
+        int64_t costMs = 0;
+    } step_state_t;
+
+    typedef struct pending_step {
+        std::string name;
+        std::shared_ptr<step_state_t> state;
+    } pending_step_t;
+
+    bool RunConcurrently(const char* phase, std::vector<teardown_step_t>& steps);
+    bool WaitStep(step_state_t& state, nsecs_t deadline);
+
+    int mDeadlineMs;
+    std::vector<teardown_step_t> mSignals;
+    std::vector<teardown_step_t> mJoins;
+    std::vector<teardown_step_t> mReleases;
+    std::vector<pending_step_t> mPending;
+    std::string mReport;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_TEARDOWN_H_
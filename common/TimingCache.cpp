@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifdef LOG_TAG
+#undef LOG_TAG
+#endif
+#define LOG_TAG "tv_input_TimingCache"
+
+#include "TimingCache.h"
+#include <inttypes.h>
+#include <log/log.h>
+
+namespace android {
+namespace tvinput {
+
+// bounds both lists, a source box rarely goes through more timings
+#define TIMING_CACHE_MAX_RECENT 8
+#define TIMING_CACHE_MAX_FORMATS 16
+
+// static
+TimingCache* TimingCache::GetInstance() {
+    static TimingCache instance;
+    return &instance;
+}
+
+void TimingCache::Touch(const tv_timing_t& timing) {
+    Mutex::Autolock autoLock(mLock);
+    for (auto it = mRecent.begin(); it != mRecent.end(); it++) {
+        if (it->width == timing.width && it->height == timing.height
+                && it->pixelFormat == timing.pixelFormat) {
+            mRecent.erase(it);
+            break;
+        }
+    }
+    mRecent.push_front(timing);
+    if (mRecent.size() > TIMING_CACHE_MAX_RECENT) {
+        mRecent.pop_back();
+    }
+}
+
+std::vector<tv_timing_t> TimingCache::GetRecent(int count) {
+    Mutex::Autolock autoLock(mLock);
+    std::vector<tv_timing_t> recent;
+    for (auto it = mRecent.begin(); it != mRecent.end() && (int)recent.size() < count; it++) {
+        recent.push_back(*it);
+    }
+    return recent;
+}
+
+// static
+bool TimingCache::Matches(const format_entry_t& entry, const struct v4l2_bt_timings& bt,
+        uint32_t srcFormat, uint32_t consumers) {
+    return entry.width == bt.width && entry.height == bt.height
+            && entry.interlaced == bt.interlaced && entry.pixelclock == bt.pixelclock
+            && entry.srcFormat == srcFormat && entry.consumers == consumers;
+}
+
+bool TimingCache::LookupFormat(const struct v4l2_bt_timings& bt, uint32_t srcFormat,
+        uint32_t consumers, uint32_t* pixelFormat) {
+    Mutex::Autolock autoLock(mLock);
+    for (auto it = mFormats.begin(); it != mFormats.end(); it++) {
+        if (Matches(*it, bt, srcFormat, consumers)) {
+            *pixelFormat = it->pixelFormat;
+            mFormats.splice(mFormats.begin(), mFormats, it);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TimingCache::StoreFormat(const struct v4l2_bt_timings& bt, uint32_t srcFormat,
+        uint32_t consumers, uint32_t pixelFormat) {
+    Mutex::Autolock autoLock(mLock);
+    for (auto it = mFormats.begin(); it != mFormats.end(); it++) {
+        if (Matches(*it, bt, srcFormat, consumers)) {
+            mFormats.erase(it);
+            break;
+        }
+    }
+    format_entry_t entry = {bt.width, bt.height, bt.interlaced, bt.pixelclock, srcFormat, consumers,
+        pixelFormat};
+    mFormats.push_front(entry);
+    if (mFormats.size() > TIMING_CACHE_MAX_FORMATS) {
+        mFormats.pop_back();
+    }
+    ALOGD("%s %ux%u%s clk %" PRIu64 " src 0x%x consumers 0x%x -> 0x%x", __FUNCTION__, bt.width,
+        bt.height, bt.interlaced ? "i" : "p", (uint64_t)bt.pixelclock, srcFormat, consumers, pixelFormat);
+}
+
+} /* namespace tvinput */
+} /* namespace android */
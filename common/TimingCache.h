@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2021 Rockchip Electronics Co., Ltd
+ */
+
+#ifndef HDMI_IN_TIMING_CACHE_H_
+#define HDMI_IN_TIMING_CACHE_H_
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <linux/videodev2.h>
+#include <utils/Mutex.h>
+
+namespace android {
+namespace tvinput {
+
+// a capture geometry as the buffers see it
+typedef struct tv_timing {
+    int width;
+    int height;
+    uint32_t pixelFormat;  // v4l2 fourcc
+} tv_timing_t;
+
+// Process wide memory of the source timings seen lately. It outlives the
+// HinDevImpl of one stream so the next open can use it:
+// - the most recently streamed timings, whose buffer sets are kept warm
+// - the negotiated capture format per dv timing, source fourcc and consumer
+//   set, so a known timing skips the ENUM_FMT/TRY_FMT round
+class TimingCache {
+ public:
+    static TimingCache* GetInstance();
+
+    // moves |timing| to the front of the recently streamed list
+    void Touch(const tv_timing_t& timing);
+
+    // up to |count| recently streamed timings, most recent first
+    std::vector<tv_timing_t> GetRecent(int count);
+
+    // true and |pixelFormat| set when |bt| was negotiated before for |consumers|.
+    // |srcFormat| is the fourcc G_FMT reports, rk_hdmirx derives it from the
+    // source colour encoding, which can change under the same timing.
+    bool LookupFormat(const struct v4l2_bt_timings& bt, uint32_t srcFormat, uint32_t consumers,
+            uint32_t* pixelFormat);
+    void StoreFormat(const struct v4l2_bt_timings& bt, uint32_t srcFormat, uint32_t consumers,
+            uint32_t pixelFormat);
+
+ private:
+    typedef struct format_entry {
+        uint32_t width;
+        uint32_t height;
+        uint32_t interlaced;
+        uint64_t pixelclock;
+        uint32_t srcFormat;
+        uint32_t consumers;
+        uint32_t pixelFormat;
+    } format_entry_t;
+
+    TimingCache() {}
+    static bool Matches(const format_entry_t& entry, const struct v4l2_bt_timings& bt,
+            uint32_t srcFormat, uint32_t consumers);
+
+    Mutex mLock;
+    std::list<tv_timing_t> mRecent;
+    std::list<format_entry_t> mFormats;
+};
+
+} /* namespace tvinput */
+} /* namespace android */
+
+#endif  // HDMI_IN_TIMING_CACHE_H_
@@ -32,6 +32,35 @@ class GbmDevice;
 enum BufferType {
   GRALLOC = 0,
   SHM = 1,
+  // HAL-internal buffer allocated straight from /dev/dma_heap, never handed
+  // to other processes. Metadata is kept locally instead of in gralloc.
+  DMABUF_HEAP = 2,
+};
+
+// What a HAL-owned buffer is used for, buffers are accounted per purpose.
+enum BufferPurpose {
+  BUFFER_PURPOSE_OTHER = 0,
+  BUFFER_PURPOSE_CAPTURE,
+  BUFFER_PURPOSE_SIDEBAND,
+  BUFFER_PURPOSE_SIGNAL,
+  BUFFER_PURPOSE_PQ,
+  BUFFER_PURPOSE_IEP,
+  BUFFER_PURPOSE_RECORD,
+  BUFFER_PURPOSE_MAX,
+};
+
+// Directions of a CPU access bracket, see |BeginCpuAccess|.
+enum CpuAccess {
+  CPU_ACCESS_READ = 0x1,
+  CPU_ACCESS_WRITE = 0x2,
+};
+
+// Pipeline stage a cache sync is accounted to in the sync statistics.
+enum CacheSyncStage {
+  CACHE_SYNC_CAPTURE = 0,
+  CACHE_SYNC_CONVERT,
+  CACHE_SYNC_DUMP,
+  CACHE_SYNC_STAGE_MAX,
 };
 
 // Generic camera buffer manager.  The class is for a camera HAL to map and
@@ -84,20 +113,24 @@ class EXPORTED TvInputBufferManager {
   //    |height|: The height of the frame.
   //    |format|: The HAL pixel format of the frame.
   //    |usage|: The gralloc usage of the buffer.
-  //    |type|: Type of the buffer: GRALLOC or SHM.
+  //    |type|: Type of the buffer: GRALLOC, SHM or DMABUF_HEAP.
   //    |out_buffer|: The handle to the allocated buffer.
   //    |out_stride|: The stride of the allocated buffer. |out_stride| is 0 for
   //                  YUV buffers.
+  //    |purpose|: What the buffer is for, its bytes are accounted to it.
   //
   // Returns:
-  //    0 on success; corresponding error code on failure.
+  //    0 on success; -EDQUOT if the buffer would take the HAL over its
+  //    memory budget, checked before allocating; corresponding error code on
+  //    other failures.
   virtual int Allocate(size_t width,
                        size_t height,
                        uint32_t format,
                        uint64_t usage,
                        BufferType type,
                        buffer_handle_t* out_buffer,
-                       uint32_t* out_stride) = 0;
+                       uint32_t* out_stride,
+                       BufferPurpose purpose) = 0;
 
   // Frees |buffer| allocated with TvInputBufferManager::Allocate().
   //
@@ -109,6 +142,47 @@ class EXPORTED TvInputBufferManager {
   virtual int Free(buffer_handle_t buffer) = 0;
   virtual int FreeLocked(buffer_handle_t buffer) = 0;
 
+  // Makes sure |count| buffers of the given geometry sit in the buffer pool,
+  // allocating the missing ones in a single allocator call, so that the
+  // following Allocate() calls are served without allocator round trips.
+  // The new buffers are charged to |purpose| right away, so the budget sees
+  // them before the Allocate() calls they are meant for.
+  //
+  // Args:
+  //    Same as Allocate(), plus |count|: number of buffers wanted.
+  //
+  // Returns:
+  //    0 on success; -EDQUOT when they don't fit the memory budget;
+  //    corresponding error code on other failures.
+  virtual int Prefetch(size_t width,
+                       size_t height,
+                       uint32_t format,
+                       uint64_t usage,
+                       BufferType type,
+                       uint32_t count,
+                       BufferPurpose purpose) = 0;
+
+  // Releases every buffer kept warm in the pool.
+  virtual void TrimPool() = 0;
+
+  // Releases the pooled buffers of one geometry, whatever their usage and
+  // type, and keeps the rest warm.
+  virtual void TrimPool(size_t width, size_t height, uint32_t format) = 0;
+
+  // Logs pool hit/miss counters and retained memory.
+  virtual void DumpPoolStats() = 0;
+
+  // Returns the bytes that can still be allocated before the memory budget
+  // is hit, counting pooled buffers as reclaimable. INT64_MAX when no budget
+  // is set.
+  virtual int64_t GetMemoryHeadroom() = 0;
+
+  // Logs the live bytes per BufferPurpose, the pool and the budget.
+  //
+  // Args:
+  //    |out|: If not null, receives a one line summary in MB.
+  virtual void DumpMemoryStats(std::string* out) = 0;
+
   // This method is analogous to the register() function in Android gralloc
   // module.  This method needs to be called for buffers that are not allocated
   // with Allocate() before |buffer| can be mapped.
@@ -217,9 +291,8 @@ class EXPORTED TvInputBufferManager {
   virtual int UnlockLocked(buffer_handle_t buffer) = 0;
 
   // This method is used to flush cache.
-  // If the allocated buffer has software read/write flags, and the memory
-  // allocated for the buffer is cacheable, |FlushCache| should be called
-  // after the buffer operation by cpu. 
+  // Only does work when a CPU access bracket is still open on |buffer|, it
+  // is a no-op without any IPC for buffers only hardware touches.
   //
   // Args:
   //    |buffer|: The buffer handle to flush.
@@ -228,6 +301,61 @@ class EXPORTED TvInputBufferManager {
   //    0 on success; -EINVAL on invalid buffer handle.
   virtual int FlushCache(buffer_handle_t buffer) = 0;
 
+  // These methods bracket CPU access to a buffer with DMA_BUF_IOCTL_SYNC, so
+  // the CPU sees what the hardware wrote and the hardware sees what the CPU
+  // wrote. Every CPU read or write through a raw mapping has to be enclosed,
+  // gralloc |Lock|/|Unlock| already do this for the locked range.
+  //
+  // Args:
+  //    |buffer|: The buffer handle to sync.
+  //    |access|: CpuAccess bits, the same for the matching begin and end.
+  //    |stage|: The stage the sync is accounted to.
+  //    |offset|, |length|: The byte range touched, 0 length for the whole
+  //        buffer. Only honoured when the kernel supports partial syncs.
+  //
+  // Returns:
+  //    0 on success; -EINVAL on invalid buffer handle.
+  virtual int BeginCpuAccess(buffer_handle_t buffer,
+                             uint32_t access,
+                             CacheSyncStage stage,
+                             size_t offset,
+                             size_t length) = 0;
+  virtual int EndCpuAccess(buffer_handle_t buffer,
+                           uint32_t access,
+                           CacheSyncStage stage,
+                           size_t offset,
+                           size_t length) = 0;
+
+  // These methods hand out a CPU mapping of |buffer| that is set up on first
+  // use and kept until the buffer is freed or deregistered, so software
+  // paths touching a buffer every frame skip the mapper lock/unlock and the
+  // mmap/munmap behind it. The pointer is only coherent between the two
+  // calls, which open and close a CPU access bracket like |BeginCpuAccess|.
+  //
+  // Args:
+  //    |buffer|: The buffer handle to map.
+  //    |access|: CpuAccess bits, the same for the matching release.
+  //    |stage|: The stage the cache syncs are accounted to.
+  //    |length|: The bytes touched from the start, 0 for the whole buffer,
+  //        the same for the matching release.
+  //    |out_addr|: The start of the buffer.
+  //
+  // Returns:
+  //    0 on success; -EINVAL if the buffer is unknown or can't be mapped
+  //    linearly, callers should fall back to |Lock| then.
+  virtual int AcquireCpuMapping(buffer_handle_t buffer,
+                                uint32_t access,
+                                CacheSyncStage stage,
+                                size_t length,
+                                void** out_addr) = 0;
+  virtual int ReleaseCpuMapping(buffer_handle_t buffer,
+                                uint32_t access,
+                                CacheSyncStage stage,
+                                size_t length) = 0;
+
+  // Logs the per-stage cache sync counters.
+  virtual void DumpCacheSyncStats() = 0;
+
   // This method is used to get handle fd.
   //
   // Args:
@@ -250,6 +378,27 @@ class EXPORTED TvInputBufferManager {
   //    buffer size
   virtual int GetHandleBufferSize(buffer_handle_t handle) = 0;
 
+  // This method is used to get the DRM format modifier the allocator picked
+  // for |buffer|, e.g. an AFBC layout.
+  //
+  // Args:
+  //    |buffer|: The buffer handle to query.
+  //
+  // Returns:
+  //    The modifier; 0 (DRM_FORMAT_MOD_LINEAR) for linear or on error.
+  virtual uint64_t GetFormatModifier(buffer_handle_t buffer) = 0;
+
+  // This method is used to get the dma-buf fd backing one plane.
+  //
+  // Args:
+  //    |buffer|: The buffer handle to query.
+  //    |plane|: The plane to query.
+  //
+  // Returns:
+  //    fd of |plane|, falls back to the fd of plane 0 when the allocator
+  //    backs all planes with a single dma-buf; negative on error.
+  virtual int GetPlaneFd(buffer_handle_t buffer, size_t plane) = 0;
+
   // Get the number of physical planes associated with |buffer|.
   //
   // Args:
@@ -288,6 +437,16 @@ class EXPORTED TvInputBufferManager {
   // Returns:
   //    The size of the specified plane; 0 on error.
   static size_t GetPlaneSize(buffer_handle_t buffer, size_t plane);
+
+  // Gets the byte offset of the specified plane inside its dma-buf.
+  //
+  // Args:
+  //    |buffer|: The buffer handle to query.
+  //    |plane|: The plane to query.
+  //
+  // Returns:
+  //    The offset of the specified plane; 0 on error.
+  static size_t GetPlaneOffset(buffer_handle_t buffer, size_t plane);
 };
 
 }  // namespace common
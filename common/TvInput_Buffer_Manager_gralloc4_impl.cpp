@@ -18,6 +18,14 @@
 //#include "LogHelper.h"
 
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "Utils.h"
 
 using android::hardware::graphics::mapper::V4_0::Error;
 using android::hardware::graphics::mapper::V4_0::IMapper;
@@ -102,6 +110,70 @@ static inline void sBufferDescriptorInfo(std::string name, uint32_t width, uint3
     outDescriptorInfo->reservedSize = 0;
 }
 
+// Layout used for DMABUF_HEAP buffers, mirrors what gralloc picks for the
+// formats the HAL allocates internally. Returns 0 for unsupported formats.
+static size_t sHeapBufferLayout(uint32_t width, uint32_t height, uint32_t format,
+                                uint64_t usage, uint32_t* out_stride) {
+    uint32_t align = (usage & RK_GRALLOC_USAGE_STRIDE_ALIGN_64) ? 64 : 16;
+    uint32_t stride = (width + align - 1) / align * align;
+    size_t size = 0;
+    switch (format) {
+    case HAL_PIXEL_FORMAT_YCrCb_NV12:
+        size = (size_t)stride * height * 3 / 2;
+        break;
+    case HAL_PIXEL_FORMAT_YCrCb_NV12_10:
+        size = (size_t)((stride * 10 / 8 + 63) / 64 * 64) * height * 3 / 2;
+        break;
+    case HAL_PIXEL_FORMAT_YCbCr_422_SP:
+        size = (size_t)stride * height * 2;
+        break;
+    case HAL_PIXEL_FORMAT_YCbCr_444_888:
+        size = (size_t)stride * height * 3;
+        break;
+    case HAL_PIXEL_FORMAT_BGR_888:
+    case HAL_PIXEL_FORMAT_RGB_888:
+        stride = (width * 3 + align - 1) / align * align;
+        size = (size_t)stride * height;
+        break;
+    default:
+        return 0;
+    }
+    *out_stride = stride;
+    return size;
+}
+
+static int sOpenHeapFd(size_t size) {
+    char heap[PROPERTY_VALUE_MAX] = {0};
+    property_get(TV_INPUT_DMA_HEAP, heap, "system-dma32");
+    if (!strcmp(heap, "memfd")) {
+        // stand-in for hosts without dma heaps, not importable by hardware
+        int fd = memfd_create("tv_input_scratch", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, size) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    std::string path = std::string("/dev/dma_heap/") + heap;
+    int heapFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (heapFd < 0) {
+        ALOGE("open %s failed: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+    struct dma_heap_allocation_data data;
+    memset(&data, 0, sizeof(data));
+    data.len = size;
+    data.fd_flags = O_RDWR | O_CLOEXEC;
+    int ret = ioctl(heapFd, DMA_HEAP_IOCTL_ALLOC, &data);
+    close(heapFd);
+    if (ret < 0) {
+        ALOGE("DMA_HEAP_IOCTL_ALLOC %zu from %s failed: %s", size, heap, strerror(errno));
+        return -1;
+    }
+    return (int)data.fd;
+}
+
 uint64_t getValidUsageBits() {
     static const uint64_t validUsageBits = []() -> uint64_t {
         uint64_t bits = 0;
@@ -165,6 +237,9 @@ TvInputBufferManager* TvInputBufferManager::GetInstance() {
 // static
 int TvInputBufferManagerImpl::GetHalPixelFormat(buffer_handle_t buffer) {
     ALOGV("GetHalPixelFormat %p", buffer);
+    if (auto heap_context = GetHeapContext(buffer)) {
+        return (int)heap_context->format;
+    }
     auto &mapper = get_mapperservice();
     // android::PixelFormat format;    // *format_requested
     PixelFormat format;    // *format_requested
@@ -248,6 +323,9 @@ uint32_t TvInputBufferManager::GetV4L2PixelFormat(buffer_handle_t buffer) {
 
 int TvInputBufferManagerImpl::GetWidth(buffer_handle_t handle)
 {
+    if (auto heap_context = GetHeapContext(handle)) {
+        return (int)heap_context->width;
+    }
     auto &mapper = get_mapperservice();
     uint64_t width;
 
@@ -262,6 +340,9 @@ int TvInputBufferManagerImpl::GetWidth(buffer_handle_t handle)
 
 int TvInputBufferManagerImpl::GetHeight(buffer_handle_t handle)
 {
+    if (auto heap_context = GetHeapContext(handle)) {
+        return (int)heap_context->height;
+    }
     auto &mapper = get_mapperservice();
     uint64_t height;
 
@@ -274,8 +355,29 @@ int TvInputBufferManagerImpl::GetHeight(buffer_handle_t handle)
     return (int)height;
 }
 
+uint64_t TvInputBufferManagerImpl::GetFormatModifier(buffer_handle_t buffer)
+{
+    if (GetHeapContext(buffer)) {
+        return 0;
+    }
+    auto &mapper = get_mapperservice();
+    uint64_t modifier = 0;
+
+    int err = get_metadata(mapper, buffer, MetadataType_PixelFormatModifier, decodePixelFormatModifier, &modifier);
+    if (err != android::OK)
+    {
+        ALOGE(" %s error: %d", __FUNCTION__, err);
+        return 0;
+    }
+
+    return modifier;
+}
+
 int TvInputBufferManagerImpl::GetHandleBufferSize(buffer_handle_t handle) {
     ALOGV("GetHandleBufferSize handle:%p", handle);
+    if (auto heap_context = GetHeapContext(handle)) {
+        return (int)heap_context->size;
+    }
 
     auto &mapper = get_mapperservice();
     uint64_t bufferSize;
@@ -298,6 +400,10 @@ size_t TvInputBufferManager::GetPlaneStride(buffer_handle_t buffer,
         ALOGE(" %s Invalid plane: : %zu", __FUNCTION__, plane);
         return 0;
     }
+    auto heap_context = static_cast<TvInputBufferManagerImpl*>(GetInstance())->GetHeapContext(buffer);
+    if (heap_context) {
+        return heap_context->stride;
+    }
 
     auto &mapper = get_mapperservice();
     std::vector<PlaneLayout> layouts;
@@ -348,6 +454,16 @@ size_t TvInputBufferManager::GetPlaneSize(buffer_handle_t buffer, size_t plane)
         ALOGE(" %s Invalid plane: %zu", __FUNCTION__, plane);
         return 0;
     }
+    auto heap_context = static_cast<TvInputBufferManagerImpl*>(GetInstance())->GetHeapContext(buffer);
+    if (heap_context) {
+        size_t luma = heap_context->size * 2 / 3;
+        if (heap_context->format == HAL_PIXEL_FORMAT_YCbCr_422_SP) {
+            luma = heap_context->size / 2;
+        } else if (heap_context->format == HAL_PIXEL_FORMAT_YCbCr_444_888) {
+            luma = heap_context->size / 3;
+        }
+        return plane == 0 ? luma : heap_context->size - luma;
+    }
 
     auto &mapper = get_mapperservice();
     std::vector<PlaneLayout> layouts;
@@ -390,6 +506,45 @@ size_t TvInputBufferManager::GetPlaneSize(buffer_handle_t buffer, size_t plane)
     }
 }
 
+// static
+size_t TvInputBufferManager::GetPlaneOffset(buffer_handle_t buffer, size_t plane) {
+    ALOGV("GetPlaneOffset %p plane:%zu", buffer, plane);
+    if (plane >= GetNumPlanes(buffer)) {
+        ALOGE(" %s Invalid plane: %zu", __FUNCTION__, plane);
+        return 0;
+    }
+    if (plane == 0) {
+        return 0;
+    }
+    auto heap_context = static_cast<TvInputBufferManagerImpl*>(GetInstance())->GetHeapContext(buffer);
+    if (heap_context) {
+        return GetPlaneSize(buffer, 0);
+    }
+
+    auto &mapper = get_mapperservice();
+    std::vector<PlaneLayout> layouts;
+    int format_requested;
+
+    format_requested = GetInstance()->GetHalPixelFormat(buffer);
+
+    if ( format_requested != HAL_PIXEL_FORMAT_YCrCb_NV12_10 )
+    {
+        int err = get_metadata(mapper, buffer, MetadataType_PlaneLayouts, decodePlaneLayouts, &layouts);
+        if (err != android::OK || layouts.size() <= plane)
+        {
+            ALOGE(" %s Failed to get plane layouts. err: %d", __FUNCTION__, err);
+            return 0;
+        }
+
+        return layouts[plane].offsetInBytes;
+    }
+    else
+    {
+        // NV12_10 keeps the rk_drm_gralloc layout: uv follows y directly
+        return GetPlaneSize(buffer, 0) * GetInstance()->GetHeight(buffer);
+    }
+}
+
 status_t TvInputBufferManagerImpl::validateBufferDescriptorInfo(
         IMapper::BufferDescriptorInfo* descriptorInfo) const {
     uint64_t validUsageBits = getValidUsageBits();
@@ -468,43 +623,76 @@ int TvInputBufferManagerImpl::Allocate(size_t width,
                                       uint64_t usage,
                                       BufferType type,
                                       buffer_handle_t* out_buffer,
-                                      uint32_t* out_stride) {
+                                      uint32_t* out_stride,
+                                      BufferPurpose purpose) {
+    BufferPoolKey key = {(uint32_t)width, (uint32_t)height, format, usage, type};
+    int ret = 0;
+    if (purpose >= BUFFER_PURPOSE_MAX) {
+        return -EINVAL;
+    }
+    if (AcquireFromPool(key, out_buffer, out_stride)) {
+        auto buffer_context = buffer_context_.Find(*out_buffer);
+        size_t size = buffer_context ? buffer_context->size : 0;
+        if (buffer_context && buffer_context->charged) {
+            // prefetched, its bytes were booked then
+            if (buffer_context->purpose != purpose) {
+                purpose_bytes_[buffer_context->purpose] -= size;
+                purpose_bytes_[purpose] += size;
+                buffer_context->purpose = purpose;
+            }
+            return 0;
+        }
+        ret = ReserveBudget(size, purpose);
+        if (ret) {
+            ReleaseBuffer(*out_buffer);
+            *out_buffer = nullptr;
+            return ret;
+        }
+        return ChargeBuffer(*out_buffer, purpose, size);
+    }
+
+    // the budget caps the peak, so it is checked before anything is allocated
+    uint32_t estimated_stride = 0;
+    size_t reserved = sHeapBufferLayout(width, height, format, usage, &estimated_stride);
+    if (!reserved) {
+        reserved = width * height * 4;
+    }
+    ret = ReserveBudget(reserved, purpose);
+    if (ret) {
+        return ret;
+    }
     if (type == GRALLOC) {
-        return AllocateGrallocBuffer(width, height, format, usage, out_buffer,
-                                     out_stride);
+        ret = AllocateGrallocBuffer(width, height, format, usage, out_buffer,
+                                    out_stride);
+    } else if (type == DMABUF_HEAP) {
+        ret = AllocateDmaHeapBuffer(width, height, format, usage, out_buffer,
+                                    out_stride);
     } else {
         ALOGE("Invalid buffer type: %d", type);
-        return -EINVAL;
+        ret = -EINVAL;
     }
+    if (ret) {
+        purpose_bytes_[purpose] -= reserved;
+        return ret;
+    }
+    return ChargeBuffer(*out_buffer, purpose, reserved);
 }
 
 int TvInputBufferManagerImpl::Free(buffer_handle_t buffer) {
     ALOGD("Free %p", buffer);
 
-    auto context_it = buffer_context_.find(buffer);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", buffer);
         return -EINVAL;
     }
 
-    auto buffer_context = context_it->second.get();
-
-    if (buffer_context->type == GRALLOC) {
-        #if IMPORTBUFFER_CB == 1
-        if (buffer) {
-            freeBuffer(buffer);           
-            buffer = nullptr;
-        }
-        #else
-        if (buffer) {
-            auto abuffer = const_cast<native_handle_t*>(
-                    buffer);
-            native_handle_close(abuffer);
-            native_handle_delete(abuffer);
-            buffer = nullptr;
+    if (buffer_context->type == GRALLOC || buffer_context->type == DMABUF_HEAP) {
+        UnchargeBuffer(buffer_context.get());
+        if (ReleaseToPool(buffer)) {
+            return 0;
         }
-        #endif
-        return 0;
+        return ReleaseBuffer(buffer);
     } else {
         // TODO(jcliang): Implement deletion of SharedMemory.
         return -EINVAL;
@@ -514,6 +702,18 @@ int TvInputBufferManagerImpl::Free(buffer_handle_t buffer) {
 
 int TvInputBufferManagerImpl::FreeLocked(buffer_handle_t buffer) {
     ALOGD("Free %p", buffer);
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (buffer_context && buffer_context->owned) {
+        UnchargeBuffer(buffer_context.get());
+        if (ReleaseToPool(buffer)) {
+            return 0;
+        }
+        return ReleaseBuffer(buffer);
+    }
+    if (buffer_context) {
+        buffer_context_.Erase(buffer);
+        PutCpuMapping(buffer_context.get());
+    }
 
     #if IMPORTBUFFER_CB == 1
     if (buffer) {
@@ -532,15 +732,335 @@ int TvInputBufferManagerImpl::FreeLocked(buffer_handle_t buffer) {
     return 0;
 }
 
+int TvInputBufferManagerImpl::ReleaseBuffer(buffer_handle_t buffer) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (buffer_context) {
+        // only prefetched buffers are still charged here
+        UnchargeBuffer(buffer_context.get());
+    }
+    if (buffer_context && buffer_context->type == DMABUF_HEAP) {
+        return FreeDmaHeapBuffer(buffer);
+    }
+    if (auto erased = buffer_context_.Erase(buffer)) {
+        PutCpuMapping(erased.get());
+    }
+
+    #if IMPORTBUFFER_CB == 1
+    if (buffer) {
+        freeBuffer(buffer);
+    }
+    #else
+    if (buffer) {
+        auto abuffer = const_cast<native_handle_t*>(
+                buffer);
+        native_handle_close(abuffer);
+        native_handle_delete(abuffer);
+    }
+    #endif
+    return 0;
+}
+
+bool TvInputBufferManagerImpl::AcquireFromPool(const BufferPoolKey& key,
+                                               buffer_handle_t* out_buffer,
+                                               uint32_t* out_stride) {
+    android::Mutex::Autolock _l(pool_lock_);
+    for (auto it = buffer_pool_.begin(); it != buffer_pool_.end(); it++) {
+        if (it->first == key) {
+            *out_buffer = it->second;
+            auto buffer_context = buffer_context_.Find(it->second);
+            *out_stride = buffer_context ? buffer_context->stride : 0;
+            if (buffer_context && !buffer_context->charged) {
+                pool_retained_bytes_ -= buffer_context->size;
+            }
+            buffer_pool_.erase(it);
+            pool_hits_++;
+            ALOGD("pool hit %p %ux%u fmt %u", *out_buffer, key.width, key.height, key.format);
+            return true;
+        }
+    }
+    pool_misses_++;
+    return false;
+}
+
+bool TvInputBufferManagerImpl::ReleaseToPool(buffer_handle_t buffer) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context || !buffer_context->owned) {
+        return false;
+    }
+    size_t budget = (size_t)property_get_int32(TV_INPUT_POOL_BUDGET, 64) << 20;
+    if (buffer_context->size > budget) {
+        return false;
+    }
+
+    std::vector<buffer_handle_t> evicted;
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        // oldest first, prefetched buffers are booked to their purpose and stay
+        auto it = buffer_pool_.end();
+        while (it != buffer_pool_.begin() && pool_retained_bytes_ + buffer_context->size > budget) {
+            --it;
+            auto victim_context = buffer_context_.Find(it->second);
+            if (victim_context && victim_context->charged) {
+                continue;
+            }
+            if (victim_context) {
+                pool_retained_bytes_ -= victim_context->size;
+            }
+            evicted.push_back(it->second);
+            it = buffer_pool_.erase(it);
+        }
+        BufferPoolKey key = {buffer_context->width, buffer_context->height,
+                             buffer_context->format, buffer_context->alloc_usage,
+                             buffer_context->type};
+        buffer_pool_.emplace_front(key, buffer);
+        pool_retained_bytes_ += buffer_context->size;
+    }
+    for (auto victim : evicted) {
+        ReleaseBuffer(victim);
+    }
+    return true;
+}
+
+int TvInputBufferManagerImpl::Prefetch(size_t width,
+                                      size_t height,
+                                      uint32_t format,
+                                      uint64_t usage,
+                                      BufferType type,
+                                      uint32_t count,
+                                      BufferPurpose purpose) {
+    BufferPoolKey key = {(uint32_t)width, (uint32_t)height, format, usage, type};
+    uint32_t pooled = 0;
+    if (purpose >= BUFFER_PURPOSE_MAX) {
+        return -EINVAL;
+    }
+    if (type != GRALLOC && type != DMABUF_HEAP) {
+        return -EINVAL;
+    }
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        for (auto& entry : buffer_pool_) {
+            if (entry.first == key) {
+                pooled++;
+            }
+        }
+    }
+    if (pooled >= count) {
+        return 0;
+    }
+
+    // booked like the Allocate() calls they stand in for, which then take
+    // them without reserving again
+    uint32_t missing = count - pooled;
+    uint32_t estimated_stride = 0;
+    size_t estimate = sHeapBufferLayout(width, height, format, usage, &estimated_stride);
+    if (!estimate) {
+        estimate = width * height * 4;
+    }
+    int ret = ReserveBudget(estimate * missing, purpose);
+    if (ret) {
+        return ret;
+    }
+
+    std::vector<buffer_handle_t> buffers;
+    uint32_t stride = 0;
+    if (type == GRALLOC) {
+        ret = AllocateGrallocBuffers(width, height, format, usage, missing, &buffers, &stride);
+    } else {
+        for (uint32_t i = 0; i < missing; i++) {
+            buffer_handle_t buffer = nullptr;
+            ret = AllocateDmaHeapBuffer(width, height, format, usage, &buffer, &stride);
+            if (ret) {
+                break;
+            }
+            buffers.push_back(buffer);
+        }
+    }
+    purpose_bytes_[purpose] -= (int64_t)(estimate * (missing - buffers.size()));
+    for (auto buffer : buffers) {
+        ChargeBuffer(buffer, purpose, estimate);
+    }
+
+    android::Mutex::Autolock _l(pool_lock_);
+    for (auto buffer : buffers) {
+        buffer_pool_.emplace_front(key, buffer);
+    }
+    pool_prefetched_ += buffers.size();
+    ALOGD("Prefetch %zu buffers %zux%zu fmt %u ret %d", buffers.size(), width, height, format, ret);
+    return ret;
+}
+
+void TvInputBufferManagerImpl::TrimPool() {
+    std::vector<buffer_handle_t> buffers;
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        for (auto& entry : buffer_pool_) {
+            buffers.push_back(entry.second);
+        }
+        buffer_pool_.clear();
+        pool_retained_bytes_ = 0;
+    }
+    for (auto buffer : buffers) {
+        ReleaseBuffer(buffer);
+    }
+}
+
+void TvInputBufferManagerImpl::TrimPool(size_t width, size_t height, uint32_t format) {
+    std::vector<buffer_handle_t> buffers;
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        for (auto it = buffer_pool_.begin(); it != buffer_pool_.end(); ) {
+            const BufferPoolKey& key = it->first;
+            if (key.width != width || key.height != height || key.format != format) {
+                ++it;
+                continue;
+            }
+            auto buffer_context = buffer_context_.Find(it->second);
+            if (buffer_context && !buffer_context->charged) {
+                pool_retained_bytes_ -= buffer_context->size;
+            }
+            buffers.push_back(it->second);
+            it = buffer_pool_.erase(it);
+        }
+    }
+    ALOGD("TrimPool %zu buffers %zux%zu fmt %u", buffers.size(), width, height, format);
+    for (auto buffer : buffers) {
+        ReleaseBuffer(buffer);
+    }
+}
+
+void TvInputBufferManagerImpl::TrimIdlePool() {
+    std::vector<buffer_handle_t> buffers;
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        for (auto it = buffer_pool_.begin(); it != buffer_pool_.end(); ) {
+            auto buffer_context = buffer_context_.Find(it->second);
+            if (buffer_context && buffer_context->charged) {
+                ++it;
+                continue;
+            }
+            if (buffer_context) {
+                pool_retained_bytes_ -= buffer_context->size;
+            }
+            buffers.push_back(it->second);
+            it = buffer_pool_.erase(it);
+        }
+    }
+    for (auto buffer : buffers) {
+        ReleaseBuffer(buffer);
+    }
+}
+
+size_t TvInputBufferManagerImpl::GetLiveBytes() {
+    int64_t live = 0;
+    for (int i = 0; i < BUFFER_PURPOSE_MAX; i++) {
+        live += purpose_bytes_[i].load();
+    }
+    return live > 0 ? (size_t)live : 0;
+}
+
+int TvInputBufferManagerImpl::ReserveBudget(size_t size, BufferPurpose purpose) {
+    size_t budget = (size_t)property_get_int32(TV_INPUT_MEM_BUDGET, 0) << 20;
+    bool trim = false;
+    {
+        android::Mutex::Autolock _l(budget_lock_);
+        if (budget) {
+            size_t pooled = 0;
+            {
+                android::Mutex::Autolock _p(pool_lock_);
+                pooled = pool_retained_bytes_;
+            }
+            // dropping the idle pool doesn't change the live bytes
+            if (GetLiveBytes() + size > budget) {
+                ALOGE("reject %zu bytes for purpose %d, %zu of %zu MB in use",
+                      size, purpose, GetLiveBytes() >> 20, budget >> 20);
+                return -EDQUOT;
+            }
+            trim = pooled && GetLiveBytes() + pooled + size > budget;
+        }
+        // booked before the trim, so a racing reservation can't count on it
+        purpose_bytes_[purpose] += size;
+    }
+    if (trim) {
+        ALOGW("memory budget %zu MB reached, dropping the idle buffer pool", budget >> 20);
+        TrimIdlePool();
+    }
+    return 0;
+}
+
+int TvInputBufferManagerImpl::ChargeBuffer(buffer_handle_t buffer, BufferPurpose purpose,
+                                           size_t reserved) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context) {
+        purpose_bytes_[purpose] -= reserved;
+        return -EINVAL;
+    }
+    // the reservation was an estimate, account what was really allocated
+    purpose_bytes_[purpose] += (int64_t)buffer_context->size - (int64_t)reserved;
+    buffer_context->purpose = purpose;
+    buffer_context->charged = true;
+    return 0;
+}
+
+void TvInputBufferManagerImpl::UnchargeBuffer(BufferContext* buffer_context) {
+    if (buffer_context->charged) {
+        buffer_context->charged = false;
+        purpose_bytes_[buffer_context->purpose] -= buffer_context->size;
+    }
+}
+
+int64_t TvInputBufferManagerImpl::GetMemoryHeadroom() {
+    size_t budget = (size_t)property_get_int32(TV_INPUT_MEM_BUDGET, 0) << 20;
+    if (!budget) {
+        return INT64_MAX;
+    }
+    return (int64_t)budget - (int64_t)GetLiveBytes();
+}
+
+void TvInputBufferManagerImpl::DumpMemoryStats(std::string* out) {
+    static const char* kPurposeNames[BUFFER_PURPOSE_MAX] = {
+        "oth", "cap", "sb", "sig", "pq", "iep", "rec"};
+    size_t pooled = 0;
+    {
+        android::Mutex::Autolock _l(pool_lock_);
+        pooled = pool_retained_bytes_;
+    }
+    size_t live = GetLiveBytes();
+    char line[256] = {0};
+    int len = snprintf(line, sizeof(line), "total=%zuM pool=%zuM budget=%dM",
+                       (live + pooled) >> 20, pooled >> 20,
+                       property_get_int32(TV_INPUT_MEM_BUDGET, 0));
+    for (int i = 0; i < BUFFER_PURPOSE_MAX && len < (int)sizeof(line); i++) {
+        int64_t bytes = purpose_bytes_[i].load();
+        if (bytes > 0) {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%" PRId64 "M",
+                            kPurposeNames[i], bytes >> 20);
+        }
+    }
+    ALOGI("hal buffer memory: %s", line);
+    for (int i = 0; i < BUFFER_PURPOSE_MAX; i++) {
+        ALOGD("  %s: %" PRId64 " bytes", kPurposeNames[i], purpose_bytes_[i].load());
+    }
+    if (out) {
+        *out = line;
+    }
+}
+
+void TvInputBufferManagerImpl::DumpPoolStats() {
+    android::Mutex::Autolock _l(pool_lock_);
+    ALOGD("buffer pool: hit %u miss %u prefetched %u, %zu buffers %zu bytes retained, %zu registered",
+          pool_hits_, pool_misses_, pool_prefetched_, buffer_pool_.size(), pool_retained_bytes_,
+          buffer_context_.Size());
+}
+
 int TvInputBufferManagerImpl::Register(buffer_handle_t buffer, buffer_handle_t* outbuffer) {
     ALOGV("Register buffer:%p", buffer);
-    auto context_it = buffer_context_.find(buffer);
-    if (context_it != buffer_context_.end()) {
-        context_it->second->usage++;
+    android::Mutex::Autolock _l(register_lock_);
+    if (auto registered = buffer_context_.Find(buffer)) {
+        registered->usage++;
         return 1;
     }
 
-    std::unique_ptr<BufferContext> buffer_context(new struct BufferContext);
+    std::shared_ptr<BufferContext> buffer_context = std::make_shared<BufferContext>();
 
     buffer_context->type = GRALLOC;
 
@@ -554,7 +1074,9 @@ int TvInputBufferManagerImpl::Register(buffer_handle_t buffer, buffer_handle_t*
     }
     
     buffer_context->usage = 1;
-    buffer_context_[*outbuffer] = std::move(buffer_context);
+    buffer_context->fd = GetHandleFd(*outbuffer);
+    buffer_context->size = GetHandleBufferSize(*outbuffer);
+    buffer_context_.Insert(*outbuffer, std::move(buffer_context));
     ALOGV("Register buffer ok");
 
     return 0;
@@ -562,17 +1084,18 @@ int TvInputBufferManagerImpl::Register(buffer_handle_t buffer, buffer_handle_t*
 
 int TvInputBufferManagerImpl::Deregister(buffer_handle_t buffer) {
     ALOGV("Deregister %p", buffer);
+    android::Mutex::Autolock _l(register_lock_);
 
-    auto context_it = buffer_context_.find(buffer);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", buffer);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
     if (buffer_context->type == GRALLOC) {
         if (!--buffer_context->usage) {
             // Unmap all the existing mapping of bo.
-            buffer_context_.erase(context_it);
+            buffer_context_.Erase(buffer);
+            PutCpuMapping(buffer_context.get());
 
             int ret = freeBuffer(buffer);
 
@@ -604,6 +1127,16 @@ int TvInputBufferManagerImpl::ImportBufferLocked(buffer_handle_t& rawHandle) {
 
     rawHandle = importedHandle;
     ALOGD("%s rawBuffer :%p, outHandle = %p", __FUNCTION__, rawHandle, importedHandle);
+
+    // track it so the fd and a persistent cpu mapping can be cached until
+    // FreeLocked, the mapper still owns the handle
+    std::shared_ptr<BufferContext> buffer_context = std::make_shared<BufferContext>();
+    buffer_context->buffer_id = reinterpret_cast<uint64_t>(buffer_context.get());
+    buffer_context->type = GRALLOC;
+    buffer_context->usage = 1;
+    buffer_context->fd = GetHandleFd(importedHandle);
+    buffer_context->size = GetHandleBufferSize(importedHandle);
+    buffer_context_.Insert(importedHandle, std::move(buffer_context));
     return 0;
 }
 
@@ -616,12 +1149,11 @@ int TvInputBufferManagerImpl::Lockinternal(buffer_handle_t bufferHandle,
                                   void** out_addr) {
     ALOGV("lock buffer:%p   %d, %d, %d, %d, %d", bufferHandle, x, y,width, height, flags);
 
-    auto context_it = buffer_context_.find(bufferHandle);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(bufferHandle);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", bufferHandle);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
 
     uint32_t num_planes = GetNumPlanes(bufferHandle);
     if (!num_planes) {
@@ -666,12 +1198,11 @@ int TvInputBufferManagerImpl::Lockinternal(buffer_handle_t bufferHandle,
 int TvInputBufferManagerImpl::Unlockinternal(buffer_handle_t bufferHandle) {
     ALOGV("Unlock buffer:%p", bufferHandle);
 
-    auto context_it = buffer_context_.find(bufferHandle);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(bufferHandle);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", bufferHandle);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
     if (buffer_context->type == GRALLOC) {
         auto &mapper = get_mapperservice();
         auto buffer = const_cast<native_handle_t*>(bufferHandle);
@@ -724,12 +1255,11 @@ int TvInputBufferManagerImpl::Lock(buffer_handle_t bufferHandle,
                                   void** out_addr) {
     ALOGV("lock buffer:%p   %d, %d, %d, %d, %d", bufferHandle, x, y,width, height, flags);
 
-    auto context_it = buffer_context_.find(bufferHandle);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(bufferHandle);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", bufferHandle);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
 
     uint32_t num_planes = GetNumPlanes(bufferHandle);
     if (!num_planes) {
@@ -767,6 +1297,9 @@ int TvInputBufferManagerImpl::Lock(buffer_handle_t bufferHandle,
         ALOGE_IF(error != Error::NONE, "lock(%p, ...) failed: %d", bufferHandle, error);
 
         return (int)error;
+    } else if (buffer_context->type == DMABUF_HEAP) {
+        *out_addr = GetCpuMapping(buffer_context.get());
+        return *out_addr ? 0 : -ENOMEM;
     } else {
         ALOGE("Invalid buffer type: %d", buffer_context->type);
         return -EINVAL;
@@ -785,6 +1318,10 @@ int TvInputBufferManagerImpl::LockLocked(buffer_handle_t bufferHandle,
                                   void** out_addr) {
     ALOGV("lock buffer:%p   %d, %d, %d, %d, %d", bufferHandle, x, y,width, height, flags);
 
+    if (GetHeapContext(bufferHandle)) {
+        return Lock(bufferHandle, flags, x, y, width, height, out_addr);
+    }
+
     uint32_t num_planes = GetNumPlanes(bufferHandle);
     if (!num_planes) {
         return -EINVAL;
@@ -838,12 +1375,11 @@ int TvInputBufferManagerImpl::LockYCbCr(buffer_handle_t buffer,
                                        struct android_ycbcr* out_ycbcr) {
     ALOGV("LockYCbCr");
 
-    auto context_it = buffer_context_.find(buffer);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", buffer);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
     uint32_t num_planes = GetNumPlanes(buffer);
     if (!num_planes) {
         return -EINVAL;
@@ -961,12 +1497,11 @@ int TvInputBufferManagerImpl::LockYCbCr(buffer_handle_t buffer,
 int TvInputBufferManagerImpl::Unlock(buffer_handle_t bufferHandle) {
     ALOGV("Unlock buffer:%p", bufferHandle);
 
-    auto context_it = buffer_context_.find(bufferHandle);
-    if (context_it == buffer_context_.end()) {
+    auto buffer_context = buffer_context_.Find(bufferHandle);
+    if (!buffer_context) {
         ALOGE("Failed Unknown buffer %p", bufferHandle);
         return -EINVAL;
     }
-    auto buffer_context = context_it->second.get();
     if (buffer_context->type == GRALLOC) {
         auto &mapper = get_mapperservice();
         auto buffer = const_cast<native_handle_t*>(bufferHandle);
@@ -1013,6 +1548,10 @@ int TvInputBufferManagerImpl::Unlock(buffer_handle_t bufferHandle) {
 
 int TvInputBufferManagerImpl::UnlockLocked(buffer_handle_t bufferHandle) {
     ALOGV("Unlock buffer:%p", bufferHandle);
+    if (GetHeapContext(bufferHandle)) {
+        // the mapping stays until the buffer is freed
+        return 0;
+    }
 
     auto &mapper = get_mapperservice();
     auto buffer = const_cast<native_handle_t*>(bufferHandle);
@@ -1055,35 +1594,197 @@ int TvInputBufferManagerImpl::UnlockLocked(buffer_handle_t bufferHandle) {
 }
 
 int TvInputBufferManagerImpl::FlushCache(buffer_handle_t buffer) {
+    if (!buffer) {
+        return -EINVAL;
+    }
+    // capture and display both are hardware, only a CPU access still in
+    // flight needs its writes pushed out before the frame moves on
+    auto buffer_context = buffer_context_.Find(buffer);
+    uint32_t access = buffer_context ? buffer_context->cpu_access.load() : 0;
+    if (!access) {
+        flush_skipped_count_++;
+        return 0;
+    }
+    return EndCpuAccess(buffer, access, CACHE_SYNC_CAPTURE, 0, 0);
+}
+
+int TvInputBufferManagerImpl::SyncBuffer(buffer_handle_t buffer,
+                                         uint64_t flags,
+                                         size_t offset,
+                                         size_t length) {
     int fd = -1;
+    if (auto buffer_context = buffer_context_.Find(buffer)) {
+        fd = buffer_context->fd;
+    }
+    if (fd < 0 && buffer->numFds > 0) {
+        // imported handles carry the dma-buf fd in data[0]
+        fd = buffer->data[0];
+    }
+    if (fd < 0) {
+        ALOGE("get fd error for buffer %p", buffer);
+        return -EINVAL;
+    }
 
-    auto &mapper = get_mapperservice();
-    std::vector<int64_t> fds;
+#ifdef DMA_BUF_IOCTL_SYNC_PARTIAL
+    if (length) {
+        struct dma_buf_sync_partial sync_partial;
+        memset(&sync_partial, 0, sizeof(sync_partial));
+        sync_partial.flags = flags;
+        sync_partial.offset = offset;
+        sync_partial.len = length;
+        if (!ioctl(fd, DMA_BUF_IOCTL_SYNC_PARTIAL, &sync_partial)) {
+            return 0;
+        }
+        // fall back to syncing the whole buffer
+    }
+#else
+    (void)offset;
+    (void)length;
+#endif
 
-    int err = get_metadata(mapper, buffer, ArmMetadataType_PLANE_FDS, decodeArmPlaneFds, &fds);
-    if (err != android::OK)
-    {
-        ALOGE("Failed to get plane_fds. err : %d", err);
-        return err;
+    struct dma_buf_sync sync_args;
+    sync_args.flags = flags;
+    if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync_args)) {
+        ALOGE("DMA_BUF_IOCTL_SYNC %p flags 0x%" PRIx64 " failed: %s",
+              buffer, flags, strerror(errno));
+        return -errno;
     }
-    assert (fds.size() > 0);
+    return 0;
+}
 
-    fd = (int)(fds[0]);
-    if (fd == -1) {
-        ALOGE("get fd error for buffer %p", buffer);
+static uint64_t sDmaBufSyncDirection(uint32_t access) {
+    uint64_t flags = 0;
+    if (access & CPU_ACCESS_READ) {
+        flags |= DMA_BUF_SYNC_READ;
+    }
+    if (access & CPU_ACCESS_WRITE) {
+        flags |= DMA_BUF_SYNC_WRITE;
+    }
+    return flags;
+}
+
+int TvInputBufferManagerImpl::BeginCpuAccess(buffer_handle_t buffer,
+                                             uint32_t access,
+                                             CacheSyncStage stage,
+                                             size_t offset,
+                                             size_t length) {
+    if (!buffer || !access || stage >= CACHE_SYNC_STAGE_MAX) {
         return -EINVAL;
     }
+    int ret = SyncBuffer(buffer, DMA_BUF_SYNC_START | sDmaBufSyncDirection(access),
+                         offset, length);
+    if (ret) {
+        return ret;
+    }
+    if (auto buffer_context = buffer_context_.Find(buffer)) {
+        buffer_context->cpu_access |= access;
+    }
+    sync_begin_count_[stage]++;
+    return 0;
+}
+
+int TvInputBufferManagerImpl::EndCpuAccess(buffer_handle_t buffer,
+                                           uint32_t access,
+                                           CacheSyncStage stage,
+                                           size_t offset,
+                                           size_t length) {
+    if (!buffer || !access || stage >= CACHE_SYNC_STAGE_MAX) {
+        return -EINVAL;
+    }
+    if (auto buffer_context = buffer_context_.Find(buffer)) {
+        buffer_context->cpu_access &= ~access;
+    }
+    int ret = SyncBuffer(buffer, DMA_BUF_SYNC_END | sDmaBufSyncDirection(access),
+                         offset, length);
+    if (ret) {
+        return ret;
+    }
+    sync_end_count_[stage]++;
+    return 0;
+}
+
+void* TvInputBufferManagerImpl::GetCpuMapping(BufferContext* buffer_context) {
+    void* addr = buffer_context->mapped;
+    if (addr) {
+        return addr;
+    }
+    if (buffer_context->fd < 0 || !buffer_context->size) {
+        return nullptr;
+    }
+    addr = mmap(nullptr, buffer_context->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, buffer_context->fd, 0);
+    if (addr == MAP_FAILED) {
+        ALOGE("mmap buffer fd %d failed: %s", buffer_context->fd, strerror(errno));
+        return nullptr;
+    }
+    void* expected = nullptr;
+    if (!buffer_context->mapped.compare_exchange_strong(expected, addr)) {
+        // another thread mapped it first, use that mapping
+        munmap(addr, buffer_context->size);
+        return expected;
+    }
+    cpu_mapping_count_++;
+    return addr;
+}
 
-    /*struct dma_buf_sync sync_args;
-    sync_args.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
-    if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync_args))
-        return -EINVAL;*/
+void TvInputBufferManagerImpl::PutCpuMapping(BufferContext* buffer_context) {
+    void* addr = buffer_context->mapped.exchange(nullptr);
+    if (addr) {
+        munmap(addr, buffer_context->size);
+        cpu_mapping_count_--;
+    }
+}
 
+int TvInputBufferManagerImpl::AcquireCpuMapping(buffer_handle_t buffer,
+                                                uint32_t access,
+                                                CacheSyncStage stage,
+                                                size_t length,
+                                                void** out_addr) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context || !out_addr) {
+        return -EINVAL;
+    }
+    // compressed buffers have no linear layout to hand out, only asked
+    // before the first mapping so later frames stay free of mapper calls
+    if (!buffer_context->mapped && buffer_context->type == GRALLOC
+            && GetFormatModifier(buffer) != DRM_FORMAT_MOD_LINEAR) {
+        return -EINVAL;
+    }
+    void* addr = GetCpuMapping(buffer_context.get());
+    if (!addr) {
+        return -EINVAL;
+    }
+    int ret = BeginCpuAccess(buffer, access, stage, 0, length);
+    if (ret) {
+        return ret;
+    }
+    *out_addr = addr;
     return 0;
 }
 
+int TvInputBufferManagerImpl::ReleaseCpuMapping(buffer_handle_t buffer,
+                                                uint32_t access,
+                                                CacheSyncStage stage,
+                                                size_t length) {
+    // the mapping itself stays until the buffer goes away
+    return EndCpuAccess(buffer, access, stage, 0, length);
+}
+
+void TvInputBufferManagerImpl::DumpCacheSyncStats() {
+    static const char* kStageNames[CACHE_SYNC_STAGE_MAX] = {"capture", "convert", "dump"};
+    for (int i = 0; i < CACHE_SYNC_STAGE_MAX; i++) {
+        ALOGD("cache sync %s: begin %u end %u", kStageNames[i],
+              sync_begin_count_[i].load(), sync_end_count_[i].load());
+    }
+    ALOGD("cache sync: %u flushes skipped, %u persistent cpu mappings",
+          flush_skipped_count_.load(), cpu_mapping_count_.load());
+}
+
 int TvInputBufferManagerImpl::GetBufferId(buffer_handle_t buffer) {
     uint64_t buffer_id = -1;
+    if (auto heap_context = GetHeapContext(buffer)) {
+        return (int32_t)heap_context->buffer_id;
+    }
 
     auto &mapper = get_mapperservice();
 
@@ -1099,6 +1800,10 @@ int TvInputBufferManagerImpl::GetBufferId(buffer_handle_t buffer) {
 
 int TvInputBufferManagerImpl::GetHandleFd(buffer_handle_t buffer) {
     int fd = -1;
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (buffer_context && buffer_context->fd >= 0) {
+        return buffer_context->fd;
+    }
     auto &mapper = get_mapperservice();
     std::vector<int64_t> fds;
 
@@ -1116,13 +1821,49 @@ int TvInputBufferManagerImpl::GetHandleFd(buffer_handle_t buffer) {
     return fd;
 }
 
+int TvInputBufferManagerImpl::GetPlaneFd(buffer_handle_t buffer, size_t plane) {
+    if (auto heap_context = GetHeapContext(buffer)) {
+        return heap_context->fd;
+    }
+    auto &mapper = get_mapperservice();
+    std::vector<int64_t> fds;
+
+    int err = get_metadata(mapper, buffer, ArmMetadataType_PLANE_FDS, decodeArmPlaneFds, &fds);
+    if (err != android::OK || fds.empty())
+    {
+        ALOGE("Failed to get plane_fds. err : %d", err);
+        return err != android::OK ? err : -EINVAL;
+    }
+
+    if (plane < fds.size() && fds[plane] >= 0) {
+        return (int)(fds[plane]);
+    }
+    return (int)(fds[0]);
+}
+
 int TvInputBufferManagerImpl::AllocateGrallocBuffer(size_t width,
                                                    size_t height,
                                                    uint32_t format,
                                                    uint64_t usage,
                                                    buffer_handle_t* out_buffer,
                                                    uint32_t* out_stride) {
-    ALOGD("AllocateGrallocBuffer %zu, %zu, %u, %" PRIu64, width, height, format, usage);
+    std::vector<buffer_handle_t> buffers;
+    int ret = AllocateGrallocBuffers(width, height, format, usage, 1, &buffers, out_stride);
+    if (ret != android::NO_ERROR || buffers.empty()) {
+        return ret != android::NO_ERROR ? ret : -ENOMEM;
+    }
+    *out_buffer = buffers[0];
+    return ret;
+}
+
+int TvInputBufferManagerImpl::AllocateGrallocBuffers(size_t width,
+                                                    size_t height,
+                                                    uint32_t format,
+                                                    uint64_t usage,
+                                                    uint32_t count,
+                                                    std::vector<buffer_handle_t>* out_buffers,
+                                                    uint32_t* out_stride) {
+    ALOGD("AllocateGrallocBuffers %zu, %zu, %u, %" PRIu64 " x%u", width, height, format, usage, count);
 
     IMapper::BufferDescriptorInfo descriptorInfo;
     sBufferDescriptorInfo("tv_input_SidebandStream", width, height, (PixelFormat)format, 1/*layerCount*/, usage, &descriptorInfo);
@@ -1134,12 +1875,8 @@ int TvInputBufferManagerImpl::AllocateGrallocBuffer(size_t width,
         return error;
     }
 
-    std::unique_ptr<BufferContext> buffer_context(new struct BufferContext);
-
-    buffer_context->buffer_id = reinterpret_cast<uint64_t>(buffer_context.get());
-    buffer_context->type = GRALLOC;
-
-    int bufferCount = 1;
+    // one allocator transaction for the whole batch
+    uint32_t bufferCount = count;
     auto &allocator = get_allocservice();
     auto ret = allocator.allocate(descriptor, bufferCount,
                                     [&](const auto& tmpError, const auto& tmpStride,
@@ -1151,29 +1888,32 @@ int TvInputBufferManagerImpl::AllocateGrallocBuffer(size_t width,
 
                                         #if IMPORTBUFFER_CB == 1
                                             for (uint32_t i = 0; i < bufferCount; i++) {
-                                                error = importBuffer(tmpBuffers[i],
-                                                                             out_buffer);
+                                                buffer_handle_t imported = nullptr;
+                                                error = importBuffer(tmpBuffers[i], &imported);
                                                 if (error != android::NO_ERROR) {
-                                                    for (uint32_t j = 0; j < i; j++) {
-                                                        freeBuffer(*out_buffer);
-                                                        *out_buffer = nullptr;
+                                                    for (auto buffer : *out_buffers) {
+                                                        freeBuffer(buffer);
                                                     }
+                                                    out_buffers->clear();
                                                     return;
                                                 }
+                                                out_buffers->push_back(imported);
                                             }
                                         #else
                                             for (uint32_t i = 0; i < bufferCount; i++) {
-                                                *out_buffer = native_handle_clone(
+                                                native_handle_t* cloned = native_handle_clone(
                                                         tmpBuffers[i].getNativeHandle());
-                                                if (!out_buffer) {
-                                                    for (uint32_t j = 0; j < i; j++) {
-                                                        //auto buffer = const_cast<native_handle_t*>(
-                                                        //        out_buffer);
-                                                        native_handle_close(out_buffer);
-                                                        native_handle_delete(out_buffer);
-                                                        *out_buffer = nullptr;
+                                                if (!cloned) {
+                                                    for (auto buffer : *out_buffers) {
+                                                        auto abuffer = const_cast<native_handle_t*>(buffer);
+                                                        native_handle_close(abuffer);
+                                                        native_handle_delete(abuffer);
                                                     }
+                                                    out_buffers->clear();
+                                                    error = -ENOMEM;
+                                                    return;
                                                 }
+                                                out_buffers->push_back(cloned);
                                             }
                                         #endif
                                         *out_stride = tmpStride;
@@ -1182,9 +1922,23 @@ int TvInputBufferManagerImpl::AllocateGrallocBuffer(size_t width,
     if (!ret.isOk())
         return -EINVAL;
 
-    ALOGD("AllocateGrallocBuffer %p", *out_buffer);
-    buffer_context->usage = 1;
-    buffer_context_[*out_buffer] = std::move(buffer_context);
+    for (auto buffer : *out_buffers) {
+        ALOGD("AllocateGrallocBuffer %p", buffer);
+        std::shared_ptr<BufferContext> buffer_context = std::make_shared<BufferContext>();
+        buffer_context->buffer_id = reinterpret_cast<uint64_t>(buffer_context.get());
+        buffer_context->type = GRALLOC;
+        buffer_context->usage = 1;
+        buffer_context->owned = true;
+        buffer_context->alloc_usage = usage;
+        buffer_context->width = width;
+        buffer_context->height = height;
+        buffer_context->format = format;
+        buffer_context->stride = *out_stride;
+        // not registered yet, so the heap lookup misses and the mapper answers
+        buffer_context->size = GetHandleBufferSize(buffer);
+        buffer_context->fd = GetHandleFd(buffer);
+        buffer_context_.Insert(buffer, std::move(buffer_context));
+    }
 
     // make sure the kernel driver sees BC_FREE_BUFFER and closes the fds now
     android::hardware::IPCThreadState::self()->flushCommands();
@@ -1192,4 +1946,124 @@ int TvInputBufferManagerImpl::AllocateGrallocBuffer(size_t width,
     return (ret.isOk()) ? error : static_cast<status_t>(kTransactionError);
 }
 
+int TvInputBufferManagerImpl::AllocateDmaHeapBuffer(size_t width,
+                                                   size_t height,
+                                                   uint32_t format,
+                                                   uint64_t usage,
+                                                   buffer_handle_t* out_buffer,
+                                                   uint32_t* out_stride) {
+    ALOGD("AllocateDmaHeapBuffer %zu, %zu, %u, %" PRIu64, width, height, format, usage);
+
+    uint32_t stride = 0;
+    size_t size = sHeapBufferLayout(width, height, format, usage, &stride);
+    if (!size) {
+        ALOGE("AllocateDmaHeapBuffer unsupported format %u", format);
+        return -EINVAL;
+    }
+
+    int fd = sOpenHeapFd(size);
+    if (fd < 0) {
+        return -ENOMEM;
+    }
+
+    // data[0] is the dma-buf fd like in gralloc handles, so code passing
+    // handle->data[0] to rga/pq/iep keeps working
+    native_handle_t* handle = native_handle_create(1, 0);
+    if (!handle) {
+        close(fd);
+        return -ENOMEM;
+    }
+    handle->data[0] = fd;
+
+    std::shared_ptr<BufferContext> buffer_context = std::make_shared<BufferContext>();
+    buffer_context->buffer_id = reinterpret_cast<uint64_t>(buffer_context.get());
+    buffer_context->type = DMABUF_HEAP;
+    buffer_context->usage = 1;
+    buffer_context->owned = true;
+    buffer_context->alloc_usage = usage;
+    buffer_context->fd = fd;
+    buffer_context->width = width;
+    buffer_context->height = height;
+    buffer_context->format = format;
+    buffer_context->stride = stride;
+    buffer_context->size = size;
+    buffer_context->mapped = nullptr;
+
+    *out_buffer = handle;
+    *out_stride = stride;
+    buffer_context_.Insert(*out_buffer, std::move(buffer_context));
+    ALOGD("AllocateDmaHeapBuffer %p fd=%d size=%zu", *out_buffer, fd, size);
+    return 0;
+}
+
+int TvInputBufferManagerImpl::FreeDmaHeapBuffer(buffer_handle_t buffer) {
+    auto buffer_context = buffer_context_.Erase(buffer);
+    if (!buffer_context) {
+        return -EINVAL;
+    }
+    PutCpuMapping(buffer_context.get());
+
+    auto abuffer = const_cast<native_handle_t*>(buffer);
+    native_handle_close(abuffer);
+    native_handle_delete(abuffer);
+    return 0;
+}
+
+std::shared_ptr<BufferContext> TvInputBufferManagerImpl::GetHeapContext(buffer_handle_t buffer) {
+    auto buffer_context = buffer_context_.Find(buffer);
+    if (!buffer_context || buffer_context->type != DMABUF_HEAP) {
+        return nullptr;
+    }
+    return buffer_context;
+}
+
+BufferContextRegistry::BufferContextRegistry() {
+    for (auto& shard : shards_) {
+        shard.snapshot = std::make_shared<const BufferContextCache>();
+    }
+}
+
+size_t BufferContextRegistry::ShardIndex(buffer_handle_t buffer) {
+    // handles come from malloc, drop the alignment bits before folding
+    uintptr_t key = reinterpret_cast<uintptr_t>(buffer) >> 4;
+    return (key ^ (key >> 8)) & (kShardCount - 1);
+}
+
+std::shared_ptr<BufferContext> BufferContextRegistry::Find(buffer_handle_t buffer) const {
+    auto snapshot = std::atomic_load(&shards_[ShardIndex(buffer)].snapshot);
+    auto it = snapshot->find(buffer);
+    return it != snapshot->end() ? it->second : nullptr;
+}
+
+void BufferContextRegistry::Insert(buffer_handle_t buffer,
+                                   std::shared_ptr<BufferContext> context) {
+    Shard& shard = shards_[ShardIndex(buffer)];
+    android::Mutex::Autolock _l(shard.write_lock);
+    auto updated = std::make_shared<BufferContextCache>(*shard.snapshot);
+    (*updated)[buffer] = std::move(context);
+    std::atomic_store(&shard.snapshot, std::shared_ptr<const BufferContextCache>(std::move(updated)));
+}
+
+std::shared_ptr<BufferContext> BufferContextRegistry::Erase(buffer_handle_t buffer) {
+    Shard& shard = shards_[ShardIndex(buffer)];
+    android::Mutex::Autolock _l(shard.write_lock);
+    auto it = shard.snapshot->find(buffer);
+    if (it == shard.snapshot->end()) {
+        return nullptr;
+    }
+    std::shared_ptr<BufferContext> context = it->second;
+    auto updated = std::make_shared<BufferContextCache>(*shard.snapshot);
+    updated->erase(buffer);
+    std::atomic_store(&shard.snapshot, std::shared_ptr<const BufferContextCache>(std::move(updated)));
+    return context;
+}
+
+size_t BufferContextRegistry::Size() const {
+    size_t size = 0;
+    for (auto& shard : shards_) {
+        size += std::atomic_load(&shard.snapshot)->size();
+    }
+    return size;
+}
+
 }  // namespace common
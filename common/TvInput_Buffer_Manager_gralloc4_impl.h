@@ -9,9 +9,14 @@
 
 #include "TvInput_Buffer_Manager.h"
 
+#include <atomic>
+#include <list>
 #include <memory>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+#include <utils/Mutex.h>
 
 
 //#include <base/synchronization/lock.h>
@@ -44,13 +49,77 @@ using android::hardware::graphics::mapper::V4_0::IMapper;
 struct BufferContext {
     uint64_t buffer_id;
     BufferType type;
+    // Register() refcount, may be bumped from several threads.
+    std::atomic<uint64_t> usage{0};
+    // dma-buf fd, owned by the handle. Cached at allocation/registration so
+    // per-frame users don't need a mapper round-trip.
+    int fd = -1;
+    // Only filled for DMABUF_HEAP buffers, gralloc ones ask the mapper.
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t format = 0;
+    uint32_t stride = 0;
+    size_t size = 0;
+    // Persistent CPU mapping of the whole buffer, kept until it is freed.
+    std::atomic<void*> mapped{nullptr};
+    // CpuAccess bits of the currently open CPU access brackets.
+    std::atomic<uint32_t> cpu_access{0};
+    // Set for buffers created by Allocate(), which may be recycled through
+    // the pool; imported buffers are never pooled.
+    bool owned = false;
+    uint64_t alloc_usage = 0;
+    // Accounting of owned buffers while they are handed out.
+    BufferPurpose purpose = BUFFER_PURPOSE_OTHER;
+    bool charged = false;
+};
+
+struct BufferPoolKey {
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
     uint64_t usage;
+    BufferType type;
+
+    bool operator==(const BufferPoolKey& other) const {
+        return std::tie(width, height, format, usage, type) ==
+               std::tie(other.width, other.height, other.format, other.usage, other.type);
+    }
 };
 
 typedef std::unordered_map<buffer_handle_t,
-        std::unique_ptr<struct BufferContext>>
+        std::shared_ptr<struct BufferContext>>
         BufferContextCache;
 
+// Buffer contexts keyed by handle, shared by the capture, PQ, IEP, encoder
+// and binder threads. Each shard publishes an immutable snapshot of its map:
+// Find() atomically loads that snapshot and doesn't take the shard lock,
+// while Insert()/Erase() serialize on the shard lock and swap in an updated
+// copy. Mutation happens when buffers are set up or freed, not per frame.
+class BufferContextRegistry {
+public:
+    BufferContextRegistry();
+
+    // Returns the context of |buffer|, nullptr if unknown. The returned
+    // reference keeps the context alive even if it is erased meanwhile.
+    std::shared_ptr<BufferContext> Find(buffer_handle_t buffer) const;
+    void Insert(buffer_handle_t buffer, std::shared_ptr<BufferContext> context);
+    // Returns the erased context, nullptr if |buffer| was not registered.
+    std::shared_ptr<BufferContext> Erase(buffer_handle_t buffer);
+    size_t Size() const;
+
+private:
+    static const size_t kShardCount = 16;
+
+    struct Shard {
+        android::Mutex write_lock;
+        std::shared_ptr<const BufferContextCache> snapshot;
+    };
+
+    static size_t ShardIndex(buffer_handle_t buffer);
+
+    Shard shards_[kShardCount];
+};
+
 class TvInputBufferManagerImpl final : public TvInputBufferManager {
 public:
     TvInputBufferManagerImpl();
@@ -63,9 +132,22 @@ public:
                  uint64_t usage,
                  BufferType type,
                  buffer_handle_t* out_buffer,
-                 uint32_t* out_stride) final;
+                 uint32_t* out_stride,
+                 BufferPurpose purpose) final;
     int Free(buffer_handle_t buffer) final;
     int FreeLocked(buffer_handle_t buffer) final;
+    int Prefetch(size_t width,
+                 size_t height,
+                 uint32_t format,
+                 uint64_t usage,
+                 BufferType type,
+                 uint32_t count,
+                 BufferPurpose purpose) final;
+    void TrimPool() final;
+    void TrimPool(size_t width, size_t height, uint32_t format) final;
+    void DumpPoolStats() final;
+    int64_t GetMemoryHeadroom() final;
+    void DumpMemoryStats(std::string* out) final;
     int Register(buffer_handle_t buffer, buffer_handle_t* outbuffer) final;
     int Deregister(buffer_handle_t buffer) final;
     int ImportBufferLocked(buffer_handle_t& rawHandle) final;
@@ -93,12 +175,34 @@ public:
     int Unlock(buffer_handle_t buffer) final;
     int UnlockLocked(buffer_handle_t buffer) final;
     int FlushCache(buffer_handle_t buffer) final;
+    int BeginCpuAccess(buffer_handle_t buffer,
+                       uint32_t access,
+                       CacheSyncStage stage,
+                       size_t offset,
+                       size_t length) final;
+    int EndCpuAccess(buffer_handle_t buffer,
+                     uint32_t access,
+                     CacheSyncStage stage,
+                     size_t offset,
+                     size_t length) final;
+    int AcquireCpuMapping(buffer_handle_t buffer,
+                          uint32_t access,
+                          CacheSyncStage stage,
+                          size_t length,
+                          void** out_addr) final;
+    int ReleaseCpuMapping(buffer_handle_t buffer,
+                          uint32_t access,
+                          CacheSyncStage stage,
+                          size_t length) final;
+    void DumpCacheSyncStats() final;
     int GetHandleFd(buffer_handle_t buffer) final;
+    int GetPlaneFd(buffer_handle_t buffer, size_t plane) final;
     int GetHandleBufferSize(buffer_handle_t handle) final;  
     int GetBufferId(buffer_handle_t buffer) final;
     int GetWidth(buffer_handle_t handle) final;
     int GetHeight(buffer_handle_t handle) final;
     int GetHalPixelFormat(buffer_handle_t buffer) final;
+    uint64_t GetFormatModifier(buffer_handle_t buffer) final;
 
 private:
     friend class TvInputBufferManager;
@@ -109,6 +213,52 @@ private:
                               uint64_t usage,
                               buffer_handle_t* out_buffer,
                               uint32_t* out_stride);
+    int AllocateGrallocBuffers(size_t width,
+                               size_t height,
+                               uint32_t format,
+                               uint64_t usage,
+                               uint32_t count,
+                               std::vector<buffer_handle_t>* out_buffers,
+                               uint32_t* out_stride);
+    int AllocateDmaHeapBuffer(size_t width,
+                              size_t height,
+                              uint32_t format,
+                              uint64_t usage,
+                              buffer_handle_t* out_buffer,
+                              uint32_t* out_stride);
+    int FreeDmaHeapBuffer(buffer_handle_t buffer);
+
+    // Returns the context of |buffer| if it is a DMABUF_HEAP buffer.
+    std::shared_ptr<BufferContext> GetHeapContext(buffer_handle_t buffer);
+
+    // Buffer pool. Returns true when a buffer was taken from / given to it.
+    bool AcquireFromPool(const BufferPoolKey& key,
+                         buffer_handle_t* out_buffer,
+                         uint32_t* out_stride);
+    bool ReleaseToPool(buffer_handle_t buffer);
+    // Frees |buffer| for real and drops its context and charge.
+    int ReleaseBuffer(buffer_handle_t buffer);
+    // Releases the pooled buffers no Prefetch() charged to a purpose.
+    void TrimIdlePool();
+
+    // Memory accounting. ReserveBudget books |size| bytes for |purpose| before
+    // an allocation and fails with -EDQUOT when they don't fit the budget even
+    // after dropping the idle pool, which it trims outside budget_lock_;
+    // ChargeBuffer then settles the reservation with the real size of |buffer|.
+    // Prefetched buffers stay charged while pooled and are not counted in
+    // pool_retained_bytes_.
+    int ReserveBudget(size_t size, BufferPurpose purpose);
+    int ChargeBuffer(buffer_handle_t buffer, BufferPurpose purpose, size_t reserved);
+    void UnchargeBuffer(BufferContext* buffer_context);
+    size_t GetLiveBytes();
+
+    // Returns the persistent mapping of |buffer_context|, creating it if
+    // needed. nullptr if the buffer can't be mapped.
+    void* GetCpuMapping(BufferContext* buffer_context);
+    void PutCpuMapping(BufferContext* buffer_context);
+
+    // Issues DMA_BUF_IOCTL_SYNC with |flags| on the fd backing |buffer|.
+    int SyncBuffer(buffer_handle_t buffer, uint64_t flags, size_t offset, size_t length);
 
 	//uint64_t get_internal_format_from_fourcc(uint32_t fourcc, uint64_t modifier);
 	status_t validateBufferDescriptorInfo(
@@ -127,15 +277,37 @@ private:
                                       buffer_handle_t* outBufferHandle) const;
 	status_t freeBuffer(buffer_handle_t bufferHandle) const;
 
-    // Lock to guard access member variables.
-    //base::Lock lock_;
+    // All the context of the registered buffers, safe to use from any thread.
+    BufferContextRegistry buffer_context_;
+
+    // Serializes Register()/Deregister() so the lookup, import and insert
+    // (or the last unref and erase) of one handle can't interleave.
+    android::Mutex register_lock_;
+
+    // Makes the budget check and the reservation of ReserveBudget() atomic.
+    android::Mutex budget_lock_;
+
+    // ** Start of pool_lock_ scope **
+
+    // Free buffers kept for reuse, most recently released first.
+    android::Mutex pool_lock_;
+    std::list<std::pair<BufferPoolKey, buffer_handle_t>> buffer_pool_;
+    size_t pool_retained_bytes_ = 0;
+    uint32_t pool_hits_ = 0;
+    uint32_t pool_misses_ = 0;
+    // Buffers allocated ahead by Prefetch(), the Allocate()s they serve are hits.
+    uint32_t pool_prefetched_ = 0;
 
-    // ** Start of lock_ scope **
+    // ** End of pool_lock_ scope **
 
-    // A cache which stores all the context of the registered buffers.
-    BufferContextCache buffer_context_;
+    // Cache maintenance counters per CacheSyncStage.
+    std::atomic<uint32_t> sync_begin_count_[CACHE_SYNC_STAGE_MAX] = {};
+    std::atomic<uint32_t> sync_end_count_[CACHE_SYNC_STAGE_MAX] = {};
+    std::atomic<uint32_t> flush_skipped_count_{0};
+    std::atomic<uint32_t> cpu_mapping_count_{0};
 
-    // ** End of lock_ scope **
+    // Bytes of owned buffers currently handed out, per BufferPurpose.
+    std::atomic<int64_t> purpose_bytes_[BUFFER_PURPOSE_MAX] = {};
 
     //DISALLOW_COPY_AND_ASSIGN(TvInputBufferManagerImpl);
 };
@@ -86,6 +86,41 @@ static const int64_t STREAM_BUFFER_GRALLOC_USAGE = (
 #define TV_INPUT_PQ_LUMA "persist.vendor.rkpq.luma"
 #define TV_INPUT_HDMIIN "vendor.rk.hdmiin"
 #define TV_INPUT_RESOLUTION_MAIN "persist.vendor.resolution.main"
+// bumped after TV_INPUT_RESOLUTION_MAIN changes so hwcomposer applies it
+#define TV_INPUT_DISPLAY_TIMELINE "vendor.display.timeline"
+#define TV_INPUT_AUTO_FRAME_RATE "persist.vendor.tvinput.autofps"
+#define TV_INPUT_IOMMU_BUFFER "persist.vendor.tvinput.iommu"
+// ms each stop() join/release step may take before it is reported
+#define TV_INPUT_STOP_DEADLINE_MS "persist.vendor.tvinput.stopdeadlinems"
+// 1 brings drm, rga, rkpq and mpp up in the background at device open
+#define TV_INPUT_PREWARM "persist.vendor.tvinput.prewarm"
+// dma heap name (e.g. system-dma32) for hal-internal buffers, empty uses gralloc
+#define TV_INPUT_DMA_HEAP "persist.vendor.tvinput.dmaheap"
+// MB of freed buffers kept for reuse, 0 disables the pool
+#define TV_INPUT_POOL_BUDGET "persist.vendor.tvinput.poolbudget"
+// MB the HAL may hold in its own buffers (pool included), 0 for no limit
+#define TV_INPUT_MEM_BUDGET "persist.vendor.tvinput.membudget"
+// ms pq/iep buffers are kept after pq is switched off, the pool keeps them
+// as long again before it is trimmed; <= 0 keeps them until stop
+#define TV_INPUT_PQ_IDLE_MS "persist.vendor.tvinput.pqidlems"
+// number of recently streamed timings whose capture and pq buffer sets are
+// kept in the pool, the current one included; 0 disables pre-allocation
+#define TV_INPUT_STANDBY_SETS "persist.vendor.tvinput.standbysets"
+// ms v4l2 events are collected before one consolidated change is reported,
+// <= 0 reports every event as it arrives
+#define TV_INPUT_EVENT_SETTLE_MS "persist.vendor.tvinput.settlems"
+// 1 restarts capture in place on a source change instead of reporting
+// new stream configurations to the framework
+#define TV_INPUT_FAST_SWITCH "persist.vendor.tvinput.fastswitch"
+// 1 runs stream start/stop on a control thread, open/close_stream return
+// at once and report "streamready"/"streamerror" to the app
+#define TV_INPUT_ASYNC_CONTROL "persist.vendor.tvinput.asynccontrol"
+// written by the "meminfo" private command
+#define TV_INPUT_MEM_INFO "vendor.tvinput.meminfo"
+// owners of each sideband capture buffer, filled by the "frameinfo" command
+#define TV_INPUT_FRAME_INFO "vendor.tvinput.frameinfo"
+// per stage frame count and avg/max cost, filled by the "pipeinfo" command
+#define TV_INPUT_PIPE_INFO "vendor.tvinput.pipeinfo"
 #define DEBUG_LEVEL_PROPNAME "vendor.tvinput.level"
 #define DEBUG_HDMIIN_LEVEL "vendor.hdmiin.debug.level"
 #define DEBUG_HDMIIN_DUMP "vendor.hdmiin.debug.dump"
@@ -36,6 +36,10 @@
 using namespace android;
 
 #define _ALIGN(x, a) (((x) + (a)-1) & ~((a)-1))
+// how long stop() waits for the encode loop before it complains
+#define STOP_WAIT_WARN_MS 100
+// and before it gives up on it
+#define STOP_WAIT_GIVEUP_MS 1000
 
 uint32_t enc_debug = 0;
 RKMppEncApi::EncCfgInfo_t encInfo;
@@ -118,6 +122,14 @@ bool MppEncodeServer::setNotifyCallback(NotifyCallback callback,
     return true;
 }
 
+void MppEncodeServer::adoptContext(MppCtx ctx, MppApi *mpi) {
+    if (mAdoptedCtx != nullptr) {
+        mpp_destroy(mAdoptedCtx);
+    }
+    mAdoptedCtx = ctx;
+    mAdoptedMpi = mpi;
+}
+
 // TODO: Expand the parameters
 bool MppEncodeServer::initOther(MetaInfo *meta) {
     encInfo.width = meta->width;
@@ -134,6 +146,11 @@ bool MppEncodeServer::initOther(MetaInfo *meta) {
     encInfo.profile = H264_PROFILE_BASELINE;
     encInfo.level = AVC_LEVEL4_1;
     encInfo.rotation = MPP_ENC_ROT_0;
+    // the encoder destroys it with its own context, even when init fails
+    encInfo.prewarmedCtx = mAdoptedCtx;
+    encInfo.prewarmedMpi = mAdoptedMpi;
+    mAdoptedCtx = nullptr;
+    mAdoptedMpi = nullptr;
     if (!mEncoder->init(&encInfo)) {
         ALOGE("Failed to init mEncoder");
         return false;
@@ -150,7 +167,11 @@ void MppEncodeServer::run() {
         processQueue();
         ALOGD("run()");
     }
-    mThreadExited.exchange(true);
+    {
+        std::lock_guard<std::mutex> lock(mExitLock);
+        mThreadExited.store(true);
+    }
+    mExitCond.notify_all();
     ALOGD("exit");
 }
 
@@ -189,18 +210,23 @@ bool MppEncodeServer::stop() {
     {
         bool result = true;
         mThreadEnabled.exchange(false);
-        // clear flag that tells thread to loop
-        while (true) {
-            if(mThreadExited.load()){
-                ALOGD("zj add file: %s func %s line %d \n",__FILE__,__FUNCTION__,__LINE__);
-                result = mOutFrameThread.stop();
-                break;
-            }else{
-                ALOGD("zj add file: %s func %s line %d \n",__FILE__,__FUNCTION__,__LINE__);
-                usleep(5000);
-                continue;
+        // clear flag that tells thread to loop, then sleep until it noticed
+        {
+            std::unique_lock<std::mutex> lock(mExitLock);
+            auto exited = [this]() { return mThreadExited.load(); };
+            if (!mExitCond.wait_for(lock, std::chrono::milliseconds(STOP_WAIT_WARN_MS), exited)) {
+                ALOGW("encode loop still running after %dms", STOP_WAIT_WARN_MS);
+                if (!mExitCond.wait_for(lock, std::chrono::milliseconds(STOP_WAIT_GIVEUP_MS), exited)) {
+                    // the loop still uses the encoder, nothing here may be freed
+                    ALOGE("encode loop stuck after %dms, giving up on it",
+                        STOP_WAIT_WARN_MS + STOP_WAIT_GIVEUP_MS);
+                    mStuck = true;
+                    return false;
+                }
             }
         }
+        result = mOutFrameThread.stop();
+        (void)result;
 
         Mutexed<ExecState>::Locked state(mExecState);
         if (state->mState != RUNNING) {
@@ -263,6 +289,10 @@ MppEncodeServer::~MppEncodeServer() {
         fclose(mOutputFile);
         mOutputFile = nullptr;
     }
+    if (mAdoptedCtx != nullptr) {
+        mpp_destroy(mAdoptedCtx);
+        mAdoptedCtx = nullptr;
+    }
 
     mLooper->unregisterHandler(mHandler->id());
     (void)mLooper->stop();
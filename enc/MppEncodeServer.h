@@ -27,6 +27,8 @@
 #include <media/stagefright/foundation/Mutexed.h>
 
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "OutFrameThread.h"
 #include "RKMppEncApi.h"
@@ -62,8 +64,13 @@ class MppEncodeServer : public std::enable_shared_from_this<MppEncodeServer>,
 
     bool init(MetaInfo* meta);
     bool setNotifyCallback(NotifyCallback callback, void* userdata);
+    // hands an inited avc context to the next init(), the server owns it from here
+    void adoptContext(MppCtx ctx, MppApi* mpi);
     bool start();
+    // false with stuck() set when the encode loop didn't exit in time
     bool stop();
+    // stop() gave up on the encode loop, the server has to be leaked
+    bool stuck() const { return mStuck; }
     bool reset();
     bool release();
 
@@ -79,7 +86,11 @@ class MppEncodeServer : public std::enable_shared_from_this<MppEncodeServer>,
     // This is used by one thread to tell another thread to exit. So it must be
     // atomic.
     std::atomic<bool> mThreadEnabled{false};
-    std::atomic<bool> mThreadExited{false};
+    // true while no encode loop runs, stop() waits on mExitCond for it
+    std::atomic<bool> mThreadExited{true};
+    std::mutex mExitLock;
+    std::condition_variable mExitCond;
+    std::atomic<bool> mStuck{false};
     // encode getoutPacket thread
     OutFrameThread mOutFrameThread;
 
@@ -122,6 +133,9 @@ class MppEncodeServer : public std::enable_shared_from_this<MppEncodeServer>,
     sp<WorkHandler> mHandler;
 
     bool initOther(MetaInfo* meta);
+
+    MppCtx mAdoptedCtx = nullptr;
+    MppApi* mAdoptedMpi = nullptr;
 };
 
 #endif  // __MPPENCODESERVER_H__
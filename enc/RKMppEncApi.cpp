@@ -53,6 +53,7 @@ RKMppEncApi::~RKMppEncApi() {
 bool RKMppEncApi::init(EncCfgInfo* cfg) {
     Trace();
     bool ret = true;
+    bool prewarmed = false;
     int err = 0;
     MppPollType timeout = MPP_POLL_NON_BLOCK;
     //MppPollType timeoutOutput = MPP_POLL_BLOCK;
@@ -84,12 +85,26 @@ bool RKMppEncApi::init(EncCfgInfo* cfg) {
      * input, since mpp can't process rgba input properly. in addition to this,
      * alloc buffer within 4G in view of rga efficiency.
      */
-    // create mpp and init mpp
-    err = mpp_create(&mMppCtx, &mMppMpi);
-    if (err) {
-        ALOGE("failed to mpp_create, ret %d", err);
-        ret = false;
-        goto error;
+    // create mpp and init mpp, unless a prewarmed context is handed over
+    prewarmed = cfg->prewarmedCtx != nullptr && mCodingType == MPP_VIDEO_CodingAVC;
+    if (prewarmed) {
+        mMppCtx = cfg->prewarmedCtx;
+        mMppMpi = cfg->prewarmedMpi;
+        cfg->prewarmedCtx = nullptr;
+        cfg->prewarmedMpi = nullptr;
+    } else {
+        if (cfg->prewarmedCtx != nullptr) {
+            // warmed up for avc, no use to another codec; we own it now
+            mpp_destroy(cfg->prewarmedCtx);
+            cfg->prewarmedCtx = nullptr;
+            cfg->prewarmedMpi = nullptr;
+        }
+        err = mpp_create(&mMppCtx, &mMppMpi);
+        if (err) {
+            ALOGE("failed to mpp_create, ret %d", err);
+            ret = false;
+            goto error;
+        }
     }
     err = mMppMpi->control(mMppCtx, MPP_SET_INPUT_TIMEOUT, &timeout);
 
@@ -100,11 +115,13 @@ bool RKMppEncApi::init(EncCfgInfo* cfg) {
         goto error;
     }
 
-    err = mpp_init(mMppCtx, MPP_CTX_ENC, mCodingType);
-    if (err) {
-        ALOGE("failed to mpp_init, ret %d", err);
-        ret = false;
-        goto error;
+    if (!prewarmed) {
+        err = mpp_init(mMppCtx, MPP_CTX_ENC, mCodingType);
+        if (err) {
+            ALOGE("failed to mpp_init, ret %d", err);
+            ret = false;
+            goto error;
+        }
     }
 
     ret = setupEncCfg();
@@ -104,6 +104,9 @@ public:
         int32_t profile;
         int32_t level;
         int32_t rotation;
+        /* avc context created and inited ahead of time, init() takes it over */
+        MppCtx prewarmedCtx;
+        MppApi *prewarmedMpi;
     } EncCfgInfo_t;
 
     typedef struct {
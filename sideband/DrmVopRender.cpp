@@ -3,8 +3,10 @@
 #include "DrmVopRender.h"
 #include "log/log.h"
 #include <unistd.h>
+#include <stdlib.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <cutils/properties.h>
 
 #include "common/TvInput_Buffer_Manager.h"
@@ -87,20 +89,22 @@ void DrmVopRender::deinitialize()
     ALOGE("deinitialize in");
     if(!mInitialized) return;
     Mutex::Autolock autoLock(mVopPlaneLock);
+    restoreDisplayModeLocked();
     for (int i = 0; i < OUTPUT_MAX; i++) {
         resetOutput(i);
     }
 
-    if (mDrmFd) {
-        close(mDrmFd);
-        mDrmFd = 0;
-    }
-
     for (const auto &fbidMap : mFbidMap) {
         int fbid = fbidMap.second;
         if (drmModeRmFB(mDrmFd, fbid))
             ALOGE("Failed to rm fb");
     }
+    mFbidMap.clear();
+
+    if (mDrmFd) {
+        close(mDrmFd);
+        mDrmFd = 0;
+    }
 
     mInitialized = false;
 }
@@ -116,6 +120,27 @@ void DrmVopRender::DestoryFB() {
     mFbidMap.clear();
 }
 
+void DrmVopRender::releaseFbid(buffer_handle_t handle) {
+    Mutex::Autolock autoLock(mVopPlaneLock);
+    if (!handle || mFbidMap.empty()) {
+        return;
+    }
+    common::TvInputBufferManager* tvBufferMgr = common::TvInputBufferManager::GetInstance();
+    int fd = (int)tvBufferMgr->GetHandleFd(handle);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return;
+    }
+    std::map<ino_t, int>::iterator it = mFbidMap.find(st.st_ino);
+    if (it == mFbidMap.end()) {
+        return;
+    }
+    ALOGV("%s fbid=%d", __FUNCTION__, it->second);
+    if (drmModeRmFB(mDrmFd, it->second))
+        ALOGE("Failed to rm fb %d", it->second);
+    mFbidMap.erase(it);
+}
+
 bool DrmVopRender::detect() {
     Mutex::Autolock autoLock(mVopPlaneLock);
     detect(HWC_DISPLAY_PRIMARY);
@@ -511,7 +536,12 @@ int DrmVopRender::getFbid(buffer_handle_t handle) {
     int src_stride = 0;
 
     fd = (int)tvBufferMgr->GetHandleFd(handle);
-    std::map<int, int>::iterator it = mFbidMap.find(fd);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        ALOGE("%s can't stat fd %d: %s", __FUNCTION__, fd, strerror(errno));
+        return -1;
+    }
+    std::map<ino_t, int>::iterator it = mFbidMap.find(st.st_ino);
     int fbid = 0;
     if (it == mFbidMap.end()) {
         memset(&bo, 0, sizeof(hwc_drm_bo_t));
@@ -567,7 +597,9 @@ int DrmVopRender::getFbid(buffer_handle_t handle) {
                      bo.pitches, bo.offsets, &bo.fb_id, 0);
         fbid = bo.fb_id;
         ALOGD("drmModeAddFB2 ret = %s fbid=%d", strerror(ret), fbid);
-        mFbidMap.insert(std::make_pair(fd, fbid));
+        if (fbid > 0) {
+            mFbidMap.insert(std::make_pair(st.st_ino, fbid));
+        }
     } else {
         fbid = it->second;
     }
@@ -746,6 +778,131 @@ bool DrmVopRender::SetDrmPlane(int device, int32_t width, int32_t height, buffer
     return true;
 }
 
+bool DrmVopRender::MatchSourceFrameRate(int device, int fps)
+{
+    Mutex::Autolock autoLock(mVopPlaneLock);
+    int outputIndex = getOutputIndex(device);
+    if (!mInitialized || outputIndex < 0 || fps <= 0) {
+        return false;
+    }
+    DrmOutput *output = &mOutputs[outputIndex];
+    for (int i=0; i<output->mDrmModeInfos.size(); i++) {
+        DrmModeInfo_t drmModeInfo = output->mDrmModeInfos[i];
+        if (!drmModeInfo.connector || !drmModeInfo.crtc || !drmModeInfo.crtc->mode_valid) {
+            continue;
+        }
+        // the crtc mode read at detect is stale once hwc switched, and a
+        // second switch should start from what the user had, not the first match
+        drmModeModeInfo curMode = mModeSwitched ? mOriginalMode : drmModeInfo.crtc->mode;
+        int bestIndex = -1;
+        int bestDiff = 0;
+        for (int j = 0; j < drmModeInfo.connector->count_modes; j++) {
+            drmModeModeInfo mode = drmModeInfo.connector->modes[j];
+            if (mode.hdisplay != curMode.hdisplay || mode.vdisplay != curMode.vdisplay
+                    || (mode.flags & DRM_MODE_FLAG_INTERLACE) != (curMode.flags & DRM_MODE_FLAG_INTERLACE)) {
+                continue;
+            }
+            // allow 1Hz of slack so that 59/60 and 23/24 fractional rates match
+            bool isMultiple = false;
+            for (int k = 1; k * fps <= (int)mode.vrefresh + 1; k++) {
+                if (abs((int)mode.vrefresh - k * fps) <= 1) {
+                    isMultiple = true;
+                    break;
+                }
+            }
+            if (!isMultiple) {
+                continue;
+            }
+            int diff = abs((int)mode.vrefresh - (int)curMode.vrefresh);
+            if (bestIndex < 0 || diff < bestDiff) {
+                bestIndex = j;
+                bestDiff = diff;
+            }
+        }
+        if (bestIndex < 0) {
+            ALOGD("%s no %dx%d mode matches source %d fps", __FUNCTION__,
+                curMode.hdisplay, curMode.vdisplay, fps);
+            return false;
+        }
+        drmModeModeInfo newMode = drmModeInfo.connector->modes[bestIndex];
+        if (newMode.vrefresh == curMode.vrefresh) {
+            ALOGD("%s original %dHz matches source %d fps", __FUNCTION__, curMode.vrefresh, fps);
+            return restoreDisplayModeLocked();
+        }
+
+        // hwcomposer is drm master and owns the mode, hand it the timing
+        // the way the display settings do instead of a modeset from here
+        char resolution[PROPERTY_VALUE_MAX] = {0};
+        formatDisplayMode(newMode, resolution, sizeof(resolution));
+        if (!mModeSwitched) {
+            property_get(TV_INPUT_RESOLUTION_MAIN, mOriginalResolution, "");
+            if (mOriginalResolution[0] == '\0') {
+                // nothing set yet, hand hwc back the timing it runs now
+                formatDisplayMode(curMode, mOriginalResolution, sizeof(mOriginalResolution));
+            }
+            mOriginalMode = curMode;
+        }
+        if (!requestDisplayModeLocked(resolution)) {
+            return false;
+        }
+        ALOGD("%s ask hwc for %s@%d instead of %s@%d for source %d fps", __FUNCTION__,
+            newMode.name, newMode.vrefresh, curMode.name, curMode.vrefresh, fps);
+        mModeSwitched = true;
+        return true;
+    }
+    return false;
+}
+
+bool DrmVopRender::RestoreDisplayMode(int device)
+{
+    Mutex::Autolock autoLock(mVopPlaneLock);
+    if (getOutputIndex(device) < 0) {
+        return false;
+    }
+    return restoreDisplayModeLocked();
+}
+
+bool DrmVopRender::restoreDisplayModeLocked()
+{
+    if (!mModeSwitched) {
+        return true;
+    }
+    mModeSwitched = false;
+    if (!requestDisplayModeLocked(mOriginalResolution)) {
+        return false;
+    }
+    ALOGD("%s restore %s", __FUNCTION__, mOriginalResolution);
+    return true;
+}
+
+// static
+void DrmVopRender::formatDisplayMode(const drmModeModeInfo& mode, char* resolution, size_t size)
+{
+    float vrefresh = mode.clock * 1000.0f / (mode.htotal * mode.vtotal);
+    snprintf(resolution, size, "%dx%d@%.2f-%d-%d-%d-%d-%d-%d-%x-%d",
+        mode.hdisplay, mode.vdisplay, vrefresh,
+        mode.hsync_start, mode.hsync_end, mode.htotal,
+        mode.vsync_start, mode.vsync_end, mode.vtotal,
+        mode.flags, mode.clock);
+}
+
+bool DrmVopRender::requestDisplayModeLocked(const char* resolution)
+{
+    if (property_set(TV_INPUT_RESOLUTION_MAIN, resolution) != 0) {
+        ALOGE("%s set %s=%s failed", __FUNCTION__, TV_INPUT_RESOLUTION_MAIN, resolution);
+        return false;
+    }
+    // hwcomposer re-reads the display properties once the timeline moves
+    int timeline = property_get_int32(TV_INPUT_DISPLAY_TIMELINE, 0);
+    char value[PROPERTY_VALUE_MAX] = {0};
+    snprintf(value, sizeof(value), "%d", timeline + 1);
+    if (property_set(TV_INPUT_DISPLAY_TIMELINE, value) != 0) {
+        ALOGE("%s set %s=%s failed", __FUNCTION__, TV_INPUT_DISPLAY_TIMELINE, value);
+        return false;
+    }
+    return true;
+}
+
 bool DrmVopRender::ClearDrmPlaneContent(int device, int32_t width, int32_t height)
 {
     Mutex::Autolock autoLock(mVopPlaneLock);
@@ -19,8 +19,10 @@
 #define __DRM_VOP_RENDER_H__
 
 #include <cutils/native_handle.h>
+#include <cutils/properties.h>
 #include <hardware/hwcomposer_defs.h>
 #include <map>
+#include <sys/types.h>
 #include <vector>
 #include <utils/threads.h>
 
@@ -90,21 +92,30 @@ public:
     bool detect(int device);
     void DestoryFB();
     int getFbid(buffer_handle_t handle);
+    // drop the framebuffer of a buffer about to be freed
+    void releaseFbid(buffer_handle_t handle);
     int getFbLength(buffer_handle_t handle);
 
     uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
 
     bool SetDrmPlane(int device, int32_t width, int32_t height, buffer_handle_t handle, int displayRatio);
     bool ClearDrmPlaneContent(int device, int32_t width, int32_t height);
+    // ask hwcomposer for a mode whose refresh is an integer multiple of fps
+    bool MatchSourceFrameRate(int device, int fps);
+    bool RestoreDisplayMode(int device);
     void setDebugLevel(int debugLevel);
 private:
     void resetOutput(int index);
+    bool restoreDisplayModeLocked();
+    bool requestDisplayModeLocked(const char* resolution);
+    static void formatDisplayMode(const drmModeModeInfo& mode, char* resolution, size_t size);
     bool FindSidebandPlane(int device);
     uint32_t getDrmEncoder(int device);
 
     // map device type to output index, return -1 if not mapped
     inline int getOutputIndex(int device);
-    std::map<int, int> mFbidMap;
+    // keyed on the dma-buf inode, fd numbers are recycled once a buffer is freed
+    std::map<ino_t, int> mFbidMap;
     bool needRedetect();
 private:
     // DRM object index
@@ -156,6 +167,12 @@ private:
     std::vector<DisplayInfo_t> mDisplayInfos;
     bool mEnableSkipFrame = false;
     nsecs_t mSkipFrameStartTime = 0;
+
+    // hwcomposer resolution and mode saved before the first frame rate switch,
+    // later switches match against the mode, stop restores the resolution
+    bool mModeSwitched = false;
+    char mOriginalResolution[PROPERTY_VALUE_MAX] = {0};
+    drmModeModeInfo mOriginalMode;
     int mDrmFd;
    // Mutex mLock;
     const gralloc_module_t *gralloc_;
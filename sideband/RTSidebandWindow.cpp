@@ -145,7 +145,8 @@ status_t RTSidebandWindow::allocateBuffer(buffer_handle_t *buffer) {
                         mSidebandInfo.usage,
                         common::GRALLOC,
                         &temp_buffer,
-                        &stride);
+                        &stride,
+                        common::BUFFER_PURPOSE_CAPTURE);
     if (!temp_buffer) {
         DEBUG_PRINT(3, "RTSidebandWindow::allocateBuffer mBuffMgr->Allocate failed !!!");
     } else {
@@ -157,7 +158,7 @@ status_t RTSidebandWindow::allocateBuffer(buffer_handle_t *buffer) {
 }
 
 status_t RTSidebandWindow::allocateSidebandHandle(buffer_handle_t *handle,
-        int width, int32_t height, int32_t format, uint64_t usage) {
+        int width, int32_t height, int32_t format, uint64_t usage, common::BufferPurpose purpose) {
     buffer_handle_t temp_buffer = NULL;
     uint32_t stride = 0;
     int ret = -1;
@@ -168,7 +169,8 @@ status_t RTSidebandWindow::allocateSidebandHandle(buffer_handle_t *handle,
                         -1 == usage?0:usage,
                         common::GRALLOC,
                         &temp_buffer,
-                        &stride);
+                        &stride,
+                        purpose);
     if (!temp_buffer) {
         DEBUG_PRINT(3, "RTSidebandWindow::allocateSidebandHandle mBuffMgr->Allocate failed !!!");
     } else {
@@ -178,10 +180,100 @@ status_t RTSidebandWindow::allocateSidebandHandle(buffer_handle_t *handle,
     return ret;
 }
 
+status_t RTSidebandWindow::prefetchBuffer(int count) {
+    return mBuffMgr->Prefetch(mSidebandInfo.width,
+                        mSidebandInfo.height,
+                        mSidebandInfo.format,
+                        mSidebandInfo.usage,
+                        common::GRALLOC,
+                        count,
+                        common::BUFFER_PURPOSE_CAPTURE);
+}
+
+status_t RTSidebandWindow::prefetchBuffer(int32_t width, int32_t height, int32_t format, int count) {
+    return mBuffMgr->Prefetch(width,
+                        height,
+                        format,
+                        mSidebandInfo.usage,
+                        common::GRALLOC,
+                        count,
+                        common::BUFFER_PURPOSE_CAPTURE);
+}
+
+status_t RTSidebandWindow::prefetchInternalHandle(int32_t width, int32_t height, int32_t format,
+        uint64_t usage, int count, common::BufferPurpose purpose) {
+    char heap[PROPERTY_VALUE_MAX] = {0};
+    property_get(TV_INPUT_DMA_HEAP, heap, "");
+    return mBuffMgr->Prefetch(-1 == width?mSidebandInfo.width:width,
+                        -1 == height?mSidebandInfo.height:height,
+                        -1 == format?mSidebandInfo.format:format,
+                        usage,
+                        heap[0] != '\0' ? common::DMABUF_HEAP : common::GRALLOC,
+                        count,
+                        purpose);
+}
+
+void RTSidebandWindow::dumpBufferPoolStats() {
+    mBuffMgr->DumpPoolStats();
+}
+
+void RTSidebandWindow::trimBufferPool() {
+    mBuffMgr->TrimPool();
+}
+
+void RTSidebandWindow::trimBufferPool(int32_t width, int32_t height, int32_t format) {
+    mBuffMgr->TrimPool(width, height, format);
+}
+
+void RTSidebandWindow::dumpCacheSyncStats() {
+    mBuffMgr->DumpCacheSyncStats();
+}
+
+int64_t RTSidebandWindow::getMemoryHeadroom() {
+    return mBuffMgr->GetMemoryHeadroom();
+}
+
+void RTSidebandWindow::dumpMemoryStats(std::string* out) {
+    mBuffMgr->DumpMemoryStats(out);
+}
+
+status_t RTSidebandWindow::allocateInternalHandle(buffer_handle_t *handle,
+        int32_t width, int32_t height, int32_t format, uint64_t usage,
+        common::BufferPurpose purpose) {
+    char heap[PROPERTY_VALUE_MAX] = {0};
+    property_get(TV_INPUT_DMA_HEAP, heap, "");
+    if (heap[0] != '\0') {
+        buffer_handle_t temp_buffer = NULL;
+        uint32_t stride = 0;
+        int ret = mBuffMgr->Allocate(-1 == width?mSidebandInfo.width:width,
+                            -1 == height?mSidebandInfo.height:height,
+                            -1 == format?mSidebandInfo.format:format,
+                            usage,
+                            common::DMABUF_HEAP,
+                            &temp_buffer,
+                            &stride,
+                            purpose);
+        if (ret == 0 && temp_buffer) {
+            *handle = temp_buffer;
+            return 0;
+        }
+        if (ret == -EDQUOT) {
+            // over budget, gralloc would only take the same memory
+            DEBUG_PRINT(3, "%s over the memory budget", __FUNCTION__);
+            return ret;
+        }
+        DEBUG_PRINT(3, "%s dma heap %s failed, fall back to gralloc", __FUNCTION__, heap);
+    }
+    return allocateSidebandHandle(handle, width, height, format, usage, purpose);
+}
+
 status_t RTSidebandWindow::freeBuffer(buffer_handle_t *buffer, int type) {
     DEBUG_PRINT(3, "%s in type = %d", __FUNCTION__, type);
     // android::Mutex::Autolock _l(mLock);
     // type: 1 mean no register
+    if (*buffer && mVopRender) {
+        mVopRender->releaseFbid(*buffer);
+    }
     if (type == 0) {
         if (*buffer) {
             mBuffMgr->Free(*buffer);
@@ -329,6 +421,20 @@ status_t RTSidebandWindow::clearVopArea() {
     return 0;
 }
 
+status_t RTSidebandWindow::matchDisplayFrameRate(int fps) {
+    if (!mVopRender) {
+        return -1;
+    }
+    return mVopRender->MatchSourceFrameRate(0, fps) ? 0 : -1;
+}
+
+status_t RTSidebandWindow::restoreDisplayMode() {
+    if (!mVopRender) {
+        return -1;
+    }
+    return mVopRender->RestoreDisplayMode(0) ? 0 : -1;
+}
+
 status_t RTSidebandWindow::handleDequeueRequest(Message &msg) {
     (void)msg;
     mRenderingQueue.erase(mRenderingQueue.begin());
@@ -362,6 +468,30 @@ int RTSidebandWindow::getBufferLength(buffer_handle_t buffer) {
     return mBuffMgr->GetHandleBufferSize(buffer);
 }
 
+int RTSidebandWindow::getBufferPlaneFd(buffer_handle_t buffer, int plane) {
+    if (!buffer) {
+        DEBUG_PRINT(3, "%s param buffer is NULL.", __FUNCTION__);
+        return -1;
+    }
+    return mBuffMgr->GetPlaneFd(buffer, plane);
+}
+
+int RTSidebandWindow::getBufferFormat(buffer_handle_t buffer) {
+    if (!buffer) {
+        DEBUG_PRINT(3, "%s param buffer is NULL.", __FUNCTION__);
+        return -1;
+    }
+    return (int)mBuffMgr->GetHalPixelFormat(buffer);
+}
+
+int RTSidebandWindow::getBufferStride(buffer_handle_t buffer, int plane) {
+    if (!buffer) {
+        DEBUG_PRINT(3, "%s param buffer is NULL.", __FUNCTION__);
+        return -1;
+    }
+    return (int)mBuffMgr->GetPlaneStride(buffer, plane);
+}
+
 int RTSidebandWindow::importHidlHandleBufferLocked(buffer_handle_t& rawHandle) {
     ALOGD("%s rawBuffer :%p", __FUNCTION__, rawHandle);
     if (rawHandle) {
@@ -374,26 +504,56 @@ int RTSidebandWindow::importHidlHandleBufferLocked(buffer_handle_t& rawHandle) {
     return -1;
 }
 
+void* RTSidebandWindow::beginCpuAccess(buffer_handle_t handle, uint32_t access,
+        common::CacheSyncStage stage, bool imported, bool* persistent, size_t length) {
+    void* addr = NULL;
+    if (!mBuffMgr->AcquireCpuMapping(handle, access, stage, length, &addr)) {
+        *persistent = true;
+        return addr;
+    }
+    *persistent = false;
+    int lockMode = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_CAMERA_MASK;
+    if (imported) {
+        mBuffMgr->LockLocked(handle, lockMode, 0, 0, mBuffMgr->GetWidth(handle), mBuffMgr->GetHeight(handle), &addr);
+    } else {
+        mBuffMgr->Lock(handle, lockMode, 0, 0, mBuffMgr->GetWidth(handle), mBuffMgr->GetHeight(handle), &addr);
+    }
+    return addr;
+}
+
+void RTSidebandWindow::endCpuAccess(buffer_handle_t handle, uint32_t access,
+        common::CacheSyncStage stage, bool imported, bool persistent, size_t length) {
+    if (persistent) {
+        mBuffMgr->ReleaseCpuMapping(handle, access, stage, length);
+        return;
+    }
+    if (imported) {
+        mBuffMgr->UnlockLocked(handle);
+    } else {
+        mBuffMgr->Unlock(handle);
+    }
+}
+
 int RTSidebandWindow::buffDataTransfer(buffer_handle_t srcHandle, buffer_handle_t dstHandle) {
     ALOGD("%s in srcHandle=%p, dstHandle=%p", __FUNCTION__, srcHandle, dstHandle);
     std::string file1 = "/data/system/tv_input_src_dump.yuv";
     std::string file2 = "/data/system/tv_input_result_dump.yuv";
     if (srcHandle && dstHandle) {
         void *tmpSrcPtr = NULL, *tmpDstPtr = NULL;
+        bool srcMapped = false, dstMapped = false;
         int srcDatasize = -1;
-            int lockMode = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_CAMERA_MASK;
-            mBuffMgr->Lock(srcHandle, lockMode, 0, 0, mBuffMgr->GetWidth(srcHandle), mBuffMgr->GetHeight(srcHandle), &tmpSrcPtr);
+            tmpSrcPtr = beginCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_DUMP, false, &srcMapped);
             for (int i = 0; i < mBuffMgr->GetNumPlanes(srcHandle); i++) {
                 srcDatasize += mBuffMgr->GetPlaneSize(srcHandle, i);
             }
              writeData2File(file1.c_str(), tmpSrcPtr, srcDatasize);
             ALOGD("data tmpSrcPtr ptr = %p, srcDatasize=%d", tmpSrcPtr, srcDatasize);
-            mBuffMgr->LockLocked(dstHandle, lockMode, 0, 0, mBuffMgr->GetWidth(dstHandle), mBuffMgr->GetHeight(dstHandle), &tmpDstPtr);
+            tmpDstPtr = beginCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_DUMP, true, &dstMapped);
             ALOGD("data tmpDstPtr ptr = %p, width=%d, height=%d", tmpDstPtr, mBuffMgr->GetWidth(dstHandle), mBuffMgr->GetHeight(dstHandle));
             std::memcpy(tmpDstPtr, tmpSrcPtr, srcDatasize);
              writeData2File(file2.c_str(), tmpDstPtr, srcDatasize);
-            mBuffMgr->UnlockLocked(dstHandle);
-            mBuffMgr->Unlock(srcHandle);
+            endCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_DUMP, true, dstMapped);
+            endCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_DUMP, false, srcMapped);
             ALOGD("%s end", __FUNCTION__);
             return 0;
     }
@@ -404,13 +564,13 @@ int RTSidebandWindow::buffDataTransfer2(buffer_handle_t srcHandle, buffer_handle
     if (srcHandle && dstHandle) {
         unsigned char* tmpSrcPtr = NULL;
         unsigned char* tmpDstPtr = NULL;
+        bool srcMapped = false, dstMapped = false;
         int srcDatasize = -1;
-        int lockMode = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_CAMERA_MASK;
-        mBuffMgr->Lock(srcHandle, lockMode, 0, 0, mBuffMgr->GetWidth(srcHandle), mBuffMgr->GetHeight(srcHandle), (void**)&tmpSrcPtr);
+        tmpSrcPtr = (unsigned char*)beginCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_CONVERT, false, &srcMapped);
         for (int i = 0; i < mBuffMgr->GetNumPlanes(srcHandle); i++) {
             srcDatasize += mBuffMgr->GetPlaneSize(srcHandle, i);
         }
-        mBuffMgr->LockLocked(dstHandle, lockMode, 0, 0, mBuffMgr->GetWidth(dstHandle), mBuffMgr->GetHeight(dstHandle), (void**)&tmpDstPtr);
+        tmpDstPtr = (unsigned char*)beginCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_CONVERT, true, &dstMapped);
         int dstDatesize = -1;
         for (int i = 0; i < mBuffMgr->GetNumPlanes(dstHandle); i++) {
             dstDatesize += mBuffMgr->GetPlaneSize(dstHandle, i);
@@ -419,8 +579,8 @@ int RTSidebandWindow::buffDataTransfer2(buffer_handle_t srcHandle, buffer_handle
 
         std::memcpy(tmpDstPtr, tmpSrcPtr, dstDatesize);
 
-        mBuffMgr->UnlockLocked(dstHandle);
-        mBuffMgr->Unlock(srcHandle);
+        endCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_CONVERT, true, dstMapped);
+        endCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_CONVERT, false, srcMapped);
 
         return 0;
     }
@@ -432,15 +592,15 @@ int RTSidebandWindow::NV24ToNV12(buffer_handle_t srcHandle, buffer_handle_t dstH
         //void *tmpSrcPtr = NULL, *tmpDstPtr = NULL;
         unsigned char* tmpSrcPtr = NULL;
         unsigned char* tmpDstPtr = NULL;
-        int srcDatasize = -1;
-        int lockMode = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_CAMERA_MASK;
+        bool srcMapped = false, dstMapped = false;
         //DEBUG_PRINT(3, "%d %d", mBuffMgr->GetHandleBufferSize(srcHandle), mBuffMgr->GetHandleBufferSize(dstHandle));
-        mBuffMgr->Lock(srcHandle, lockMode, 0, 0, mBuffMgr->GetWidth(srcHandle), mBuffMgr->GetHeight(srcHandle), (void**)&tmpSrcPtr);
-        for (int i = 0; i < mBuffMgr->GetNumPlanes(srcHandle); i++) {
-            srcDatasize += mBuffMgr->GetPlaneSize(srcHandle, i);
-        }
-        //ALOGD("data tmpSrcPtr ptr = %p, srcDatasize=%d", tmpSrcPtr, srcDatasize);
-        mBuffMgr->LockLocked(dstHandle, lockMode, 0, 0, mBuffMgr->GetWidth(dstHandle), mBuffMgr->GetHeight(dstHandle), (void**)&tmpDstPtr);
+        // only sync the bytes touched: nv24 is a luma plane and a double
+        // width chroma plane, the nv12 output a luma plane and half of it
+        size_t srcLength = (size_t)mBuffMgr->GetPlaneStride(srcHandle, 0) * height * 3;
+        size_t dstLength = (size_t)mBuffMgr->GetPlaneStride(dstHandle, 0) * height * 3 / 2;
+        tmpSrcPtr = (unsigned char*)beginCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_CONVERT, false, &srcMapped, srcLength);
+        //ALOGD("data tmpSrcPtr ptr = %p", tmpSrcPtr);
+        tmpDstPtr = (unsigned char*)beginCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_CONVERT, true, &dstMapped, dstLength);
         //ALOGD("data tmpDstPtr ptr = %p, width=%d, height=%d", tmpDstPtr, mBuffMgr->GetWidth(dstHandle), mBuffMgr->GetHeight(dstHandle));
 
         int i,j;
@@ -452,16 +612,18 @@ int RTSidebandWindow::NV24ToNV12(buffer_handle_t srcHandle, buffer_handle_t dstH
         //ALOGD("==============start================%dX%d, %dX%d", width_uv_out, height_uv_out, width, height);
         std::memcpy(tmpDstPtr, tmpSrcPtr, width*height);
 
+        // every other uv pair of every other row, a 16 bit copy per pair lets
+        // the compiler vectorise what was a memcpy call per pixel
         for(i = 0; i < height_uv_out; i++) {
+            const uint16_t* srcUv = (const uint16_t*)(tmpSrcPtr + uIn + i*4*width);
+            uint16_t* dstUv = (uint16_t*)(tmpDstPtr + uOut + i*width);
             for(j = 0; j < width_uv_out; j++) {
-                int dstPos = uOut + i*width + j*2;
-                int srcPos = uIn + i*4*width + j*4;
-                std::memcpy(tmpDstPtr+dstPos, tmpSrcPtr+srcPos, 2);
+                dstUv[j] = srcUv[j*2];
             }
         }
 
-        mBuffMgr->UnlockLocked(dstHandle);
-        mBuffMgr->Unlock(srcHandle);
+        endCpuAccess(dstHandle, common::CPU_ACCESS_WRITE, common::CACHE_SYNC_CONVERT, true, dstMapped, dstLength);
+        endCpuAccess(srcHandle, common::CPU_ACCESS_READ, common::CACHE_SYNC_CONVERT, false, srcMapped, srcLength);
         //ALOGD("==============end================");
 
         return 0;
@@ -501,6 +663,7 @@ int RTSidebandWindow::dumpImage(buffer_handle_t handle, char* fileName, int mode
     fp = fopen(fileName, "wb+");
     if (fp != NULL) {
         struct android_ycbcr ycbrData;
+        bool persistent = false;
         int lockMode = GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_HW_CAMERA_MASK;
         if (mode == 1) {
             mBuffMgr->LockYCbCr(handle, lockMode, 0, 0, mBuffMgr->GetWidth(handle), mBuffMgr->GetHeight(handle), &ycbrData);
@@ -508,7 +671,7 @@ int RTSidebandWindow::dumpImage(buffer_handle_t handle, char* fileName, int mode
         } else {
             ALOGD("width = %d", mBuffMgr->GetWidth(handle));
             ALOGD("height = %d", mBuffMgr->GetHeight(handle));
-            mBuffMgr->LockLocked(handle, lockMode, 0, 0, mBuffMgr->GetWidth(handle), mBuffMgr->GetHeight(handle), &dataPtr);
+            dataPtr = beginCpuAccess(handle, common::CPU_ACCESS_READ, common::CACHE_SYNC_DUMP, true, &persistent);
         }
         ALOGD("planesNum = %d", mBuffMgr->GetNumPlanes(handle));
         for (int i = 0; i < mBuffMgr->GetNumPlanes(handle); i++) {
@@ -526,7 +689,7 @@ int RTSidebandWindow::dumpImage(buffer_handle_t handle, char* fileName, int mode
         }
         fclose(fp);
 	if (mode == 0) {
-            mBuffMgr->UnlockLocked(handle);
+            endCpuAccess(handle, common::CPU_ACCESS_READ, common::CACHE_SYNC_DUMP, true, persistent);
         } else {
             mBuffMgr->Unlock(handle);
         }
@@ -92,10 +92,27 @@ class RTSidebandWindow : public RefBase, IMessageHandler {
     status_t remainBuffer(buffer_handle_t buffer);
     status_t dequeueBuffer(buffer_handle_t *buffer);
     status_t queueBuffer(buffer_handle_t buffer);
+    status_t prefetchBuffer(int count);
+    status_t prefetchBuffer(int32_t width, int32_t height, int32_t format, int count);
+    status_t prefetchInternalHandle(int32_t width, int32_t height, int32_t format,
+            uint64_t usage, int count, common::BufferPurpose purpose);
+    void dumpBufferPoolStats();
+    void trimBufferPool();
+    // drops only pooled buffers of this geometry
+    void trimBufferPool(int32_t width, int32_t height, int32_t format);
+    void dumpCacheSyncStats();
+    int64_t getMemoryHeadroom();
+    void dumpMemoryStats(std::string* out);
+    status_t allocateInternalHandle(buffer_handle_t *handle,
+            int32_t width, int32_t height, int32_t format, uint64_t usage,
+            common::BufferPurpose purpose);
     status_t allocateSidebandHandle(buffer_handle_t *handle, int32_t width, int32_t height,
-        int32_t format, uint64_t usage);
+        int32_t format, uint64_t usage, common::BufferPurpose purpose);
     int getBufferHandleFd(buffer_handle_t buffer);
     int getBufferLength(buffer_handle_t buffer);
+    int getBufferPlaneFd(buffer_handle_t buffer, int plane);
+    int getBufferFormat(buffer_handle_t buffer);
+    int getBufferStride(buffer_handle_t buffer, int plane);
 
     status_t setBufferGeometry(int32_t width, int32_t height, int32_t format);
     status_t setCrop(int32_t left, int32_t top, int32_t right, int32_t bottom);
@@ -111,12 +128,22 @@ class RTSidebandWindow : public RefBase, IMessageHandler {
     int NV24ToNV12(buffer_handle_t srcHandle, buffer_handle_t dstHandle, int width, int height);
     status_t show(buffer_handle_t buffer, int displayRadio);
     status_t clearVopArea();
+    status_t matchDisplayFrameRate(int fps);
+    status_t restoreDisplayMode();
     void setDebugLevel(int debugLevel);
 
  private:
     RTSidebandWindow(const RTSidebandWindow& other);
     RTSidebandWindow& operator=(const RTSidebandWindow& other);
     int writeData2File(const char *fileName, void *data, int dataSize);
+    // cpu pointer to |handle| through the manager's persistent mapping, or a
+    // gralloc lock (LockLocked for |imported| handles) when it has none.
+    // |length| bytes from the start are synced on the mapping, 0 for all;
+    // the gralloc lock does its own cache maintenance
+    void* beginCpuAccess(buffer_handle_t handle, uint32_t access,
+            common::CacheSyncStage stage, bool imported, bool* persistent, size_t length = 0);
+    void endCpuAccess(buffer_handle_t handle, uint32_t access,
+            common::CacheSyncStage stage, bool imported, bool persistent, size_t length = 0);
 
     virtual void messageThreadLoop();
     virtual status_t requestExitAndWait();
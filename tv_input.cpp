@@ -5,6 +5,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <memory>
+#include <deque>
 
 #include <cutils/native_handle.h>
 #include <log/log.h>
@@ -21,6 +23,8 @@
 #include "TvDeviceV4L2Event.h"
 #include "HinDev.h"
 #include "Utils.h"
+#include "CaptureResultRing.h"
+#include "ControlQueue.h"
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -34,6 +38,8 @@ using namespace android;
 
 #define STREAM_ID_GENERIC       1
 #define STREAM_ID_FRAME_CAPTURE 2
+// downscaled producer streams, one per entry of s_ScaledPreviewHeights
+#define STREAM_ID_SCALED_BASE   16
 
 // tv input source type
 typedef enum tv_input_source_type {
@@ -64,10 +70,24 @@ typedef struct tv_input_request_info {
 
 static tv_input_private_t *s_TvInputPriv;
 static tv_input_request_info_t requestInfo;
+// optional shared memory channel for capture results, see "result_ring"
+static tvinput::CaptureResultRing* s_ResultRing = NULL;
+static Mutex s_ResultRingLock;
+// results that found the ring full, published before any newer one
+static std::deque<tvinput::capture_result_entry_t> s_ResultBacklog;
 static int s_HinDevStreamWidth = 1280;
 static int s_HinDevStreamHeight = 720;
 static int s_HinDevStreamFormat = DEFAULT_TVHAL_STREAM_FORMAT;
 static int s_HinDevStreamInterlaced = 0;
+// stream start/stop run here when TV_INPUT_ASYNC_CONTROL is on
+static tvinput::ControlQueue* s_ControlQueue = NULL;
+// TV_INPUT_ASYNC_CONTROL as read when the device was opened
+static bool s_AsyncControl = false;
+// owns s_TvInputPriv->mDev, queued start/stop jobs hold their own reference
+static std::shared_ptr<HinDevImpl> s_HinDev;
+// held across start(), stop() and reconfigure() so they never overlap, and
+// while the device is handed over or dropped
+static Mutex s_StreamControlLock;
 //static unsigned int gHinDevOpened = 0;
 //static Mutex gHinDevOpenLock;
 //static HinDevImpl* gHinHals[MAX_HIN_DEVICE_SUPPORTED];
@@ -95,9 +115,12 @@ tv_input_module_t HAL_MODULE_INFO_SYM = {
     }
 };
 
+static void notifyStreamState(const char* action);
+
 V4L2EventCallBack hinDevEventCallback(int event_type) {
     ALOGD("%s event type: %d", __FUNCTION__,event_type);
     bool isHdmiIn;
+    bool streamError = false;
     tv_input_event_t event;
     if (s_TvInputPriv && !s_TvInputPriv->isOpened) {
        ALOGE("%s The device is not open ", __FUNCTION__);
@@ -120,12 +143,37 @@ V4L2EventCallBack hinDevEventCallback(int event_type) {
             }
         }
              break;
-        case V4L2_EVENT_SOURCE_CHANGE:
+        case V4L2_EVENT_SOURCE_CHANGE: {
+             Mutex::Autolock controlLock(s_StreamControlLock);
+             if (!s_TvInputPriv->mDev) {
+                 return 0;
+             }
+             // start/stop hold the lock too; one still queued sets the
+             // device up again anyway, leave it to that one
+             if (s_TvInputPriv->isInitialized
+                     && !(s_ControlQueue && s_ControlQueue->IsBusy())
+                     && s_TvInputPriv->mStreamType == TV_STREAM_TYPE_INDEPENDENT_VIDEO_SOURCE
+                     && property_get_int32(TV_INPUT_FAST_SWITCH, 1) == 1) {
+                 int ret = s_TvInputPriv->mDev->reconfigure();
+                 if (ret == NO_ERROR) {
+                     // the sideband stream carries on at the new timing, the
+                     // framework keeps its stream open
+                     s_TvInputPriv->mDev->get_current_sourcesize(s_HinDevStreamWidth, s_HinDevStreamHeight, s_HinDevStreamFormat);
+                     s_HinDevStreamInterlaced = s_TvInputPriv->mDev->check_interlaced();
+                     ALOGD("%s reconfigured in place %dx%d", __FUNCTION__, s_HinDevStreamWidth, s_HinDevStreamHeight);
+                     return 0;
+                 } else if (ret != INVALID_OPERATION) {
+                     // the stream is stopped now, the configuration change
+                     // below lets the framework reopen it
+                     streamError = true;
+                 }
+             }
              isHdmiIn = s_TvInputPriv->mDev->get_current_sourcesize(s_HinDevStreamWidth, s_HinDevStreamHeight,s_HinDevStreamFormat);
              s_HinDevStreamInterlaced = s_TvInputPriv->mDev->check_interlaced();
              ALOGD("s_HinDevStreamInterlaced %d ", s_HinDevStreamInterlaced);
              event.type = TV_INPUT_EVENT_STREAM_CONFIGURATIONS_CHANGED;
              break;
+        }
         case RK_HDMIRX_V4L2_EVENT_SIGNAL_LOST:
              if (s_TvInputPriv->mDev) {
              std::map<std::string, std::string> data;
@@ -135,6 +183,9 @@ V4L2EventCallBack hinDevEventCallback(int event_type) {
              }
              break;
     }
+    if (streamError) {
+        notifyStreamState("streamerror");
+    }
     ALOGE("%s width:%d,height:%d,format:0x%x,%d", __FUNCTION__,s_HinDevStreamWidth,s_HinDevStreamHeight,s_HinDevStreamFormat,isHdmiIn);
     event.device_info.device_id = SOURCE_HDMI1;
     event.device_info.type = TV_INPUT_TYPE_HDMI;
@@ -171,20 +222,35 @@ static int hin_dev_open(int deviceId, int type)
             return -EINVAL;
         }
         if (!s_TvInputPriv->mDev) {
+            // the previous stream may still be stopping on the same node
+            if (s_ControlQueue) {
+                s_ControlQueue->WaitIdle();
+            }
             hinDevImpl = new HinDevImpl;
             if (!hinDevImpl) {
                 ALOGE("no memory to new hinDevImpl");
                 return -ENOMEM;
             }
-            s_TvInputPriv->mDev = hinDevImpl;
+            {
+                Mutex::Autolock controlLock(s_StreamControlLock);
+                s_HinDev.reset(hinDevImpl);
+                s_TvInputPriv->mDev = hinDevImpl;
+            }
+            // one mode per open, the close must match how the open started
+            s_AsyncControl = s_ControlQueue && property_get_int32(TV_INPUT_ASYNC_CONTROL, 1) == 1;
             s_TvInputPriv->mDev->set_data_callback((V4L2EventCallBack)hinDevEventCallback);
             if (s_TvInputPriv->mDev->findDevice(deviceId, s_HinDevStreamWidth, s_HinDevStreamHeight,s_HinDevStreamFormat)!= 0) {
                 ALOGE("hinDevImpl->findDevice %d failed!", deviceId);
-                delete s_TvInputPriv->mDev;
-	        s_TvInputPriv->mDev = nullptr;
+                std::shared_ptr<HinDevImpl> hinDev;
+                {
+                    Mutex::Autolock controlLock(s_StreamControlLock);
+                    hinDev.swap(s_HinDev);
+                    s_TvInputPriv->mDev = nullptr;
+                }
                 return -1;
             }
             ALOGD("hinDevImpl->findDevice %d ,%d,0x%x,0x%x!", s_HinDevStreamWidth,s_HinDevStreamHeight,s_HinDevStreamFormat,DEFAULT_V4L2_STREAM_FORMAT);
+            s_TvInputPriv->mDev->prewarm();
             s_TvInputPriv->mDev->set_interlaced(s_HinDevStreamInterlaced);
             s_TvInputPriv->isOpened = true;
         }
@@ -219,6 +285,28 @@ static int generateEvent(tv_input_private_t *priv, tv_input_source_t source_type
 }
 
 
+/**
+ * Tells the app how a queued open/close went: "streamready" once capture runs,
+ * "streamerror" when a start or stop failed.
+ * */
+static void notifyStreamState(const char* action) {
+    if (!s_TvInputPriv || !s_TvInputPriv->callback) {
+        return;
+    }
+    tv_input_event_t event;
+    event.type = TV_INPUT_EVENT_PRIV_CMD_TO_APP;
+    event.priv_app_cmd.action = action;
+    event.device_info.device_id = requestInfo.deviceId;
+    event.device_info.type = TV_INPUT_TYPE_HDMI;
+    event.device_info.audio_type = AUDIO_DEVICE_NONE;
+    event.device_info.audio_address = NULL;
+    s_TvInputPriv->callback->notify(nullptr, &event, nullptr);
+}
+
+static bool asyncControl() {
+    return s_ControlQueue && s_AsyncControl;
+}
+
 /**
  * List all of the devices, may register hotplug listener here.
  * */
@@ -230,7 +318,36 @@ void findTvDevices(tv_input_private_t *priv) {
 }
 
 #define NUM_OF_CONFIGS_DEFAULT 2
-static tv_stream_config_t mconfig[NUM_OF_CONFIGS_DEFAULT];
+static const int s_ScaledPreviewHeights[] = {1080, 720, 360};
+#define NUM_OF_SCALED_CONFIGS (int)(sizeof(s_ScaledPreviewHeights) / sizeof(s_ScaledPreviewHeights[0]))
+#define NUM_OF_CONFIGS_MAX (NUM_OF_CONFIGS_DEFAULT + NUM_OF_SCALED_CONFIGS)
+static tv_stream_config_t mconfig[NUM_OF_CONFIGS_MAX];
+static int s_NumOfConfigs = 0;
+
+/**
+ * Producer configs below the source resolution, same aspect ratio, filled by
+ * one rga scale per frame so small preview windows don't get 4k buffers.
+ * */
+static int addScaledStreamConfigs(int index) {
+    if (s_HinDevStreamWidth <= 0 || s_HinDevStreamHeight <= 0) {
+        return index;
+    }
+    for (int i = 0; i < NUM_OF_SCALED_CONFIGS; i++) {
+        int height = s_ScaledPreviewHeights[i];
+        if (height >= s_HinDevStreamHeight) {
+            continue;
+        }
+        int width = (s_HinDevStreamWidth * height / s_HinDevStreamHeight) & ~0xf;
+        mconfig[index] = mconfig[0];
+        mconfig[index].stream_id = STREAM_ID_SCALED_BASE + i;
+        mconfig[index].max_video_width = width;
+        mconfig[index].max_video_height = height;
+        mconfig[index].width = width;
+        mconfig[index].height = height;
+        index++;
+    }
+    return index;
+}
 static native_handle_t* out_buffer;
 
 static int tv_input_get_stream_configurations(
@@ -240,6 +357,13 @@ static int tv_input_get_stream_configurations(
     UNUSED(dev);
     if (device_id == -1) {
         *num_of_configs = -1;
+    }
+    if (s_NumOfConfigs > 0 && s_ControlQueue && s_ControlQueue->IsBusy()) {
+        // mid-switch, answer from the last query instead of waiting for the device
+        *num_of_configs = s_NumOfConfigs;
+        *configs = mconfig;
+        ALOGD("%s cached %d configs while the stream switches", __func__, s_NumOfConfigs);
+        return 0;
     }
 	if (hin_dev_open(device_id, 0) < 0) {
 		ALOGD("Open hdmi failed!!!\n");
@@ -266,10 +390,11 @@ static int tv_input_get_stream_configurations(
         mconfig[1].max_video_height = s_HinDevStreamHeight;
         mconfig[1].format = s_HinDevStreamFormat;//DEFAULT_TVHAL_STREAM_FORMAT;
         mconfig[1].width = s_HinDevStreamWidth;
-        mconfig[1].height = s_HinDevStreamWidth;
+        mconfig[1].height = s_HinDevStreamHeight;
         mconfig[1].usage = STREAM_BUFFER_GRALLOC_USAGE;
         mconfig[1].buffCount = APP_PREVIEW_BUFF_CNT;
-        *num_of_configs = NUM_OF_CONFIGS_DEFAULT;
+        s_NumOfConfigs = addScaledStreamConfigs(NUM_OF_CONFIGS_DEFAULT);
+        *num_of_configs = s_NumOfConfigs;
         *configs = mconfig;
         ALOGE("config %d ,%d,0x%x,0x%x!", s_HinDevStreamWidth,s_HinDevStreamHeight,s_HinDevStreamFormat,DEFAULT_V4L2_STREAM_FORMAT);
         break;
@@ -298,6 +423,16 @@ static int tv_input_open_stream(struct tv_input_device *dev, int device_id, tv_s
 
             if(s_TvInputPriv->mDev->set_format(width, height, s_HinDevStreamFormat))
                 return -EINVAL;
+            int scaleWidth = 0, scaleHeight = 0;
+            for (int i = NUM_OF_CONFIGS_DEFAULT; i < s_NumOfConfigs; i++) {
+                if (mconfig[i].stream_id == stream->stream_id) {
+                    scaleWidth = mconfig[i].width;
+                    scaleHeight = mconfig[i].height;
+                    break;
+                }
+            }
+            if (s_TvInputPriv->mDev->set_preview_scale(scaleWidth, scaleHeight))
+                return -EINVAL;
             int dst_width = 0, dst_height = 0;
             bool use_zme = s_TvInputPriv->mDev->check_zme(width, height, &dst_width, &dst_height);
             if(use_zme) {
@@ -310,7 +445,24 @@ static int tv_input_open_stream(struct tv_input_device *dev, int device_id, tv_s
                 stream->sideband_stream_source_handle = native_handle_clone(s_TvInputPriv->mDev->getSindebandBufferHandle());
                 out_buffer = stream->sideband_stream_source_handle;
             }
-            s_TvInputPriv->mDev->start();
+            if (!asyncControl()) {
+                Mutex::Autolock controlLock(s_StreamControlLock);
+                s_TvInputPriv->mDev->start();
+                return 0;
+            }
+            // the sideband handle is already out, capture comes up behind it
+            std::shared_ptr<HinDevImpl> hinDev = s_HinDev;
+            s_ControlQueue->Post("start", [hinDev]() {
+                int ret = NO_ERROR;
+                {
+                    Mutex::Autolock controlLock(s_StreamControlLock);
+                    ret = hinDev->start();
+                }
+                if (ret != NO_ERROR) {
+                    ALOGE("start failed: %d", ret);
+                }
+                notifyStreamState(ret == NO_ERROR ? "streamready" : "streamerror");
+            });
         }
         return 0;
     }
@@ -328,35 +480,174 @@ static int tv_input_close_stream(struct tv_input_device *dev, int device_id, int
                 out_buffer=NULL;
             }
 
-            s_TvInputPriv->mDev->stop();
-            s_TvInputPriv->isInitialized = false;
-            s_TvInputPriv->isOpened = false;
-            s_TvInputPriv->mDev = nullptr;
+            {
+                Mutex::Autolock autoLock(s_ResultRingLock);
+                delete s_ResultRing;
+                s_ResultRing = NULL;
+                s_ResultBacklog.clear();
+            }
+            // nothing new reaches the device once it is handed over
+            std::shared_ptr<HinDevImpl> hinDev;
+            {
+                Mutex::Autolock controlLock(s_StreamControlLock);
+                hinDev.swap(s_HinDev);
+                s_TvInputPriv->isInitialized = false;
+                s_TvInputPriv->isOpened = false;
+                s_TvInputPriv->mDev = nullptr;
+            }
+            if (asyncControl()) {
+                // a start that has not run yet has nothing left to do, the
+                // stop fails the captures it would have replayed
+                s_ControlQueue->Cancel("start");
+                // the job owns the device from here, the next open waits for it
+                s_ControlQueue->Post("stop", [hinDev]() {
+                    int ret = NO_ERROR;
+                    {
+                        Mutex::Autolock controlLock(s_StreamControlLock);
+                        ret = hinDev->stop();
+                    }
+                    if (ret == TIMED_OUT) {
+                        // stuck threads still use it, leaked on purpose
+                        new std::shared_ptr<HinDevImpl>(hinDev);
+                    }
+                    if (ret != NO_ERROR) {
+                        ALOGE("stop failed: %d", ret);
+                        notifyStreamState("streamerror");
+                    }
+                });
+            } else {
+                int ret = NO_ERROR;
+                {
+                    Mutex::Autolock controlLock(s_StreamControlLock);
+                    ret = hinDev->stop();
+                }
+                if (ret == TIMED_OUT) {
+                    // stuck threads still use it, leaked on purpose
+                    new std::shared_ptr<HinDevImpl>(hinDev);
+                }
+            }
             return 0;
         }
     }
     return -EINVAL;
 }
 
-NotifyQueueDataCallback dataCallback(tv_input_capture_result_t result) {
-    ALOGV("%s req:%u ,%u in result.buff_id=%" PRIu64, __FUNCTION__,requestInfo.seq,result.seq, result.buff_id);
+static void notifyCaptureResult(uint64_t buff_id, buffer_handle_t buffer, uint32_t seq) {
     tv_input_event_t event;
     event.capture_result.device_id = requestInfo.deviceId;
     event.capture_result.stream_id = requestInfo.streamId;
-    event.capture_result.seq = requestInfo.seq++;
-    if (result.buff_id != -1) {
+    event.capture_result.seq = seq;
+    if (buff_id != (uint64_t)-1) {
         event.type = TV_INPUT_EVENT_CAPTURE_SUCCEEDED;
-        event.capture_result.buff_id = result.buff_id;
-        event.capture_result.buffer = result.buffer;
+        event.capture_result.buff_id = buff_id;
+        event.capture_result.buffer = buffer;
     } else {
         event.type = TV_INPUT_EVENT_CAPTURE_FAILED;
     }
     s_TvInputPriv->callback->notify(nullptr, &event, nullptr);
+}
+
+// moves held back results into the ring, oldest first, s_ResultRingLock held
+static void drainResultBacklogLocked() {
+    while (!s_ResultBacklog.empty() && s_ResultRing->Push(s_ResultBacklog.front())) {
+        s_ResultBacklog.pop_front();
+    }
+}
+
+NotifyQueueDataCallback dataCallback(tv_input_capture_result_t result) {
+    ALOGV("%s req:%u ,%u in result.buff_id=%" PRIu64, __FUNCTION__,requestInfo.seq,result.seq, result.buff_id);
+    {
+        Mutex::Autolock autoLock(s_ResultRingLock);
+        if (s_ResultRing) {
+            tvinput::capture_result_entry_t entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.buff_id = result.buff_id;
+            entry.seq = requestInfo.seq++;
+            entry.stream_id = requestInfo.streamId;
+            entry.timestamp_ns = systemTime(SYSTEM_TIME_MONOTONIC);
+            entry.acquire_fence = -1;
+            entry.status = result.buff_id != (uint64_t)-1 ? 0 : -1;
+            drainResultBacklogLocked();
+            // ring full: hold it back rather than send an event that would
+            // overtake the results still in the ring. Only requested buffers
+            // produce results, so the backlog is bounded by the app's buffers.
+            if (!s_ResultBacklog.empty() || !s_ResultRing->Push(entry)) {
+                s_ResultBacklog.push_back(entry);
+            }
+            return 0;
+        }
+    }
+    notifyCaptureResult(result.buff_id, result.buffer, requestInfo.seq++);
+    return 0;
+}
+
+static void sendResultRingHandle(const native_handle_t* handle) {
+    tv_input_event_t event;
+    event.type = TV_INPUT_EVENT_CAPTURE_SUCCEEDED;
+    event.capture_result.device_id = requestInfo.deviceId;
+    event.capture_result.stream_id = requestInfo.streamId;
+    event.capture_result.seq = 0;
+    event.capture_result.buff_id = CAPTURE_RESULT_RING_BUFF_ID;
+    event.capture_result.buffer = handle;
+    s_TvInputPriv->callback->notify(nullptr, &event, nullptr);
+}
+
+/**
+ * "result_ring" with enable=1 switches capture results of the producer stream
+ * to a shared memory ring. The ring handle (region fd, eventfd) is sent once as
+ * a capture result with buff_id CAPTURE_RESULT_RING_BUFF_ID; clients that never
+ * ask for it keep getting one event per frame. While the ring is on, failed
+ * captures are entries with a nonzero status so they stay in order too.
+ * */
+static int handleResultRingCmd(const std::map<std::string, std::string>& data) {
+    auto it = data.find("enable");
+    bool enable = it != data.end() && it->second.compare("1") == 0;
+    if (!enable) {
+        std::deque<tvinput::capture_result_entry_t> backlog;
+        {
+            Mutex::Autolock autoLock(s_ResultRingLock);
+            delete s_ResultRing;
+            s_ResultRing = NULL;
+            backlog.swap(s_ResultBacklog);
+        }
+        // results never published in the ring still owe the app its buffers
+        for (const auto& entry : backlog) {
+            notifyCaptureResult(entry.status == 0 ? entry.buff_id : (uint64_t)-1,
+                    nullptr, entry.seq);
+        }
+        return 0;
+    }
+    native_handle_t* handle = NULL;
+    {
+        Mutex::Autolock autoLock(s_ResultRingLock);
+        if (!s_ResultRing) {
+            tvinput::CaptureResultRing* ring = new tvinput::CaptureResultRing();
+            if (ring->Init() != 0) {
+                delete ring;
+                return -ENOMEM;
+            }
+            s_ResultRing = ring;
+        }
+        // the ring may go away once unlocked, notify with our own fds
+        handle = native_handle_clone(s_ResultRing->GetHandle());
+    }
+    if (!handle) {
+        return -ENOMEM;
+    }
+    sendResultRingHandle(handle);
+    native_handle_close(handle);
+    native_handle_delete(handle);
     return 0;
 }
 
 static int tv_input_priv_cmd_from_app(const std::string action, const std::map<std::string, std::string> data) {
     ALOGV("%s called", __func__);
+    if (action.compare("result_ring") == 0) {
+        if (!s_TvInputPriv || !s_TvInputPriv->callback) {
+            return -EINVAL;
+        }
+        return handleResultRingCmd(data);
+    }
     if (s_TvInputPriv && s_TvInputPriv->isInitialized && s_TvInputPriv->mDev) {
         s_TvInputPriv->mDev->deal_priv_message(action, data);
         return 0;
@@ -370,6 +661,13 @@ static int tv_input_request_capture(struct tv_input_device* dev, int device_id,
     if (s_TvInputPriv && s_TvInputPriv->isInitialized && s_TvInputPriv->mDev && buffer != nullptr) {
         //requestInfo.seq = seq;
         s_TvInputPriv->mDev->set_preview_callback((NotifyQueueDataCallback)dataCallback);
+        {
+            // the client requeues after reading the ring, room for held results
+            Mutex::Autolock autoLock(s_ResultRingLock);
+            if (s_ResultRing) {
+                drainResultBacklogLocked();
+            }
+        }
         s_TvInputPriv->mDev->request_capture(buffer, buff_id);
         return 0;
     }
@@ -387,6 +685,11 @@ static int tv_input_set_preview_info(int32_t deviceId, int32_t streamId,
             int32_t top, int32_t left, int32_t width, int32_t height, int32_t extInfo)
 {
     ALOGD("%s device id %d,called,%p", __func__,deviceId,s_TvInputPriv->mDev);
+    if (s_TvInputPriv && !s_TvInputPriv->mDev && s_NumOfConfigs > 0) {
+        // configurations came from the cache while the last stream was
+        // closing, open the device now that it is gone
+        hin_dev_open(deviceId, 0);
+    }
     if (s_TvInputPriv && s_TvInputPriv->mDev && !s_TvInputPriv->isInitialized) {
         if (s_TvInputPriv->mDev->init(deviceId, extInfo)!= 0) {
             ALOGE("hinDevImpl->init %d failed!", deviceId);
@@ -418,11 +721,19 @@ static int tv_input_set_preview_buffer(buffer_handle_t rawHandle, uint64_t buffe
 static int tv_input_device_close(struct hw_device_t *dev)
 {
     ALOGD("%s called", __func__);
+    if (s_ControlQueue) {
+        // finishes a queued start/stop before the device goes away
+        delete s_ControlQueue;
+        s_ControlQueue = NULL;
+    }
     if (s_TvInputPriv) {
-        if (s_TvInputPriv->mDev) {
-            delete s_TvInputPriv->mDev;
+        std::shared_ptr<HinDevImpl> hinDev;
+        {
+            Mutex::Autolock controlLock(s_StreamControlLock);
+            hinDev.swap(s_HinDev);
             s_TvInputPriv->mDev = nullptr;
         }
+        hinDev.reset();
         s_TvInputPriv->isOpened = false;
         s_TvInputPriv->isInitialized = false;
         free(s_TvInputPriv);
@@ -479,6 +790,10 @@ static int tv_input_device_open(const struct hw_module_t* module,
         dev->device.request_capture = tv_input_request_capture;
         dev->device.cancel_capture = tv_input_cancel_capture;
 
+        if (!s_ControlQueue) {
+            s_ControlQueue = new tvinput::ControlQueue();
+        }
+
         *device = &dev->device.common;
         status = 0;
         ALOGD("%s end. name: %s %d", __FUNCTION__, name, status);